@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "lib/tweetnacl.h"
+#include "src/suite.h"
+#include "src/cryptofs.h"
+#include <fuse.h>
+
+// Benchmarks the block engine, driven through the crypto_file calls the
+// frontends sit on against a volume in a scratch directory, so nothing is
+// mounted, and the primitives blocks are sealed with. Every line after the
+// header is one case, tab separated:
+//
+//   case size align pattern ops mb_s ops_s cycles_byte p50_us p99_us
+//
+// Engine cases read and write a file of -s MiB. Requests start on a block
+// boundary (aligned), 256 bytes short of one so they straddle it
+// (straddle), or at the end of the file (tail: writes append, reads take
+// its last bytes). Sequential requests go front to back a block apart at
+// most, random ones anywhere in the file. Writes finish with a flush,
+// which counts towards the rate but not the latencies. cycles_byte comes
+// from the time stamp counter, nan where there is none.
+
+#define BENCH_STRADDLE 256
+
+static const size_t io_sizes[]   = { 512, 4096, 65536, 1 << 20 };
+static const size_t prim_sizes[] = { 64, 1024, 4056, 65496 };
+
+static size_t file_mb   = 64;
+static size_t budget_mb = 64;       // bytes a case moves, at most
+static size_t max_ops   = 10000;
+static const char *only = NULL;     // run only cases whose name has this in it
+
+static uint64_t _bench_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t _bench_cycles(void){
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static uint64_t _bench_rand(void){
+  static uint64_t x = 88172645463325252ULL;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return x;
+}
+
+static int _bench_cmp(const void *a, const void *b){
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static size_t _bench_ops(size_t size){
+  size_t n = (budget_mb << 20) / size;
+  return n < 16 ? 16 : n > max_ops ? max_ops : n;
+}
+
+// A case being timed, lat holds the latency of each of its ops.
+struct bench {
+  const char *name;
+  size_t size;
+  const char *align;
+  const char *pattern;
+  size_t ops;
+  uint64_t *lat;
+  uint64_t start, cycles;
+};
+
+static int _bench_skip(const char *name){
+  return only != NULL && strstr(name, only) == NULL;
+}
+
+static void _bench_begin(struct bench *b, const char *name, size_t size, const char *align,
+                         const char *pattern, size_t ops){
+  b->name    = name;
+  b->size    = size;
+  b->align   = align;
+  b->pattern = pattern;
+  b->ops     = ops;
+  if((b->lat = malloc(ops * sizeof(*b->lat))) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  b->cycles = _bench_cycles();
+  b->start  = _bench_ns();
+}
+
+static void _bench_end(struct bench *b){
+  uint64_t ns = _bench_ns() - b->start;
+  uint64_t cycles = _bench_cycles() - b->cycles;
+  double bytes = (double) b->size * b->ops;
+
+  qsort(b->lat, b->ops, sizeof(*b->lat), _bench_cmp);
+  double p50 = b->lat[b->ops / 2] / 1e3;
+  double p99 = b->lat[(b->ops * 99) / 100] / 1e3;
+  double secs = ns / 1e9;
+  double cpb = cycles > 0 ? cycles / bytes : 0.0 / 0.0;
+
+  printf("%s\t%zu\t%s\t%s\t%zu\t%.1f\t%.0f\t%.2f\t%.1f\t%.1f\n", b->name, b->size, b->align,
+         b->pattern, b->ops, bytes / secs / 1e6, b->ops / secs, cpb, p50, p99);
+  fflush(stdout);
+  free(b->lat);
+}
+
+#define BENCH_OP(b, i, op) do { \
+    uint64_t t0 = _bench_ns(); \
+    op; \
+    (b)->lat[i] = _bench_ns() - t0; \
+  } while(0)
+
+static void _bench_primitives(void){
+  static unsigned char m[65536 + 64], c[65536 + 64], k[32], n[24], tag[16];
+  struct bench b;
+
+  memset(k, 0x42, sizeof(k));
+  memset(n, 0x24, sizeof(n));
+  for(size_t i = 0; i < sizeof(m); i++)
+    m[i] = i;
+
+  for(size_t s = 0; s < sizeof(prim_sizes) / sizeof(*prim_sizes); s++) {
+    size_t size = prim_sizes[s], ops = _bench_ops(size);
+
+    // secretbox wants its zero bytes in front of the message.
+    memset(m, 0, crypto_secretbox_ZEROBYTES);
+    if(!_bench_skip("secretbox")) {
+      _bench_begin(&b, "secretbox", size, "-", "-", ops);
+      for(size_t i = 0; i < ops; i++)
+        BENCH_OP(&b, i, crypto_secretbox(c, m, size + crypto_secretbox_ZEROBYTES, n, k));
+      _bench_end(&b);
+    }
+    if(!_bench_skip("secretbox_open")) {
+      crypto_secretbox(c, m, size + crypto_secretbox_ZEROBYTES, n, k);
+      _bench_begin(&b, "secretbox_open", size, "-", "-", ops);
+      for(size_t i = 0; i < ops; i++)
+        BENCH_OP(&b, i, crypto_secretbox_open(m, c, size + crypto_secretbox_ZEROBYTES, n, k));
+      _bench_end(&b);
+    }
+    if(!_bench_skip("stream_salsa20_xor")) {
+      _bench_begin(&b, "stream_salsa20_xor", size, "-", "-", ops);
+      for(size_t i = 0; i < ops; i++)
+        BENCH_OP(&b, i, crypto_stream_salsa20_xor(c, m, size, n, k));
+      _bench_end(&b);
+    }
+    if(!_bench_skip("onetimeauth")) {
+      _bench_begin(&b, "onetimeauth", size, "-", "-", ops);
+      for(size_t i = 0; i < ops; i++)
+        BENCH_OP(&b, i, crypto_onetimeauth(tag, m, size, k));
+      _bench_end(&b);
+    }
+
+    // The suites, the way the engine seals and opens blocks.
+    for(unsigned int id = 0; id < CRYPTO_SUITE_COUNT; id++) {
+      char seal[64], open[64];
+      snprintf(seal, sizeof(seal), "seal:%s", crypto_suite_name(id));
+      snprintf(open, sizeof(open), "open:%s", crypto_suite_name(id));
+      if(_bench_skip(seal) && _bench_skip(open))
+        continue;
+      crypto_suite_init(id, k);
+      if(!_bench_skip(seal)) {
+        _bench_begin(&b, seal, size, "-", "-", ops);
+        for(size_t i = 0; i < ops; i++)
+          BENCH_OP(&b, i, crypto_suite_seal(c, tag, m, size, n));
+        _bench_end(&b);
+      }
+      if(!_bench_skip(open)) {
+        crypto_suite_seal(c, tag, m, size, n);
+        _bench_begin(&b, open, size, "-", "-", ops);
+        for(size_t i = 0; i < ops; i++)
+          BENCH_OP(&b, i, crypto_suite_open(m, c, tag, size, n));
+        _bench_end(&b);
+      }
+      crypto_suite_destroy();
+    }
+  }
+}
+
+static void _bench_check(int res, size_t want, const char *what){
+  if(res < 0 || (size_t) res != want) {
+    fprintf(stderr, "%s: %s\n", what, res < 0 ? strerror(-res) : "short transfer");
+    exit(1);
+  }
+}
+
+// Where the i-th request of a case starts, next carrying the block the
+// sequential pattern goes on from.
+static off_t _bench_off(size_t payload, size_t size, int straddle, int seq, size_t *next){
+  size_t blocks = ((size_t) file_mb << 20) / payload;
+  size_t shift  = straddle ? payload - BENCH_STRADDLE : 0;
+  size_t span   = (shift + size + payload - 1) / payload;
+  size_t idx;
+
+  if(seq) {
+    if(*next + span > blocks)
+      *next = 0;
+    idx = *next;
+    *next += span;
+  } else {
+    idx = _bench_rand() % (blocks - span + 1);
+  }
+  return (off_t) (idx * payload + shift);
+}
+
+static void _bench_engine(int dirfd, size_t payload){
+  static const char *aligns[]   = { "aligned", "straddle" };
+  static const char *patterns[] = { "seq", "rand" };
+  struct crypto_file *cf;
+  struct bench b;
+  char *buf = malloc(1 << 20);
+  if(buf == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  for(size_t i = 0; i < 1 << 20; i++)
+    buf[i] = _bench_rand();
+
+  int err = crypto_file_open(dirfd, "bench", O_RDWR | O_CREAT | O_TRUNC, 0600, &cf);
+  if(err < 0) {
+    fprintf(stderr, "open: %s\n", strerror(-err));
+    exit(1);
+  }
+  for(off_t off = 0; off < (off_t) file_mb << 20; off += 1 << 20)
+    _bench_check(crypto_file_write(cf, buf, 1 << 20, off), 1 << 20, "fill");
+  _bench_check(crypto_file_flush(cf), 0, "flush");
+
+  for(size_t s = 0; s < sizeof(io_sizes) / sizeof(*io_sizes); s++) {
+    size_t size = io_sizes[s], ops = _bench_ops(size);
+    if(size + payload > (size_t) file_mb << 20)
+      continue;
+
+    for(int a = 0; a < 2; a++) {
+      for(int p = 0; p < 2; p++) {
+        size_t next = 0;
+        if(!_bench_skip("write")) {
+          _bench_begin(&b, "write", size, aligns[a], patterns[p], ops);
+          for(size_t i = 0; i < ops; i++) {
+            off_t off = _bench_off(payload, size, a, p == 0, &next);
+            BENCH_OP(&b, i, err = crypto_file_write(cf, buf, size, off));
+            _bench_check(err, size, "write");
+          }
+          _bench_check(crypto_file_flush(cf), 0, "flush");
+          _bench_end(&b);
+        }
+
+        next = 0;
+        if(!_bench_skip("read")) {
+          _bench_begin(&b, "read", size, aligns[a], patterns[p], ops);
+          for(size_t i = 0; i < ops; i++) {
+            off_t off = _bench_off(payload, size, a, p == 0, &next);
+            BENCH_OP(&b, i, err = crypto_file_read(cf, buf, size, off));
+            _bench_check(err, size, "read");
+          }
+          _bench_end(&b);
+        }
+      }
+    }
+
+    // Appending keeps resealing the partial block at the end of the file.
+    if(!_bench_skip("write")) {
+      _bench_check(crypto_file_truncate(cf, payload / 2), 0, "truncate");
+      off_t end = payload / 2;
+      _bench_begin(&b, "write", size, "tail", "seq", ops);
+      for(size_t i = 0; i < ops; i++, end += size) {
+        BENCH_OP(&b, i, err = crypto_file_write(cf, buf, size, end));
+        _bench_check(err, size, "write");
+      }
+      _bench_check(crypto_file_flush(cf), 0, "flush");
+      _bench_end(&b);
+      _bench_check(crypto_file_truncate(cf, (off_t) file_mb << 20), 0, "truncate");
+    }
+    if(!_bench_skip("read")) {
+      off_t end = ((off_t) file_mb << 20) - payload / 2;
+      _bench_check(crypto_file_truncate(cf, end), 0, "truncate");
+      _bench_begin(&b, "read", size, "tail", "seq", ops);
+      for(size_t i = 0; i < ops; i++) {
+        BENCH_OP(&b, i, err = crypto_file_read(cf, buf, size, end - size));
+        _bench_check(err, size, "read");
+      }
+      _bench_end(&b);
+      _bench_check(crypto_file_truncate(cf, (off_t) file_mb << 20), 0, "truncate");
+    }
+  }
+
+  _bench_check(crypto_file_release(cf), 0, "release");
+  free(buf);
+}
+
+static void _bench_cleanup(const char *dir){
+  DIR *dp = opendir(dir);
+  if(dp == NULL)
+    return;
+  struct dirent *de;
+  while((de = readdir(dp)) != NULL) {
+    if(strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+      unlinkat(dirfd(dp), de->d_name, 0);
+  }
+  closedir(dp);
+  rmdir(dir);
+}
+
+static void _bench_usage(void){
+  printf("usage: cryptofs-bench [-o cryptofs options] [-s file MiB] [-b MiB per case] "
+         "[-n most ops per case] [-c case] [-d scratch dir]\n");
+}
+
+int main(int argc, char *argv[]){
+  const char *opts = NULL, *scratch = NULL;
+  int c;
+  while((c = getopt(argc, argv, "o:s:b:n:c:d:h")) != -1) {
+    switch(c) {
+    case 'o': opts = optarg; break;
+    case 's': file_mb = strtoul(optarg, NULL, 10); break;
+    case 'b': budget_mb = strtoul(optarg, NULL, 10); break;
+    case 'n': max_ops = strtoul(optarg, NULL, 10); break;
+    case 'c': only = optarg; break;
+    case 'd': scratch = optarg; break;
+    default: _bench_usage(); return c == 'h' ? 0 : 1;
+    }
+  }
+  if(file_mb == 0 || budget_mb == 0 || max_ops == 0) {
+    _bench_usage();
+    return 1;
+  }
+
+  struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+  fuse_opt_add_arg(&args, argv[0]);
+  if(opts != NULL) {
+    fuse_opt_add_arg(&args, "-o");
+    fuse_opt_add_arg(&args, opts);
+  }
+  if(crypto_options_parse(&args) == -1)
+    return 1;
+  fuse_opt_free_args(&args);
+
+  printf("case\tsize\talign\tpattern\tops\tmb_s\tops_s\tcycles_byte\tp50_us\tp99_us\n");
+  _bench_primitives();
+
+  char tmpl[] = "/tmp/cryptofs-bench-XXXXXX";
+  char *dir = scratch != NULL ? realpath(scratch, NULL) : mkdtemp(tmpl);
+  if(dir == NULL) {
+    perror(scratch != NULL ? scratch : "mkdtemp");
+    return 1;
+  }
+  if(scratch != NULL && mkdir(dir, 0700) == -1 && errno != EEXIST) {
+    perror(dir);
+    return 1;
+  }
+
+  unsigned char key[32];
+  memset(key, 0x42, sizeof(key));
+  int ret = 0;
+  if(crypto_engine_init(dir, key) == -1) {
+    ret = 1;
+  } else {
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if(dirfd == -1) {
+      perror(dir);
+      ret = 1;
+    } else {
+      if(!_bench_skip("read") || !_bench_skip("write"))
+        _bench_engine(dirfd, crypto_engine_payload());
+      close(dirfd);
+    }
+    crypto_engine_destroy();
+  }
+
+  if(scratch == NULL)
+    _bench_cleanup(dir);
+  else
+    free(dir);
+  return ret;
+}
@@ -0,0 +1,439 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "src/trace.h"
+#include "src/cryptofs.h"
+#include <fuse.h>
+
+// Replays a trace recorded with the trace mount option against the path
+// based op table, on a volume in a scratch directory, so nothing is
+// mounted. Calls go out one at a time, in the order they came in, at the
+// times they came in or, with -f, as fast as they can. Every path of the
+// trace becomes a name of its own in the top directory, it is only known
+// by its hash. Files and directories the trace uses without making them
+// are made first, files as large as the furthest the trace reads or
+// writes them.
+//
+// Prints, tab separated, a line for every op in the trace:
+//
+//   op calls errors traced_p50_us traced_p99_us p50_us p99_us
+//
+// where errors counts calls that failed on one side but not the other,
+// and a total line with the calls, errors, seconds the replay took and
+// MB/s read and written.
+
+// Everything known about a path of the trace.
+struct replay_path {
+  uint64_t hash;
+  uint64_t extent;          // furthest it is read or written to
+  int used;
+  int made;                 // the trace makes it before using it
+  int dir;
+};
+
+// A handle of the trace and the one it is replayed on.
+struct replay_handle {
+  uint64_t fh;
+  struct fuse_file_info inf;
+  struct replay_handle *next;
+};
+
+#define REPLAY_HANDLES 1024
+
+static const struct fuse_operations *ops;
+static struct replay_path *paths = NULL;
+static size_t npaths = 0;     // slots, a power of two
+static struct replay_handle *handles[REPLAY_HANDLES];
+static uint64_t root = 0;     // hash of "/"
+
+static uint64_t _replay_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int _replay_cmp_when(const void *a, const void *b){
+  const struct crypto_trace_rec *x = a, *y = b;
+  return x->when < y->when ? -1 : x->when > y->when;
+}
+
+static int _replay_cmp_u32(const void *a, const void *b){
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void _replay_name(char *buf, size_t len, uint64_t hash){
+  if(hash == root)
+    snprintf(buf, len, "/");
+  else
+    snprintf(buf, len, "/%016llx", (unsigned long long) hash);
+}
+
+static struct replay_path *_replay_path(uint64_t hash){
+  size_t i = (hash * 0x9E3779B97F4A7C15ULL) & (npaths - 1);
+  while(paths[i].used && paths[i].hash != hash)
+    i = (i + 1) & (npaths - 1);
+  paths[i].hash = hash;
+  return &paths[i];
+}
+
+// Marks where a path is first seen, and whether the call makes it.
+static void _replay_see(uint64_t hash, int makes){
+  struct replay_path *p = _replay_path(hash);
+  if(!p->used) {
+    p->used = 1;
+    p->made = makes;
+  }
+}
+
+static void _replay_scan(const struct crypto_trace_rec *recs, size_t n){
+  for(npaths = 16; npaths < 2 * n + 2; npaths <<= 1)
+    ;
+  if((paths = calloc(npaths, sizeof(*paths))) == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+
+  for(size_t i = 0; i < n; i++) {
+    const struct crypto_trace_rec *r = &recs[i];
+    int op = r->op;
+    // Nothing is made beforehand for a path the trace makes, or that
+    // wasn't there when the trace first looked for it.
+    _replay_see(r->path, op == CRYPTO_TRACE_CREATE || op == CRYPTO_TRACE_MKNOD ||
+                         op == CRYPTO_TRACE_MKDIR || op == CRYPTO_TRACE_SYMLINK || r->res == -ENOENT);
+    if(op == CRYPTO_TRACE_RENAME || op == CRYPTO_TRACE_LINK)
+      _replay_see(r->arg, 1);
+
+    struct replay_path *p = _replay_path(r->path);
+    if(op == CRYPTO_TRACE_MKDIR || op == CRYPTO_TRACE_RMDIR || op == CRYPTO_TRACE_READDIR)
+      p->dir = 1;
+    if((op == CRYPTO_TRACE_READ || op == CRYPTO_TRACE_WRITE) && r->arg + r->len > p->extent)
+      p->extent = r->arg + r->len;
+  }
+}
+
+// Makes what the trace expects to be there already.
+static void _replay_prepare(char *buf, size_t buflen){
+  char name[32];
+  for(size_t i = 0; i < npaths; i++) {
+    struct replay_path *p = &paths[i];
+    if(!p->used || p->made || p->hash == root)
+      continue;
+    _replay_name(name, sizeof(name), p->hash);
+    if(p->dir) {
+      ops->mkdir(name, 0755);
+      continue;
+    }
+
+    struct fuse_file_info inf;
+    memset(&inf, 0, sizeof(inf));
+    inf.flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if(ops->create(name, 0644, &inf) < 0)
+      continue;
+    for(uint64_t off = 0; off < p->extent; off += buflen) {
+      size_t len = p->extent - off < buflen ? p->extent - off : buflen;
+      if(ops->write(name, buf, len, off, &inf) < 0)
+        break;
+    }
+    ops->release(name, &inf);
+  }
+}
+
+static struct replay_handle **_replay_slot(uint64_t fh){
+  struct replay_handle **h = &handles[(fh * 0x9E3779B97F4A7C15ULL) >> 54];
+  while(*h != NULL && (*h)->fh != fh)
+    h = &(*h)->next;
+  return h;
+}
+
+// The handle fh is replayed on, opened here if the trace opened it
+// before recording started.
+static struct fuse_file_info *_replay_handle(uint64_t fh, const char *name){
+  struct replay_handle **h = _replay_slot(fh);
+  if(*h != NULL)
+    return &(*h)->inf;
+
+  struct replay_handle *n = calloc(1, sizeof(*n));
+  if(n == NULL)
+    return NULL;
+  n->fh = fh;
+  n->inf.flags = O_RDWR;
+  if(ops->open(name, &n->inf) < 0) {
+    free(n);
+    return NULL;
+  }
+  *h = n;
+  return &n->inf;
+}
+
+static void _replay_opened(uint64_t fh, const struct fuse_file_info *inf){
+  struct replay_handle **h = _replay_slot(fh);
+  struct replay_handle *n = *h;
+  if(n == NULL && (n = calloc(1, sizeof(*n))) == NULL)
+    return;
+  n->fh  = fh;
+  n->inf = *inf;
+  *h = n;
+}
+
+static int _replay_fill(void *buf, const char *name, const struct stat *st, off_t off){
+  (void) buf;
+  (void) name;
+  (void) st;
+  (void) off;
+  return 0;
+}
+
+// Makes the call r records, counting what it moved in moved.
+static int _replay_one(const struct crypto_trace_rec *r, char *buf, uint64_t *moved){
+  char name[32], other[32];
+  struct fuse_file_info inf, *fi = NULL;
+  struct stat st;
+  struct statvfs sv;
+  int res;
+
+  _replay_name(name, sizeof(name), r->path);
+  _replay_name(other, sizeof(other), r->arg);
+  if(r->fh != 0 && r->op != CRYPTO_TRACE_OPEN && r->op != CRYPTO_TRACE_CREATE &&
+     (fi = _replay_handle(r->fh, name)) == NULL)
+    return -EBADF;
+
+  switch(r->op) {
+  case CRYPTO_TRACE_GETATTR:   return ops->getattr(name, &st);
+  case CRYPTO_TRACE_READLINK:  return ops->readlink(name, buf, r->len);
+  case CRYPTO_TRACE_MKNOD:     return ops->mknod(name, r->flags, r->arg);
+  case CRYPTO_TRACE_MKDIR:     return ops->mkdir(name, r->flags);
+  case CRYPTO_TRACE_UNLINK:    return ops->unlink(name);
+  case CRYPTO_TRACE_RMDIR:     return ops->rmdir(name);
+  case CRYPTO_TRACE_SYMLINK:   return ops->symlink(other, name);
+  case CRYPTO_TRACE_RENAME:    return ops->rename(name, other);
+  case CRYPTO_TRACE_LINK:      return ops->link(name, other);
+  case CRYPTO_TRACE_CHMOD:     return ops->chmod(name, r->flags);
+  case CRYPTO_TRACE_CHOWN:     return ops->chown(name, r->arg >> 32, (uint32_t) r->arg);
+  case CRYPTO_TRACE_TRUNCATE:  return ops->truncate(name, r->arg);
+  case CRYPTO_TRACE_STATFS:    return ops->statfs(name, &sv);
+  case CRYPTO_TRACE_READDIR:   return ops->readdir(name, NULL, _replay_fill, r->arg, fi);
+  case CRYPTO_TRACE_FLUSH:     return fi != NULL ? ops->flush(name, fi) : -EBADF;
+  case CRYPTO_TRACE_FSYNC:     return fi != NULL ? ops->fsync(name, r->flags, fi) : -EBADF;
+  case CRYPTO_TRACE_FTRUNCATE: return fi != NULL ? ops->ftruncate(name, r->arg, fi) : -EBADF;
+#if FUSE_VERSION >= 29
+  case CRYPTO_TRACE_FALLOCATE:
+    return fi != NULL && ops->fallocate != NULL ? ops->fallocate(name, r->flags, r->arg, r->len, fi)
+                                                : -EOPNOTSUPP;
+#endif
+
+  case CRYPTO_TRACE_READ:
+  case CRYPTO_TRACE_WRITE:
+    if(fi == NULL)
+      return -EBADF;
+    res = r->op == CRYPTO_TRACE_READ ? ops->read(name, buf, r->len, r->arg, fi)
+                                     : ops->write(name, buf, r->len, r->arg, fi);
+    if(res > 0)
+      *moved += res;
+    return res;
+
+  case CRYPTO_TRACE_OPEN:
+  case CRYPTO_TRACE_CREATE:
+    memset(&inf, 0, sizeof(inf));
+    inf.flags = r->flags;
+    res = r->op == CRYPTO_TRACE_OPEN ? ops->open(name, &inf) : ops->create(name, r->arg, &inf);
+    if(res == 0 && r->fh != 0)
+      _replay_opened(r->fh, &inf);
+    else if(res == 0)
+      ops->release(name, &inf);
+    return res;
+
+  case CRYPTO_TRACE_RELEASE:
+    if(fi == NULL)
+      return -EBADF;
+    res = ops->release(name, fi);
+    struct replay_handle **h = _replay_slot(r->fh), *n = *h;
+    *h = n->next;
+    free(n);
+    return res;
+  }
+  return -ENOSYS;
+}
+
+static void _replay_cleanup(const char *dir){
+  DIR *dp = opendir(dir);
+  if(dp == NULL)
+    return;
+  struct dirent *de;
+  while((de = readdir(dp)) != NULL) {
+    if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+    if(unlinkat(dirfd(dp), de->d_name, 0) == -1 && errno == EISDIR) {
+      char *sub;
+      if(asprintf(&sub, "%s/%s", dir, de->d_name) != -1) {
+        _replay_cleanup(sub);
+        free(sub);
+      }
+    }
+  }
+  closedir(dp);
+  rmdir(dir);
+}
+
+static void _replay_usage(void){
+  printf("usage: cryptofs-replay [-o cryptofs options] [-f] [-d scratch dir] <trace>\n");
+}
+
+int main(int argc, char *argv[]){
+  const char *opts = NULL, *scratch = NULL;
+  int fast = 0, c;
+  while((c = getopt(argc, argv, "o:fd:h")) != -1) {
+    switch(c) {
+    case 'o': opts = optarg; break;
+    case 'f': fast = 1; break;
+    case 'd': scratch = optarg; break;
+    default: _replay_usage(); return c == 'h' ? 0 : 1;
+    }
+  }
+  if(optind != argc - 1) {
+    _replay_usage();
+    return 1;
+  }
+
+  FILE *f = fopen(argv[optind], "rb");
+  struct crypto_trace_header h;
+  if(f == NULL || fread(&h, sizeof(h), 1, f) != 1) {
+    perror(argv[optind]);
+    return 1;
+  }
+  if(memcmp(h.magic, CRYPTO_TRACE_MAGIC, sizeof(h.magic)) != 0 || h.version != CRYPTO_TRACE_VERSION ||
+     h.rec_size != sizeof(struct crypto_trace_rec)) {
+    printf("%s: not a trace this version can read\n", argv[optind]);
+    return 1;
+  }
+
+  size_t n = 0, cap = 4096;
+  struct crypto_trace_rec *recs = malloc(cap * sizeof(*recs));
+  while(recs != NULL && fread(&recs[n], sizeof(*recs), 1, f) == 1) {
+    if(++n == cap)
+      recs = realloc(recs, (cap *= 2) * sizeof(*recs));
+  }
+  fclose(f);
+  if(recs == NULL || n == 0) {
+    printf("%s: %s\n", argv[optind], recs == NULL ? strerror(ENOMEM) : "no calls in the trace");
+    return 1;
+  }
+
+  // Records go in as calls return, they are replayed as they came in.
+  qsort(recs, n, sizeof(*recs), _replay_cmp_when);
+  root = crypto_trace_hash("/");
+  _replay_scan(recs, n);
+
+  size_t buflen = 1 << 20;
+  for(size_t i = 0; i < n; i++) {
+    if(recs[i].len > buflen && recs[i].op != CRYPTO_TRACE_FALLOCATE)
+      buflen = recs[i].len;
+  }
+  char *buf = malloc(buflen);
+  uint32_t *lat = malloc(n * sizeof(*lat));
+  int *res = malloc(n * sizeof(*res));
+  if(buf == NULL || lat == NULL || res == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  for(size_t i = 0; i < buflen; i++)
+    buf[i] = i * 7 + 1;
+
+  struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+  fuse_opt_add_arg(&args, argv[0]);
+  if(opts != NULL) {
+    fuse_opt_add_arg(&args, "-o");
+    fuse_opt_add_arg(&args, opts);
+  }
+  if(crypto_options_parse(&args) == -1)
+    return 1;
+  fuse_opt_free_args(&args);
+
+  char tmpl[] = "/tmp/cryptofs-replay-XXXXXX";
+  char *dir = scratch != NULL ? realpath(scratch, NULL) : mkdtemp(tmpl);
+  if(dir == NULL) {
+    perror(scratch != NULL ? scratch : "mkdtemp");
+    return 1;
+  }
+
+  unsigned char key[32];
+  memset(key, 0x42, sizeof(key));
+  if(crypto_engine_init(dir, key) == -1)
+    return 1;
+  ops = crypto_engine_ops();
+  _replay_prepare(buf, buflen);
+
+  uint64_t moved = 0, start = _replay_ns();
+  for(size_t i = 0; i < n; i++) {
+    if(!fast) {
+      uint64_t due = start + (recs[i].when - recs[0].when), now = _replay_ns();
+      if(due > now) {
+        struct timespec ts = { (due - now) / 1000000000, (due - now) % 1000000000 };
+        while(nanosleep(&ts, &ts) == -1 && errno == EINTR)
+          ;
+      }
+    }
+    uint64_t t0 = _replay_ns();
+    res[i] = _replay_one(&recs[i], buf, &moved);
+    uint64_t took = _replay_ns() - t0;
+    lat[i] = took > UINT32_MAX ? UINT32_MAX : took;
+  }
+  double secs = (_replay_ns() - start) / 1e9;
+
+  // Closes whatever the trace left open, the way unmounting would.
+  for(size_t i = 0; i < REPLAY_HANDLES; i++) {
+    while(handles[i] != NULL) {
+      struct replay_handle *h = handles[i];
+      ops->release("", &h->inf);
+      handles[i] = h->next;
+      free(h);
+    }
+  }
+
+  printf("op\tcalls\terrors\ttraced_p50_us\ttraced_p99_us\tp50_us\tp99_us\n");
+  uint32_t *traced = malloc(n * sizeof(*traced)), *replayed = malloc(n * sizeof(*replayed));
+  size_t mismatched = 0;
+  for(unsigned int op = 1; traced != NULL && replayed != NULL && op < CRYPTO_TRACE_OPS; op++) {
+    size_t calls = 0, errors = 0;
+    for(size_t i = 0; i < n; i++) {
+      if(recs[i].op != op)
+        continue;
+      traced[calls] = recs[i].latency;
+      replayed[calls] = lat[i];
+      calls++;
+      errors += (recs[i].res < 0) != (res[i] < 0);
+      mismatched += (recs[i].res < 0) != (res[i] < 0);
+    }
+    if(calls == 0)
+      continue;
+    qsort(traced, calls, sizeof(*traced), _replay_cmp_u32);
+    qsort(replayed, calls, sizeof(*replayed), _replay_cmp_u32);
+    printf("%s\t%zu\t%zu\t%.1f\t%.1f\t%.1f\t%.1f\n", crypto_trace_op_name(op), calls, errors,
+           traced[calls / 2] / 1e3, traced[calls * 99 / 100] / 1e3,
+           replayed[calls / 2] / 1e3, replayed[calls * 99 / 100] / 1e3);
+  }
+  printf("total\t%zu\t%zu\t%.3f\t%.1f\n", n, mismatched, secs, moved / secs / 1e6);
+
+  crypto_engine_destroy();
+  if(scratch == NULL)
+    _replay_cleanup(dir);
+  else
+    free(dir);
+  free(traced);
+  free(replayed);
+  free(recs);
+  free(lat);
+  free(res);
+  free(buf);
+  free(paths);
+  return 0;
+}
@@ -5,6 +5,7 @@
 typedef unsigned char u8;
 typedef unsigned long u32;
 typedef unsigned long long u64;
+typedef unsigned int w32;
 typedef long long i64;
 typedef i64 gf[16];
 
@@ -121,13 +122,148 @@ int crypto_core_hsalsa20(u8 *out,const u8 *in,const u8 *k,const u8 *c)
 
 static const u8 sigma[16] = "expand 32-byte k";
 
-int crypto_stream_salsa20_xor(u8 *c,const u8 *m,u64 b,const u8 *n,const u8 *k)
+/*
+ * Wide Salsa20 kernels. Each one runs L blocks side by side, one block per
+ * vector lane with the block counter differing between lanes, and xors the
+ * keystream into m a 32-bit word at a time. They are picked by cpuid at
+ * startup and only used if they agree with core() bit for bit.
+ *
+ * u32 above is an unsigned long and L32 doesn't mask, so on LP64 core()
+ * carries its words in 64 bits and everything ever written by this code
+ * depends on that. The kernels keep 64-bit lanes to stay compatible.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SALSA20_WIDE
+#include <string.h>
+
+typedef u64 w64x4 __attribute__((vector_size(32)));
+typedef u64 w64x8 __attribute__((vector_size(64)));
+typedef u64 w64x16 __attribute__((vector_size(128)));
+
+typedef void (*salsa20_wide_fn)(u8 *,const u8 *,u64,const u8 *,const u8 *,u64);
+
+#define WL32(v,c) (((v) << (c)) | ((v) >> (32 - (c))))
+#define WQR(a,b,c,d) \
+  b ^= WL32(a + d, 7); \
+  c ^= WL32(b + a, 9); \
+  d ^= WL32(c + b,13); \
+  a ^= WL32(d + c,18);
+
+#define SALSA20_KERNEL(NAME,TARGET,V,L) \
+__attribute__((target(TARGET))) \
+static void NAME(u8 *c,const u8 *m,u64 blocks,const u8 *n,const u8 *k,u64 ctr) \
+{ \
+  V x[16],y[16]; \
+  u64 o[16][L] __attribute__((aligned(64))),s[16],b; \
+  w32 t[16]; \
+  int i,j; \
+  FOR(i,4) { \
+    s[5*i] = ld32(sigma+4*i); \
+    s[1+i] = ld32(k+4*i); \
+    s[11+i] = ld32(k+16+4*i); \
+  } \
+  s[6] = ld32(n); \
+  s[7] = ld32(n+4); \
+  for (b = 0;b < blocks;b += L) { \
+    FOR(i,16) FOR(j,L) y[i][j] = s[i]; \
+    FOR(j,L) { \
+      y[8][j] = (w32) (ctr + b + j); \
+      y[9][j] = (w32) ((ctr + b + j) >> 32); \
+    } \
+    FOR(i,16) x[i] = y[i]; \
+    FOR(i,10) { \
+      WQR(x[0],x[4],x[8],x[12]) \
+      WQR(x[5],x[9],x[13],x[1]) \
+      WQR(x[10],x[14],x[2],x[6]) \
+      WQR(x[15],x[3],x[7],x[11]) \
+      WQR(x[0],x[1],x[2],x[3]) \
+      WQR(x[5],x[6],x[7],x[4]) \
+      WQR(x[10],x[11],x[8],x[9]) \
+      WQR(x[15],x[12],x[13],x[14]) \
+    } \
+    FOR(i,16) x[i] += y[i]; \
+    memcpy(o,x,sizeof(o)); \
+    FOR(j,L) { \
+      if (m) memcpy(t,m + 64 * j,64); else memset(t,0,64); \
+      FOR(i,16) t[i] ^= (w32) o[i][j]; \
+      memcpy(c + 64 * j,t,64); \
+    } \
+    c += 64 * L; \
+    if (m) m += 64 * L; \
+  } \
+}
+
+SALSA20_KERNEL(salsa20_sse2,"sse2",w64x4,4)
+SALSA20_KERNEL(salsa20_avx2,"avx2",w64x8,8)
+SALSA20_KERNEL(salsa20_avx512,"avx512f",w64x16,16)
+
+static salsa20_wide_fn salsa20_wide = 0;
+static u64 salsa20_lanes = 0;
+
+/* Runs both the kernel and core() over blocks that carry into the high
+   counter word and compares. */
+static int salsa20_wide_ok(salsa20_wide_fn f,u64 lanes)
+{
+  u8 k[32],n[8],z[16],want[64 * 16],got[64 * 16],msg[64 * 16];
+  u64 i,j,ctr = 0xfffffffdULL;
+  FOR(i,32) k[i] = 7 * i + 1;
+  FOR(i,8) n[i] = 3 * i + 5;
+  FOR(i,64 * lanes) msg[i] = i;
+  FOR(i,lanes) {
+    FOR(j,8) z[j] = n[j];
+    FOR(j,8) z[8 + j] = (ctr + i) >> (8 * j);
+    crypto_core_salsa20(want + 64 * i,z,k,sigma);
+    FOR(j,64) want[64 * i + j] ^= msg[64 * i + j];
+  }
+  f(got,msg,lanes,n,k,ctr);
+  FOR(i,64 * lanes) if (got[i] != want[i]) return 0;
+  return 1;
+}
+
+__attribute__((constructor))
+static void salsa20_pick(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && salsa20_wide_ok(salsa20_avx512,16)) {
+    salsa20_wide = salsa20_avx512;
+    salsa20_lanes = 16;
+  } else if (__builtin_cpu_supports("avx2") && salsa20_wide_ok(salsa20_avx2,8)) {
+    salsa20_wide = salsa20_avx2;
+    salsa20_lanes = 8;
+  } else if (__builtin_cpu_supports("sse2") && salsa20_wide_ok(salsa20_sse2,4)) {
+    salsa20_wide = salsa20_sse2;
+    salsa20_lanes = 4;
+  }
+}
+#endif
+
+/* Like crypto_stream_salsa20_xor, starting at block ic of the keystream. */
+int crypto_stream_salsa20_xor_ic(u8 *c,const u8 *m,u64 b,const u8 *n,u64 ic,const u8 *k)
 {
   u8 z[16],x[64];
   u32 u,i;
   if (!b) return 0;
-  FOR(i,16) z[i] = 0;
   FOR(i,8) z[i] = n[i];
+  FOR(i,8) z[8 + i] = ic >> (8 * i);
+#ifdef SALSA20_WIDE
+  if (salsa20_wide && b >= 64 * salsa20_lanes) {
+    u64 blocks = b / 64 / salsa20_lanes * salsa20_lanes;
+    salsa20_wide(c,m,blocks,n,k,ic);
+    ic += blocks;
+    FOR(i,8) z[8 + i] = ic >> (8 * i);
+    b -= 64 * blocks;
+    c += 64 * blocks;
+    if (m) m += 64 * blocks;
+  }
+  /* One more pass of the kernel into a scratch keystream is still far
+     cheaper than finishing a short tail with core(). */
+  if (salsa20_wide && b > 64) {
+    u8 ks[64 * 16];
+    salsa20_wide(ks,0,salsa20_lanes,n,k,ic);
+    FOR(i,b) c[i] = (m?m[i]:0) ^ ks[i];
+    return 0;
+  }
+#endif
   while (b >= 64) {
     crypto_core_salsa20(x,z,k,sigma);
     FOR(i,64) c[i] = (m?m[i]:0) ^ x[i];
@@ -148,6 +284,11 @@ int crypto_stream_salsa20_xor(u8 *c,const u8 *m,u64 b,const u8 *n,const u8 *k)
   return 0;
 }
 
+int crypto_stream_salsa20_xor(u8 *c,const u8 *m,u64 b,const u8 *n,const u8 *k)
+{
+  return crypto_stream_salsa20_xor_ic(c,m,b,n,0,k);
+}
+
 int crypto_stream_salsa20(u8 *c,u64 d,const u8 *n,const u8 *k)
 {
   return crypto_stream_salsa20_xor(c,0,d,n,k);
@@ -181,7 +322,7 @@ static const u32 minusp[17] = {
   5, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 252
 } ;
 
-int crypto_onetimeauth(u8 *out,const u8 *m,u64 n,const u8 *k)
+static int onetimeauth_ref(u8 *out,const u8 *m,u64 n,const u8 *k)
 {
   u32 s,i,j,u,x[17],r[17],h[17],c[17],g[17];
 
@@ -234,6 +375,207 @@ int crypto_onetimeauth(u8 *out,const u8 *m,u64 n,const u8 *k)
   return 0;
 }
 
+/*
+ * Poly1305 with wide limbs: three 44-bit limbs and 128-bit products where
+ * the compiler has them, five 26-bit limbs and 64-bit products otherwise.
+ * Whole blocks are absorbed straight from m; only a short tail is padded.
+ * The reference above stays as the fallback and as the self-test oracle.
+ */
+static u64 ld64(const u8 *x) { return ld32(x) | (u64) ld32(x + 4) << 32; }
+sv st64(u8 *x,u64 u) { st32(x,u); st32(x + 4,u >> 32); }
+
+#ifdef __SIZEOF_INT128__
+typedef unsigned __int128 u128;
+#define M44 0xfffffffffffULL
+#define M42 0x3ffffffffffULL
+
+static int onetimeauth_wide(u8 *out,const u8 *m,u64 n,const u8 *k)
+{
+  u64 r0,r1,r2,s1,s2,h0 = 0,h1 = 0,h2 = 0,t0,t1,g0,g1,g2,c,hibit;
+  u128 d0,d1,d2;
+  u8 last[16];
+  int i;
+
+  t0 = ld64(k);
+  t1 = ld64(k + 8);
+  r0 = t0 & 0xffc0fffffffULL;
+  r1 = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+  r2 = (t1 >> 24) & 0x00ffffffc0fULL;
+  s1 = r1 * 20;
+  s2 = r2 * 20;
+
+  while (n > 0) {
+    hibit = 1ULL << 40;
+    if (n < 16) {
+      FOR(i,16) last[i] = (i < (int) n) ? m[i] : 0;
+      last[n] = 1;
+      m = last;
+      n = 16;
+      hibit = 0;
+    }
+    t0 = ld64(m);
+    t1 = ld64(m + 8);
+    h0 += t0 & M44;
+    h1 += ((t0 >> 44) | (t1 << 20)) & M44;
+    h2 += ((t1 >> 24) & M42) | hibit;
+
+    d0 = (u128) h0 * r0 + (u128) h1 * s2 + (u128) h2 * s1;
+    d1 = (u128) h0 * r1 + (u128) h1 * r0 + (u128) h2 * s2;
+    d2 = (u128) h0 * r2 + (u128) h1 * r1 + (u128) h2 * r0;
+    c = d0 >> 44; h0 = (u64) d0 & M44;
+    d1 += c; c = d1 >> 44; h1 = (u64) d1 & M44;
+    d2 += c; c = d2 >> 42; h2 = (u64) d2 & M42;
+    h0 += c * 5; c = h0 >> 44; h0 &= M44;
+    h1 += c;
+
+    m += 16;
+    n -= 16;
+  }
+
+  c = h1 >> 44; h1 &= M44; h2 += c;
+  c = h2 >> 42; h2 &= M42; h0 += c * 5;
+  c = h0 >> 44; h0 &= M44; h1 += c;
+  c = h1 >> 44; h1 &= M44; h2 += c;
+  c = h2 >> 42; h2 &= M42; h0 += c * 5;
+  c = h0 >> 44; h0 &= M44; h1 += c;
+
+  g0 = h0 + 5; c = g0 >> 44; g0 &= M44;
+  g1 = h1 + c; c = g1 >> 44; g1 &= M44;
+  g2 = h2 + c - (1ULL << 42);
+  c = (g2 >> 63) - 1;
+  h0 = (h0 & ~c) | (g0 & c);
+  h1 = (h1 & ~c) | (g1 & c);
+  h2 = (h2 & ~c) | (g2 & c);
+
+  t0 = ld64(k + 16);
+  t1 = ld64(k + 24);
+  h0 += t0 & M44; c = h0 >> 44; h0 &= M44;
+  h1 += (((t0 >> 44) | (t1 << 20)) & M44) + c; c = h1 >> 44; h1 &= M44;
+  h2 += ((t1 >> 24) & M42) + c; h2 &= M42;
+
+  st64(out,h0 | (h1 << 44));
+  st64(out + 8,(h1 >> 20) | (h2 << 24));
+  return 0;
+}
+#else
+#define M26 0x3ffffff
+
+static int onetimeauth_wide(u8 *out,const u8 *m,u64 n,const u8 *k)
+{
+  w32 r0,r1,r2,r3,r4,s1,s2,s3,s4,h0 = 0,h1 = 0,h2 = 0,h3 = 0,h4 = 0;
+  w32 g0,g1,g2,g3,g4,c,mask,hibit;
+  u64 d0,d1,d2,d3,d4,f;
+  u8 last[16];
+  int i;
+
+  r0 = ld32(k) & 0x3ffffff;
+  r1 = (ld32(k + 3) >> 2) & 0x3ffff03;
+  r2 = (ld32(k + 6) >> 4) & 0x3ffc0ff;
+  r3 = (ld32(k + 9) >> 6) & 0x3f03fff;
+  r4 = (ld32(k + 12) >> 8) & 0x00fffff;
+  s1 = r1 * 5; s2 = r2 * 5; s3 = r3 * 5; s4 = r4 * 5;
+
+  while (n > 0) {
+    hibit = 1 << 24;
+    if (n < 16) {
+      FOR(i,16) last[i] = (i < (int) n) ? m[i] : 0;
+      last[n] = 1;
+      m = last;
+      n = 16;
+      hibit = 0;
+    }
+    h0 += ld32(m) & M26;
+    h1 += (ld32(m + 3) >> 2) & M26;
+    h2 += (ld32(m + 6) >> 4) & M26;
+    h3 += (ld32(m + 9) >> 6) & M26;
+    h4 += (ld32(m + 12) >> 8) | hibit;
+
+    d0 = (u64) h0 * r0 + (u64) h1 * s4 + (u64) h2 * s3 + (u64) h3 * s2 + (u64) h4 * s1;
+    d1 = (u64) h0 * r1 + (u64) h1 * r0 + (u64) h2 * s4 + (u64) h3 * s3 + (u64) h4 * s2;
+    d2 = (u64) h0 * r2 + (u64) h1 * r1 + (u64) h2 * r0 + (u64) h3 * s4 + (u64) h4 * s3;
+    d3 = (u64) h0 * r3 + (u64) h1 * r2 + (u64) h2 * r1 + (u64) h3 * r0 + (u64) h4 * s4;
+    d4 = (u64) h0 * r4 + (u64) h1 * r3 + (u64) h2 * r2 + (u64) h3 * r1 + (u64) h4 * r0;
+    c = d0 >> 26; h0 = d0 & M26;
+    d1 += c; c = d1 >> 26; h1 = d1 & M26;
+    d2 += c; c = d2 >> 26; h2 = d2 & M26;
+    d3 += c; c = d3 >> 26; h3 = d3 & M26;
+    d4 += c; c = d4 >> 26; h4 = d4 & M26;
+    h0 += c * 5; c = h0 >> 26; h0 &= M26;
+    h1 += c;
+
+    m += 16;
+    n -= 16;
+  }
+
+  c = h1 >> 26; h1 &= M26; h2 += c;
+  c = h2 >> 26; h2 &= M26; h3 += c;
+  c = h3 >> 26; h3 &= M26; h4 += c;
+  c = h4 >> 26; h4 &= M26; h0 += c * 5;
+  c = h0 >> 26; h0 &= M26; h1 += c;
+
+  g0 = h0 + 5; c = g0 >> 26; g0 &= M26;
+  g1 = h1 + c; c = g1 >> 26; g1 &= M26;
+  g2 = h2 + c; c = g2 >> 26; g2 &= M26;
+  g3 = h3 + c; c = g3 >> 26; g3 &= M26;
+  g4 = h4 + c - (1 << 26);
+  mask = (g4 >> 31) - 1;
+  h0 = (h0 & ~mask) | (g0 & mask);
+  h1 = (h1 & ~mask) | (g1 & mask);
+  h2 = (h2 & ~mask) | (g2 & mask);
+  h3 = (h3 & ~mask) | (g3 & mask);
+  h4 = (h4 & ~mask) | (g4 & mask);
+
+  h0 = h0 | (h1 << 26);
+  h1 = (h1 >> 6) | (h2 << 20);
+  h2 = (h2 >> 12) | (h3 << 14);
+  h3 = (h3 >> 18) | (h4 << 8);
+
+  f = (u64) h0 + (w32) ld32(k + 16); st32(out,f);
+  f = (u64) h1 + (w32) ld32(k + 20) + (f >> 32); st32(out + 4,f);
+  f = (u64) h2 + (w32) ld32(k + 24) + (f >> 32); st32(out + 8,f);
+  f = (u64) h3 + (w32) ld32(k + 28) + (f >> 32); st32(out + 12,f);
+  return 0;
+}
+#endif
+
+typedef int (*onetimeauth_fn)(u8 *,const u8 *,u64,const u8 *);
+static onetimeauth_fn onetimeauth = onetimeauth_ref;
+
+/* Compares against the reference on every tail length and on keys that
+   max out r and the pad, so every carry path gets exercised. */
+static int onetimeauth_wide_ok(void)
+{
+  u8 k[32],m[300],want[16],got[16];
+  int i,j,n;
+  FOR(i,300) m[i] = 0xff - 5 * i;
+  FOR(j,3) {
+    FOR(i,32) k[i] = j == 0 ? 0xff : j == 1 ? 13 * i + 1 : (i & 1) * 0xff;
+    for (n = 0;n < 300;n += (n < 40) ? 1 : 37) {
+      onetimeauth_ref(want,m,n,k);
+      onetimeauth_wide(got,m,n,k);
+      FOR(i,16) if (got[i] != want[i]) return 0;
+    }
+  }
+  FOR(i,300) m[i] = 0xff;
+  onetimeauth_ref(want,m,300,k);
+  onetimeauth_wide(got,m,300,k);
+  FOR(i,16) if (got[i] != want[i]) return 0;
+  return 1;
+}
+
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+static void onetimeauth_pick(void)
+{
+  if (onetimeauth_wide_ok()) onetimeauth = onetimeauth_wide;
+}
+
+int crypto_onetimeauth(u8 *out,const u8 *m,u64 n,const u8 *k)
+{
+  return onetimeauth(out,m,n,k);
+}
+
 int crypto_onetimeauth_verify(const u8 *h,const u8 *m,u64 n,const u8 *k)
 {
   u8 x[16];
@@ -263,6 +605,47 @@ int crypto_secretbox_open(u8 *m,const u8 *c,u64 d,const u8 *n,const u8 *k)
   return 0;
 }
 
+/*
+ * The same box with the tag kept apart and no zero padding: c and m are
+ * the d bytes of ciphertext and plaintext, and may be the same buffer.
+ * The first keystream block gives the Poly1305 key and covers the first
+ * 32 bytes of the message, the rest of the message starts at block 1.
+ */
+sv secretbox_first(u8 *x,u8 *s,const u8 *n,const u8 *k)
+{
+  crypto_core_hsalsa20(s,n,k,sigma);
+  crypto_stream_salsa20(x,64,n + 16,s);
+}
+
+int crypto_secretbox_detached(u8 *c,u8 *mac,const u8 *m,u64 d,const u8 *n,const u8 *k)
+{
+  u8 s[32],x[64];
+  u64 i;
+  secretbox_first(x,s,n,k);
+  for (i = 0;i < d && i < 32;++i) c[i] = m[i] ^ x[32 + i];
+  if (d > 32) crypto_stream_salsa20_xor_ic(c + 32,m + 32,d - 32,n + 16,1,s);
+  crypto_onetimeauth(mac,c,d,x);
+  FOR(i,64) x[i] = 0;
+  FOR(i,32) s[i] = 0;
+  return 0;
+}
+
+int crypto_secretbox_open_detached(u8 *m,const u8 *c,const u8 *mac,u64 d,const u8 *n,const u8 *k)
+{
+  u8 s[32],x[64];
+  u64 i;
+  int r = -1;
+  secretbox_first(x,s,n,k);
+  if (crypto_onetimeauth_verify(mac,c,d,x) == 0) {
+    for (i = 0;i < d && i < 32;++i) m[i] = c[i] ^ x[32 + i];
+    if (d > 32) crypto_stream_salsa20_xor_ic(m + 32,c + 32,d - 32,n + 16,1,s);
+    r = 0;
+  }
+  FOR(i,64) x[i] = 0;
+  FOR(i,32) s[i] = 0;
+  return r;
+}
+
 sv set25519(gf r, const gf a)
 {
   int i;
@@ -812,27 +1195,42 @@ int crypto_sign_open(u8 *m,u64 *mlen,const u8 *sm,u64 n,const u8 *pk)
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#if defined(__GNUC__) && !defined(__APPLE__) && !defined(__OpenBSD__)
+#include <pthread.h>
+#endif
 
-/* it's really stupid that there isn't a syscall for this */
+/* getrandom where the kernel has it, /dev/urandom otherwise */
 
 static int fd = -1;
 
-void randombytes(unsigned char *x,unsigned long long xlen)
+static void randombytes_fill(unsigned char *x,unsigned long long xlen)
 {
-  int i;
-
-  if (fd == -1) {
-    for (;;) {
-      fd = open("/dev/urandom",O_RDONLY);
-      if (fd != -1) break;
-      sleep(1);
-    }
-  }
+  long i,n;
 
   while (xlen > 0) {
-    if (xlen < 1048576) i = xlen; else i = 1048576;
-
-    i = read(fd,x,i);
+    if (xlen < 1048576) n = xlen; else n = 1048576;
+
+#ifdef SYS_getrandom
+    i = syscall(SYS_getrandom,x,n,0);
+    if (i < 0 && errno == EINTR) continue;
+    if (i < 0) {
+#endif
+    if (fd == -1) {
+      for (;;) {
+        fd = open("/dev/urandom",O_RDONLY);
+        if (fd != -1) break;
+        sleep(1);
+      }
+    }
+    i = read(fd,x,n);
+#ifdef SYS_getrandom
+    }
+#endif
     if (i < 1) {
       sleep(1);
       continue;
@@ -843,3 +1241,62 @@ void randombytes(unsigned char *x,unsigned long long xlen)
   }
 }
 
+#if defined(__APPLE__) || defined(__OpenBSD__)
+#include <stdlib.h>
+
+/* arc4random is already buffered per process and safe across fork */
+void randombytes(unsigned char *x,unsigned long long xlen)
+{
+  arc4random_buf(x,xlen);
+}
+#elif defined(__GNUC__)
+/*
+ * Small requests, which is every nonce, are served from a per-thread pool
+ * refilled a few kilobytes at a time, so sealing a block costs no syscall.
+ * Bytes are wiped as they are handed out. A child after fork must not
+ * reuse its parent's pool, so forking bumps a generation that every
+ * thread checks before it draws.
+ */
+static __thread unsigned char pool[4096];
+static __thread unsigned long pool_left = 0;
+static __thread unsigned long pool_gen = 0;
+static volatile unsigned long fork_gen = 1;
+
+static void randombytes_forked(void)
+{
+  ++fork_gen;
+}
+
+__attribute__((constructor))
+static void randombytes_init(void)
+{
+  pthread_atfork(0,0,randombytes_forked);
+}
+
+void randombytes(unsigned char *x,unsigned long long xlen)
+{
+  unsigned char *p;
+
+  if (xlen > sizeof(pool) / 4) {
+    randombytes_fill(x,xlen);
+    return;
+  }
+  if (pool_gen != fork_gen) {
+    pool_left = 0;
+    pool_gen = fork_gen;
+  }
+  if (pool_left < xlen) {
+    randombytes_fill(pool,sizeof(pool));
+    pool_left = sizeof(pool);
+  }
+  p = pool + sizeof(pool) - pool_left;
+  memcpy(x,p,xlen);
+  memset(p,0,xlen);
+  pool_left -= xlen;
+}
+#else
+void randombytes(unsigned char *x,unsigned long long xlen)
+{
+  randombytes_fill(x,xlen);
+}
+#endif
@@ -185,15 +185,24 @@ extern int crypto_scalarmult_curve25519_tweet_base(unsigned char *,const unsigne
 #define crypto_secretbox_BOXZEROBYTES crypto_secretbox_xsalsa20poly1305_BOXZEROBYTES
 #define crypto_secretbox_IMPLEMENTATION crypto_secretbox_xsalsa20poly1305_IMPLEMENTATION
 #define crypto_secretbox_VERSION crypto_secretbox_xsalsa20poly1305_VERSION
+#define crypto_secretbox_detached crypto_secretbox_xsalsa20poly1305_detached
+#define crypto_secretbox_open_detached crypto_secretbox_xsalsa20poly1305_open_detached
+#define crypto_secretbox_MACBYTES crypto_secretbox_xsalsa20poly1305_MACBYTES
 #define crypto_secretbox_xsalsa20poly1305_tweet_KEYBYTES 32
 #define crypto_secretbox_xsalsa20poly1305_tweet_NONCEBYTES 24
 #define crypto_secretbox_xsalsa20poly1305_tweet_ZEROBYTES 32
 #define crypto_secretbox_xsalsa20poly1305_tweet_BOXZEROBYTES 16
+#define crypto_secretbox_xsalsa20poly1305_tweet_MACBYTES 16
 extern int crypto_secretbox_xsalsa20poly1305_tweet(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *,const unsigned char *);
 extern int crypto_secretbox_xsalsa20poly1305_tweet_open(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *,const unsigned char *);
+extern int crypto_secretbox_xsalsa20poly1305_tweet_detached(unsigned char *,unsigned char *,const unsigned char *,unsigned long long,const unsigned char *,const unsigned char *);
+extern int crypto_secretbox_xsalsa20poly1305_tweet_open_detached(unsigned char *,const unsigned char *,const unsigned char *,unsigned long long,const unsigned char *,const unsigned char *);
 #define crypto_secretbox_xsalsa20poly1305_tweet_VERSION "-"
 #define crypto_secretbox_xsalsa20poly1305 crypto_secretbox_xsalsa20poly1305_tweet
 #define crypto_secretbox_xsalsa20poly1305_open crypto_secretbox_xsalsa20poly1305_tweet_open
+#define crypto_secretbox_xsalsa20poly1305_detached crypto_secretbox_xsalsa20poly1305_tweet_detached
+#define crypto_secretbox_xsalsa20poly1305_open_detached crypto_secretbox_xsalsa20poly1305_tweet_open_detached
+#define crypto_secretbox_xsalsa20poly1305_MACBYTES crypto_secretbox_xsalsa20poly1305_tweet_MACBYTES
 #define crypto_secretbox_xsalsa20poly1305_KEYBYTES crypto_secretbox_xsalsa20poly1305_tweet_KEYBYTES
 #define crypto_secretbox_xsalsa20poly1305_NONCEBYTES crypto_secretbox_xsalsa20poly1305_tweet_NONCEBYTES
 #define crypto_secretbox_xsalsa20poly1305_ZEROBYTES crypto_secretbox_xsalsa20poly1305_tweet_ZEROBYTES
@@ -246,9 +255,11 @@ extern int crypto_stream_xsalsa20_tweet_xor(unsigned char *,const unsigned char
 #define crypto_stream_salsa20_tweet_NONCEBYTES 8
 extern int crypto_stream_salsa20_tweet(unsigned char *,unsigned long long,const unsigned char *,const unsigned char *);
 extern int crypto_stream_salsa20_tweet_xor(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *,const unsigned char *);
+extern int crypto_stream_salsa20_tweet_xor_ic(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *,unsigned long long,const unsigned char *);
 #define crypto_stream_salsa20_tweet_VERSION "-"
 #define crypto_stream_salsa20 crypto_stream_salsa20_tweet
 #define crypto_stream_salsa20_xor crypto_stream_salsa20_tweet_xor
+#define crypto_stream_salsa20_xor_ic crypto_stream_salsa20_tweet_xor_ic
 #define crypto_stream_salsa20_KEYBYTES crypto_stream_salsa20_tweet_KEYBYTES
 #define crypto_stream_salsa20_NONCEBYTES crypto_stream_salsa20_tweet_NONCEBYTES
 #define crypto_stream_salsa20_VERSION crypto_stream_salsa20_tweet_VERSION
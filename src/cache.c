@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "src/cache.h"
+#include "src/stats.h"
+
+#define CACHE_SHARDS 16
+#define CACHE_GENERATIONS 256
+#define CACHE_EPOCHS 4096
+#define CACHE_RANGE_MAX 64     // blocks dropped one by one, more drop the whole file
+
+struct cache_slot {
+  dev_t dev;
+  ino_t ino;
+  size_t idx;
+  size_t len;             // plaintext bytes held in data
+  uint32_t epoch;         // of its file when cached, stale once that moves on
+  long next;              // next slot in the bucket chain, -1 at the end
+  unsigned char used;
+  unsigned char ref;      // CLOCK reference bit
+  unsigned char *data;
+};
+
+struct cache_shard {
+  pthread_mutex_t lock;
+  struct cache_slot *slots;
+  size_t nslots;
+  size_t hand;
+  long *buckets;
+  size_t nbuckets;
+  unsigned char *data;
+};
+
+static struct cache_shard shards[CACHE_SHARDS];
+static size_t block_len = 0;
+static int enabled = 0;
+
+// Bumped by every change made on behalf of a write, one counter per group
+// of files, so a fill only loses out to writes that may have hit its file.
+static uint64_t generations[CACHE_GENERATIONS];
+
+// Bumped to drop every cached block of a file at once, blocks are checked
+// against it as they are looked up instead of being hunted down. Files
+// that share an epoch lose their blocks along with it.
+static uint32_t epochs[CACHE_EPOCHS];
+
+static uint64_t _cache_hash(dev_t dev, ino_t ino, size_t idx){
+  uint64_t h = (uint64_t) ino * 0x9E3779B97F4A7C15ULL;
+  h ^= (uint64_t) dev + 0x632BE59BD9B4E019ULL + (h << 6) + (h >> 2);
+  h ^= (uint64_t) idx * 0xC2B2AE3D27D4EB4FULL;
+  h ^= h >> 29;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  return h ^ (h >> 32);
+}
+
+static uint64_t *_cache_generation(dev_t dev, ino_t ino){
+  return &generations[_cache_hash(dev, ino, 0) % CACHE_GENERATIONS];
+}
+
+static uint32_t *_cache_epoch(dev_t dev, ino_t ino){
+  return &epochs[_cache_hash(dev, ino, 0) % CACHE_EPOCHS];
+}
+
+static int _cache_stale(const struct cache_slot *s){
+  return s->epoch != __atomic_load_n(_cache_epoch(s->dev, s->ino), __ATOMIC_RELAXED);
+}
+
+static struct cache_shard *_cache_shard(uint64_t h){
+  return &shards[h % CACHE_SHARDS];
+}
+
+static long *_cache_bucket(struct cache_shard *sh, uint64_t h){
+  return &sh->buckets[(h >> 8) & (sh->nbuckets - 1)];
+}
+
+static void _cache_unlink(struct cache_shard *sh, struct cache_slot *s);
+
+// Stale blocks are dropped on the way.
+static struct cache_slot *_cache_find(struct cache_shard *sh, uint64_t h,
+                                      dev_t dev, ino_t ino, size_t idx){
+  for(long i = *_cache_bucket(sh, h); i != -1; i = sh->slots[i].next) {
+    struct cache_slot *s = &sh->slots[i];
+    if(s->ino == ino && s->idx == idx && s->dev == dev) {
+      if(!_cache_stale(s))
+        return s;
+      _cache_unlink(sh, s);
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+static void _cache_unlink(struct cache_shard *sh, struct cache_slot *s){
+  long want = s - sh->slots;
+  long *p = _cache_bucket(sh, _cache_hash(s->dev, s->ino, s->idx));
+  while(*p != want)
+    p = &sh->slots[*p].next;
+  *p = s->next;
+  s->used = 0;
+  s->ref  = 0;
+}
+
+// Advances the clock hand until it finds a free or stale slot, or one that
+// has not been referenced since the last sweep.
+static struct cache_slot *_cache_victim(struct cache_shard *sh){
+  for(;;) {
+    struct cache_slot *s = &sh->slots[sh->hand];
+    sh->hand = (sh->hand + 1) % sh->nslots;
+    if(!s->used)
+      return s;
+    if(!s->ref || _cache_stale(s)) {
+      _cache_unlink(sh, s);
+      return s;
+    }
+    s->ref = 0;
+  }
+}
+
+int crypto_cache_init(size_t budget, size_t block){
+  size_t per = budget / CACHE_SHARDS / block;
+  if(per == 0)
+    return 0;
+
+  size_t nbuckets = 1;
+  while(nbuckets < per)
+    nbuckets <<= 1;
+
+  for(int i = 0; i < CACHE_SHARDS; i++) {
+    struct cache_shard *sh = &shards[i];
+    sh->slots    = calloc(per, sizeof(*sh->slots));
+    sh->buckets  = malloc(nbuckets * sizeof(*sh->buckets));
+    sh->data     = malloc(per * block);
+    if(sh->slots == NULL || sh->buckets == NULL || sh->data == NULL) {
+      crypto_cache_destroy();
+      return -1;
+    }
+
+    sh->nslots   = per;
+    sh->nbuckets = nbuckets;
+    sh->hand     = 0;
+    for(size_t j = 0; j < nbuckets; j++)
+      sh->buckets[j] = -1;
+    for(size_t j = 0; j < per; j++)
+      sh->slots[j].data = sh->data + j * block;
+    pthread_mutex_init(&sh->lock, NULL);
+  }
+
+  block_len = block;
+  enabled   = 1;
+  return 0;
+}
+
+void crypto_cache_destroy(void){
+  for(int i = 0; i < CACHE_SHARDS; i++) {
+    struct cache_shard *sh = &shards[i];
+    if(enabled)
+      pthread_mutex_destroy(&sh->lock);
+    free(sh->slots);
+    free(sh->buckets);
+    free(sh->data);
+    memset(sh, 0, sizeof(*sh));
+  }
+  enabled = 0;
+}
+
+ssize_t crypto_cache_get(dev_t dev, ino_t ino, size_t idx, unsigned char *out){
+  if(!enabled)
+    return -1;
+
+  uint64_t h = _cache_hash(dev, ino, idx);
+  struct cache_shard *sh = _cache_shard(h);
+  ssize_t len = -1;
+
+  pthread_mutex_lock(&sh->lock);
+  struct cache_slot *s = _cache_find(sh, h, dev, ino, idx);
+  if(s != NULL) {
+    s->ref = 1;
+    len = s->len;
+    memcpy(out, s->data, len);
+  }
+  pthread_mutex_unlock(&sh->lock);
+
+  crypto_stats_add(len < 0 ? CRYPTO_STATS_CACHE_MISSES : CRYPTO_STATS_CACHE_HITS, 1);
+  return len;
+}
+
+size_t crypto_cache_blocks(void){
+  return enabled ? shards[0].nslots * CACHE_SHARDS : 0;
+}
+
+int crypto_cache_has(dev_t dev, ino_t ino, size_t idx){
+  if(!enabled)
+    return 0;
+
+  uint64_t h = _cache_hash(dev, ino, idx);
+  struct cache_shard *sh = _cache_shard(h);
+
+  pthread_mutex_lock(&sh->lock);
+  int has = _cache_find(sh, h, dev, ino, idx) != NULL;
+  pthread_mutex_unlock(&sh->lock);
+
+  return has;
+}
+
+uint64_t crypto_cache_generation(dev_t dev, ino_t ino){
+  return __sync_fetch_and_add(_cache_generation(dev, ino), 0);
+}
+
+static void _cache_insert(dev_t dev, ino_t ino, size_t idx, const unsigned char *data,
+                          size_t len, int fill, uint64_t gen){
+  uint64_t h = _cache_hash(dev, ino, idx);
+  struct cache_shard *sh = _cache_shard(h);
+
+  // Sampled before the generation, a fill that gets the epoch of an
+  // invalidate that raced it sees its generation too.
+  uint32_t epoch = __atomic_load_n(_cache_epoch(dev, ino), __ATOMIC_SEQ_CST);
+
+  pthread_mutex_lock(&sh->lock);
+  if(fill && gen != crypto_cache_generation(dev, ino)) {
+    pthread_mutex_unlock(&sh->lock);
+    return;
+  }
+
+  struct cache_slot *s = _cache_find(sh, h, dev, ino, idx);
+  if(s == NULL) {
+    s = _cache_victim(sh);
+    s->dev   = dev;
+    s->ino   = ino;
+    s->idx   = idx;
+    s->used  = 1;
+    s->ref   = 0;
+    s->epoch = epoch;
+    long *b = _cache_bucket(sh, h);
+    s->next = *b;
+    *b = s - sh->slots;
+  } else {
+    s->ref  = 1;
+  }
+  s->len = len;
+  memcpy(s->data, data, len);
+  pthread_mutex_unlock(&sh->lock);
+}
+
+void crypto_cache_fill(dev_t dev, ino_t ino, size_t idx, const unsigned char *data,
+                       size_t len, uint64_t gen){
+  if(enabled && len <= block_len)
+    _cache_insert(dev, ino, idx, data, len, 1, gen);
+}
+
+void crypto_cache_put(dev_t dev, ino_t ino, size_t idx, const unsigned char *data, size_t len){
+  if(!enabled || len > block_len)
+    return;
+
+  __sync_fetch_and_add(_cache_generation(dev, ino), 1);
+  _cache_insert(dev, ino, idx, data, len, 0, 0);
+}
+
+void crypto_cache_remove(dev_t dev, ino_t ino, size_t idx){
+  if(!enabled)
+    return;
+
+  __sync_fetch_and_add(_cache_generation(dev, ino), 1);
+
+  uint64_t h = _cache_hash(dev, ino, idx);
+  struct cache_shard *sh = _cache_shard(h);
+
+  pthread_mutex_lock(&sh->lock);
+  struct cache_slot *s = _cache_find(sh, h, dev, ino, idx);
+  if(s != NULL)
+    _cache_unlink(sh, s);
+  pthread_mutex_unlock(&sh->lock);
+}
+
+void crypto_cache_invalidate(dev_t dev, ino_t ino, size_t from, size_t to){
+  if(!enabled)
+    return;
+
+  if(to - from <= CACHE_RANGE_MAX) {
+    for(size_t idx = from; idx < to; idx++)
+      crypto_cache_remove(dev, ino, idx);
+    return;
+  }
+
+  __sync_fetch_and_add(_cache_generation(dev, ino), 1);
+  __sync_fetch_and_add(_cache_epoch(dev, ino), 1);
+}
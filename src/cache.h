@@ -0,0 +1,42 @@
+#ifndef CRYPTOFS_CACHE_H
+#define CRYPTOFS_CACHE_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A cache of decrypted blocks shared by every open file, keyed by the
+// backing file's (dev, ino) and the block index. Eviction is CLOCK within
+// a handful of independently locked shards.
+
+// budget is in bytes of plaintext, block is the plaintext size of a block.
+// A budget smaller than one block per shard disables the cache.
+int crypto_cache_init(size_t budget, size_t block);
+void crypto_cache_destroy(void);
+
+// How many blocks fit, 0 if the cache is disabled.
+size_t crypto_cache_blocks(void);
+
+// Copies the cached block into out, which must hold a whole block, and
+// returns its plaintext length, or -1 if the block is not cached.
+ssize_t crypto_cache_get(dev_t dev, ino_t ino, size_t idx, unsigned char *out);
+
+// Whether the block is cached, without counting as a use of it.
+int crypto_cache_has(dev_t dev, ino_t ino, size_t idx);
+
+// Writes go through put, which replaces whatever was cached. Readers that
+// decrypted a block off of disk use fill with the generation they sampled
+// before reading, so a write that raced with them is never overwritten by
+// the stale block. Generations are per file, give or take hash collisions.
+void crypto_cache_put(dev_t dev, ino_t ino, size_t idx, const unsigned char *data, size_t len);
+uint64_t crypto_cache_generation(dev_t dev, ino_t ino);
+void crypto_cache_fill(dev_t dev, ino_t ino, size_t idx, const unsigned char *data,
+                       size_t len, uint64_t gen);
+
+// Drops a single block, or every block in [from, to), SIZE_MAX for to
+// going on to the end. Larger ranges drop every block of the file, which
+// takes no longer than a small one.
+void crypto_cache_remove(dev_t dev, ino_t ino, size_t idx);
+void crypto_cache_invalidate(dev_t dev, ino_t ino, size_t from, size_t to);
+
+#endif
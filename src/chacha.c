@@ -0,0 +1,463 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "lib/tweetnacl.h"
+#include "src/chacha.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHACHA_AVX2
+#include <immintrin.h>
+#define CHACHA_HW __attribute__((target("avx2")))
+#endif
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define QR(a, b, c, d) \
+  a += b; d ^= a; d = ROTL(d, 16); \
+  c += d; b ^= c; b = ROTL(b, 12); \
+  a += b; d ^= a; d = ROTL(d, 8); \
+  c += d; b ^= c; b = ROTL(b, 7);
+
+static uint32_t _chacha_get32(const unsigned char *p){
+  return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static void _chacha_put32(unsigned char *p, uint32_t v){
+  for(int i = 0; i < 4; i++, v >>= 8)
+    p[i] = v;
+}
+
+static void _chacha_wipe(void *p, size_t len){
+  volatile unsigned char *v = p;
+  while(len-- > 0)
+    *v++ = 0;
+}
+
+// "expand 32-byte k", the key and 16 bytes of counter and nonce.
+static void _chacha_setup(uint32_t s[16], const unsigned char *key, const unsigned char *in){
+  s[0] = 0x61707865;
+  s[1] = 0x3320646e;
+  s[2] = 0x79622d32;
+  s[3] = 0x6b206574;
+  for(int i = 0; i < 8; i++)
+    s[4 + i] = _chacha_get32(key + 4 * i);
+  for(int i = 0; i < 4; i++)
+    s[12 + i] = _chacha_get32(in + 4 * i);
+}
+
+static void _chacha_rounds(uint32_t x[16]){
+  for(int i = 0; i < 10; i++) {
+    QR(x[0], x[4], x[8],  x[12]);
+    QR(x[1], x[5], x[9],  x[13]);
+    QR(x[2], x[6], x[10], x[14]);
+    QR(x[3], x[7], x[11], x[15]);
+    QR(x[0], x[5], x[10], x[15]);
+    QR(x[1], x[6], x[11], x[12]);
+    QR(x[2], x[7], x[8],  x[13]);
+    QR(x[3], x[4], x[9],  x[14]);
+  }
+}
+
+// The subkey for the first 16 bytes of an extended nonce.
+static void _chacha_hchacha(unsigned char *out, const unsigned char *key, const unsigned char *n){
+  uint32_t x[16];
+
+  _chacha_setup(x, key, n);
+  _chacha_rounds(x);
+  for(int i = 0; i < 4; i++) {
+    _chacha_put32(out + 4 * i, x[i]);
+    _chacha_put32(out + 16 + 4 * i, x[12 + i]);
+  }
+  _chacha_wipe(x, sizeof(x));
+}
+
+#ifdef __SSE2__
+
+#define ROTV(x, n) _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+#define QRV(a, b, c, d) \
+  a = _mm_add_epi32(a, b); d = ROTV(_mm_xor_si128(d, a), 16); \
+  c = _mm_add_epi32(c, d); b = ROTV(_mm_xor_si128(b, c), 12); \
+  a = _mm_add_epi32(a, b); d = ROTV(_mm_xor_si128(d, a), 8); \
+  c = _mm_add_epi32(c, d); b = ROTV(_mm_xor_si128(b, c), 7);
+
+// XORs the four blocks from counter s[12] on into 256 bytes. Each vector
+// holds one word of all four, so the rounds are the scalar ones and the
+// words only get sorted into blocks at the end.
+static void _chacha_xor4(const uint32_t s[16], unsigned char *out, const unsigned char *in){
+  const __m128i ctr = _mm_add_epi32(_mm_set1_epi32((int) s[12]), _mm_set_epi32(3, 2, 1, 0));
+  __m128i x[16];
+
+  // The input words are broadcast again for the final add rather than
+  // kept, there are just enough registers for the rounds as it is.
+  for(int i = 0; i < 16; i++)
+    x[i] = i == 12 ? ctr : _mm_set1_epi32((int) s[i]);
+
+  for(int i = 0; i < 10; i++) {
+    QRV(x[0], x[4], x[8],  x[12]);
+    QRV(x[1], x[5], x[9],  x[13]);
+    QRV(x[2], x[6], x[10], x[14]);
+    QRV(x[3], x[7], x[11], x[15]);
+    QRV(x[0], x[5], x[10], x[15]);
+    QRV(x[1], x[6], x[11], x[12]);
+    QRV(x[2], x[7], x[8],  x[13]);
+    QRV(x[3], x[4], x[9],  x[14]);
+  }
+
+  for(int g = 0; g < 4; g++) {
+    __m128i a[4];
+    for(int j = 0; j < 4; j++) {
+      int w = 4 * g + j;
+      a[j] = _mm_add_epi32(x[w], w == 12 ? ctr : _mm_set1_epi32((int) s[w]));
+    }
+    __m128i t0 = _mm_unpacklo_epi32(a[0], a[1]), t1 = _mm_unpacklo_epi32(a[2], a[3]);
+    __m128i t2 = _mm_unpackhi_epi32(a[0], a[1]), t3 = _mm_unpackhi_epi32(a[2], a[3]);
+    __m128i b[4] = {
+      _mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1),
+      _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3)
+    };
+    for(int j = 0; j < 4; j++) {
+      size_t at = 64 * j + 16 * g;
+      __m128i d = _mm_loadu_si128((const __m128i *) (in + at));
+      _mm_storeu_si128((__m128i *) (out + at), _mm_xor_si128(d, b[j]));
+    }
+  }
+}
+
+#endif
+
+#ifdef CHACHA_AVX2
+
+#define ROT8(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+#define QR8(a, b, c, d) \
+  a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16); \
+  c = _mm256_add_epi32(c, d); b = ROT8(_mm256_xor_si256(b, c), 12); \
+  a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8); \
+  c = _mm256_add_epi32(c, d); b = ROT8(_mm256_xor_si256(b, c), 7);
+
+// _chacha_xor4 eight blocks and 512 bytes wide. The 4x4 transposes work
+// within 128 bit lanes, which leaves blocks j and j + 4 in one vector.
+CHACHA_HW static void _chacha_xor8(const uint32_t s[16], unsigned char *out, const unsigned char *in){
+  const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                         2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+  const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                        3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+  const __m256i ctr = _mm256_add_epi32(_mm256_set1_epi32((int) s[12]),
+                                       _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  __m256i x[16];
+
+  for(int i = 0; i < 16; i++)
+    x[i] = i == 12 ? ctr : _mm256_set1_epi32((int) s[i]);
+
+  for(int i = 0; i < 10; i++) {
+    QR8(x[0], x[4], x[8],  x[12]);
+    QR8(x[1], x[5], x[9],  x[13]);
+    QR8(x[2], x[6], x[10], x[14]);
+    QR8(x[3], x[7], x[11], x[15]);
+    QR8(x[0], x[5], x[10], x[15]);
+    QR8(x[1], x[6], x[11], x[12]);
+    QR8(x[2], x[7], x[8],  x[13]);
+    QR8(x[3], x[4], x[9],  x[14]);
+  }
+
+  for(int g = 0; g < 4; g++) {
+    __m256i a[4];
+    for(int j = 0; j < 4; j++) {
+      int w = 4 * g + j;
+      a[j] = _mm256_add_epi32(x[w], w == 12 ? ctr : _mm256_set1_epi32((int) s[w]));
+    }
+    __m256i t0 = _mm256_unpacklo_epi32(a[0], a[1]), t1 = _mm256_unpacklo_epi32(a[2], a[3]);
+    __m256i t2 = _mm256_unpackhi_epi32(a[0], a[1]), t3 = _mm256_unpackhi_epi32(a[2], a[3]);
+    __m256i b[4] = {
+      _mm256_unpacklo_epi64(t0, t1), _mm256_unpackhi_epi64(t0, t1),
+      _mm256_unpacklo_epi64(t2, t3), _mm256_unpackhi_epi64(t2, t3)
+    };
+    for(int j = 0; j < 4; j++) {
+      size_t lo = 64 * j + 16 * g, hi = lo + 256;
+      __m128i dl = _mm_loadu_si128((const __m128i *) (in + lo));
+      __m128i dh = _mm_loadu_si128((const __m128i *) (in + hi));
+      _mm_storeu_si128((__m128i *) (out + lo), _mm_xor_si128(dl, _mm256_castsi256_si128(b[j])));
+      _mm_storeu_si128((__m128i *) (out + hi), _mm_xor_si128(dh, _mm256_extracti128_si256(b[j], 1)));
+    }
+  }
+}
+
+#endif
+
+// XORs the keystream from block ctr on into len bytes.
+static void _chacha_xor(const uint32_t s0[16], unsigned char *out, const unsigned char *in,
+                        size_t len, uint32_t ctr){
+  uint32_t s[16], x[16];
+  unsigned char ks[64];
+  size_t off = 0;
+
+  memcpy(s, s0, sizeof(s));
+#ifdef CHACHA_AVX2
+  if(len >= 512 && __builtin_cpu_supports("avx2"))
+    for(; off + 512 <= len; off += 512, ctr += 8) {
+      s[12] = ctr;
+      _chacha_xor8(s, out + off, in + off);
+    }
+#endif
+#ifdef __SSE2__
+  for(; off + 256 <= len; off += 256, ctr += 4) {
+    s[12] = ctr;
+    _chacha_xor4(s, out + off, in + off);
+  }
+#endif
+  for(; off < len; off += 64, ctr++) {
+    s[12] = ctr;
+    memcpy(x, s, sizeof(x));
+    _chacha_rounds(x);
+    for(int i = 0; i < 16; i++)
+      _chacha_put32(ks + 4 * i, x[i] + s[i]);
+    for(size_t j = 0; j < 64 && off + j < len; j++)
+      out[off + j] = in[off + j] ^ ks[j];
+  }
+  _chacha_wipe(x, sizeof(x));
+  _chacha_wipe(ks, sizeof(ks));
+}
+
+// Poly1305 after poly1305-donna. Only whole 16 byte blocks are fed to it,
+// the AEAD pads everything else with zeros.
+#ifdef __SIZEOF_INT128__
+
+// Three limbs of 44, 44 and 42 bits, multiplied into 128 bits.
+struct chacha_poly {
+  uint64_t r[3];
+  uint64_t h[3];
+  uint64_t pad[2];
+};
+
+__extension__ typedef unsigned __int128 u128;
+
+#define M44 0xfffffffffffULL
+#define M42 0x3ffffffffffULL
+
+static uint64_t _chacha_get64(const unsigned char *p){
+  return (uint64_t) _chacha_get32(p) | (uint64_t) _chacha_get32(p + 4) << 32;
+}
+
+static void _chacha_poly_init(struct chacha_poly *p, const unsigned char *k){
+  uint64_t t0 = _chacha_get64(k), t1 = _chacha_get64(k + 8);
+  p->r[0] = t0 & 0xffc0fffffffULL;
+  p->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+  p->r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+  p->h[0] = p->h[1] = p->h[2] = 0;
+  p->pad[0] = _chacha_get64(k + 16);
+  p->pad[1] = _chacha_get64(k + 24);
+}
+
+static void _chacha_poly_blocks(struct chacha_poly *p, const unsigned char *m, size_t len){
+  const uint64_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2];
+  const uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+  uint64_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], c;
+
+  for(; len >= 16; m += 16, len -= 16) {
+    uint64_t t0 = _chacha_get64(m), t1 = _chacha_get64(m + 8);
+    h0 += t0 & M44;
+    h1 += ((t0 >> 44) | (t1 << 20)) & M44;
+    h2 += ((t1 >> 24) & M42) | (1ULL << 40);
+
+    u128 d0 = (u128) h0 * r0 + (u128) h1 * s2 + (u128) h2 * s1;
+    u128 d1 = (u128) h0 * r1 + (u128) h1 * r0 + (u128) h2 * s2;
+    u128 d2 = (u128) h0 * r2 + (u128) h1 * r1 + (u128) h2 * r0;
+
+    c = d0 >> 44; h0 = (uint64_t) d0 & M44; d1 += c;
+    c = d1 >> 44; h1 = (uint64_t) d1 & M44; d2 += c;
+    c = d2 >> 42; h2 = (uint64_t) d2 & M42;
+    h0 += c * 5;
+    c = h0 >> 44; h0 &= M44; h1 += c;
+  }
+
+  p->h[0] = h0; p->h[1] = h1; p->h[2] = h2;
+}
+
+static void _chacha_poly_finish(struct chacha_poly *p, unsigned char *mac){
+  uint64_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], c;
+
+  c = h1 >> 44; h1 &= M44; h2 += c;
+  c = h2 >> 42; h2 &= M42; h0 += c * 5;
+  c = h0 >> 44; h0 &= M44; h1 += c;
+  c = h1 >> 44; h1 &= M44; h2 += c;
+  c = h2 >> 42; h2 &= M42; h0 += c * 5;
+  c = h0 >> 44; h0 &= M44; h1 += c;
+
+  // h - p, picked instead of h if it didn't go negative.
+  uint64_t g0 = h0 + 5; c = g0 >> 44; g0 &= M44;
+  uint64_t g1 = h1 + c; c = g1 >> 44; g1 &= M44;
+  uint64_t g2 = h2 + c - (1ULL << 42);
+  uint64_t mask = (g2 >> 63) - 1;
+  h0 = (h0 & ~mask) | (g0 & mask);
+  h1 = (h1 & ~mask) | (g1 & mask);
+  h2 = (h2 & ~mask) | (g2 & mask);
+
+  uint64_t t0 = p->pad[0], t1 = p->pad[1];
+  h0 += t0 & M44; c = h0 >> 44; h0 &= M44;
+  h1 += (((t0 >> 44) | (t1 << 20)) & M44) + c; c = h1 >> 44; h1 &= M44;
+  h2 += ((t1 >> 24) & M42) + c; h2 &= M42;
+
+  h0 = h0 | (h1 << 44);
+  h1 = (h1 >> 20) | (h2 << 24);
+  _chacha_put32(mac,      h0);
+  _chacha_put32(mac + 4,  h0 >> 32);
+  _chacha_put32(mac + 8,  h1);
+  _chacha_put32(mac + 12, h1 >> 32);
+  _chacha_wipe(p, sizeof(*p));
+}
+
+#else
+
+// Without 128 bit products the limbs are 26 bits.
+struct chacha_poly {
+  uint32_t r[5];
+  uint32_t h[5];
+  uint32_t pad[4];
+};
+
+static void _chacha_poly_init(struct chacha_poly *p, const unsigned char *k){
+  p->r[0] = _chacha_get32(k) & 0x3ffffff;
+  p->r[1] = (_chacha_get32(k + 3) >> 2) & 0x3ffff03;
+  p->r[2] = (_chacha_get32(k + 6) >> 4) & 0x3ffc0ff;
+  p->r[3] = (_chacha_get32(k + 9) >> 6) & 0x3f03fff;
+  p->r[4] = (_chacha_get32(k + 12) >> 8) & 0x00fffff;
+  for(int i = 0; i < 5; i++)
+    p->h[i] = 0;
+  for(int i = 0; i < 4; i++)
+    p->pad[i] = _chacha_get32(k + 16 + 4 * i);
+}
+
+static void _chacha_poly_blocks(struct chacha_poly *p, const unsigned char *m, size_t len){
+  const uint32_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3], r4 = p->r[4];
+  const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+  uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+
+  for(; len >= 16; m += 16, len -= 16) {
+    h0 += _chacha_get32(m) & 0x3ffffff;
+    h1 += (_chacha_get32(m + 3) >> 2) & 0x3ffffff;
+    h2 += (_chacha_get32(m + 6) >> 4) & 0x3ffffff;
+    h3 += (_chacha_get32(m + 9) >> 6) & 0x3ffffff;
+    h4 += (_chacha_get32(m + 12) >> 8) | (1 << 24);
+
+    uint64_t d0 = (uint64_t) h0 * r0 + (uint64_t) h1 * s4 + (uint64_t) h2 * s3 + (uint64_t) h3 * s2 + (uint64_t) h4 * s1;
+    uint64_t d1 = (uint64_t) h0 * r1 + (uint64_t) h1 * r0 + (uint64_t) h2 * s4 + (uint64_t) h3 * s3 + (uint64_t) h4 * s2;
+    uint64_t d2 = (uint64_t) h0 * r2 + (uint64_t) h1 * r1 + (uint64_t) h2 * r0 + (uint64_t) h3 * s4 + (uint64_t) h4 * s3;
+    uint64_t d3 = (uint64_t) h0 * r3 + (uint64_t) h1 * r2 + (uint64_t) h2 * r1 + (uint64_t) h3 * r0 + (uint64_t) h4 * s4;
+    uint64_t d4 = (uint64_t) h0 * r4 + (uint64_t) h1 * r3 + (uint64_t) h2 * r2 + (uint64_t) h3 * r1 + (uint64_t) h4 * r0;
+
+    uint32_t c;
+    c = d0 >> 26; h0 = d0 & 0x3ffffff; d1 += c;
+    c = d1 >> 26; h1 = d1 & 0x3ffffff; d2 += c;
+    c = d2 >> 26; h2 = d2 & 0x3ffffff; d3 += c;
+    c = d3 >> 26; h3 = d3 & 0x3ffffff; d4 += c;
+    c = d4 >> 26; h4 = d4 & 0x3ffffff;
+    h0 += c * 5;
+    c = h0 >> 26; h0 &= 0x3ffffff; h1 += c;
+  }
+
+  p->h[0] = h0; p->h[1] = h1; p->h[2] = h2; p->h[3] = h3; p->h[4] = h4;
+}
+
+static void _chacha_poly_finish(struct chacha_poly *p, unsigned char *mac){
+  uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4], c;
+
+  c = h1 >> 26; h1 &= 0x3ffffff; h2 += c;
+  c = h2 >> 26; h2 &= 0x3ffffff; h3 += c;
+  c = h3 >> 26; h3 &= 0x3ffffff; h4 += c;
+  c = h4 >> 26; h4 &= 0x3ffffff; h0 += c * 5;
+  c = h0 >> 26; h0 &= 0x3ffffff; h1 += c;
+
+  // h - p, picked instead of h if it didn't go negative.
+  uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+  uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+  uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+  uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+  uint32_t g4 = h4 + c - (1 << 26);
+  uint32_t mask = (g4 >> 31) - 1;
+  h0 = (h0 & ~mask) | (g0 & mask);
+  h1 = (h1 & ~mask) | (g1 & mask);
+  h2 = (h2 & ~mask) | (g2 & mask);
+  h3 = (h3 & ~mask) | (g3 & mask);
+  h4 = (h4 & ~mask) | (g4 & mask);
+
+  h0 = h0 | (h1 << 26);
+  h1 = (h1 >> 6) | (h2 << 20);
+  h2 = (h2 >> 12) | (h3 << 14);
+  h3 = (h3 >> 18) | (h4 << 8);
+
+  uint64_t f;
+  f = (uint64_t) h0 + p->pad[0];             _chacha_put32(mac, f);
+  f = (uint64_t) h1 + p->pad[1] + (f >> 32); _chacha_put32(mac + 4, f);
+  f = (uint64_t) h2 + p->pad[2] + (f >> 32); _chacha_put32(mac + 8, f);
+  f = (uint64_t) h3 + p->pad[3] + (f >> 32); _chacha_put32(mac + 12, f);
+  _chacha_wipe(p, sizeof(*p));
+}
+
+#endif
+
+// The tag over ciphertext with no associated data: the ciphertext padded
+// to 16 bytes, then the two lengths.
+static void _chacha_mac(struct chacha_poly *p, const unsigned char *c, size_t len){
+  unsigned char b[16];
+  size_t whole = len & ~(size_t) 15;
+
+  _chacha_poly_blocks(p, c, whole);
+  if(whole < len) {
+    memset(b, 0, 16);
+    memcpy(b, c + whole, len - whole);
+    _chacha_poly_blocks(p, b, 16);
+  }
+
+  memset(b, 0, 16);
+  for(int i = 0; i < 8; i++)
+    b[8 + i] = (uint64_t) len >> (8 * i);
+  _chacha_poly_blocks(p, b, 16);
+}
+
+static void _chacha_crypt(const unsigned char *key, unsigned char *out, const unsigned char *in,
+                          size_t len, const unsigned char *n, unsigned char *tag, int enc){
+  unsigned char sub[32], block[64], ctr[16];
+  uint32_t s[16];
+  struct chacha_poly p;
+
+  _chacha_hchacha(sub, key, n);
+  memset(ctr, 0, 8);
+  memcpy(ctr + 8, n + 16, 8);
+  _chacha_setup(s, sub, ctr);
+
+  // Block 0 keys Poly1305, the message starts at block 1.
+  memset(block, 0, sizeof(block));
+  _chacha_xor(s, block, block, sizeof(block), 0);
+  _chacha_poly_init(&p, block);
+
+  // Decrypting may be in place, authenticate the ciphertext while it is there.
+  if(!enc)
+    _chacha_mac(&p, in, len);
+  _chacha_xor(s, out, in, len, 1);
+  if(enc)
+    _chacha_mac(&p, out, len);
+  _chacha_poly_finish(&p, tag);
+
+  _chacha_wipe(sub, sizeof(sub));
+  _chacha_wipe(block, sizeof(block));
+  _chacha_wipe(s, sizeof(s));
+}
+
+void crypto_chacha_seal(const unsigned char *key, unsigned char *c, unsigned char *tag,
+                        const unsigned char *m, size_t len, const unsigned char *n){
+  _chacha_crypt(key, c, m, len, n, tag, 1);
+}
+
+int crypto_chacha_open(const unsigned char *key, unsigned char *m, const unsigned char *c,
+                       const unsigned char *tag, size_t len, const unsigned char *n){
+  unsigned char want[16];
+
+  _chacha_crypt(key, m, c, len, n, want, 0);
+  if(crypto_verify_16(want, tag) != 0) {
+    memset(m, 0, len);
+    return -1;
+  }
+  return 0;
+}
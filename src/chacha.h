@@ -0,0 +1,22 @@
+#ifndef CRYPTOFS_CHACHA_H
+#define CRYPTOFS_CHACHA_H
+
+#include <stddef.h>
+
+// XChaCha20-Poly1305: the ChaCha20-Poly1305 AEAD of RFC 8439, keyed
+// through HChaCha20 so that it takes a 192 bit nonce, which is safe to
+// pick at random. There is no associated data. ChaCha20 runs eight
+// blocks at once with AVX2 and four with SSE2, which is most of its speed.
+
+#define CRYPTO_CHACHA_KEYBYTES 32
+#define CRYPTO_CHACHA_NONCEBYTES 24
+#define CRYPTO_CHACHA_TAGBYTES 16
+
+void crypto_chacha_seal(const unsigned char *key, unsigned char *c, unsigned char *tag,
+                        const unsigned char *m, size_t len, const unsigned char *n);
+
+// Returns -1 and clears m if the tag doesn't match.
+int crypto_chacha_open(const unsigned char *key, unsigned char *m, const unsigned char *c,
+                       const unsigned char *tag, size_t len, const unsigned char *n);
+
+#endif
@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/stats.h"
+#include "src/control.h"
+
+struct crypto_control {
+  char *text;
+  size_t len;
+};
+
+const char *const crypto_control_names[] = { "stats", "stats.json", NULL };
+
+int crypto_control_path(const char *path){
+  static const char dir[] = "/" CRYPTO_CONTROL_NAME;
+  if(strncmp(path, dir, sizeof(dir) - 1) != 0)
+    return CRYPTO_CONTROL_NONE;
+
+  path += sizeof(dir) - 1;
+  if(*path == '\0')
+    return CRYPTO_CONTROL_DIR;
+  if(*path != '/')
+    return CRYPTO_CONTROL_NONE;
+  return crypto_control_name(path + 1);
+}
+
+int crypto_control_name(const char *name){
+  if(strcmp(name, "stats") == 0)
+    return CRYPTO_CONTROL_STATS;
+  if(strcmp(name, "stats.json") == 0)
+    return CRYPTO_CONTROL_STATS_JSON;
+  return CRYPTO_CONTROL_MISSING;
+}
+
+int crypto_control_attr(int which, struct stat *st){
+  if(which == CRYPTO_CONTROL_MISSING)
+    return -ENOENT;
+
+  memset(st, 0, sizeof(*st));
+  st->st_uid   = getuid();
+  st->st_gid   = getgid();
+  st->st_mtime = st->st_atime = st->st_ctime = time(NULL);
+  if(which == CRYPTO_CONTROL_DIR) {
+    st->st_mode  = S_IFDIR | 0555;
+    st->st_nlink = 2;
+  } else {
+    st->st_mode  = S_IFREG | 0644;
+    st->st_nlink = 1;
+  }
+  return 0;
+}
+
+int crypto_control_open(int which, struct crypto_control **ctl){
+  if(which == CRYPTO_CONTROL_DIR)
+    return -EISDIR;
+  if(which == CRYPTO_CONTROL_MISSING)
+    return -ENOENT;
+
+  struct crypto_control *c = malloc(sizeof(*c));
+  if(c == NULL)
+    return -ENOMEM;
+  ssize_t len = crypto_stats_render(&c->text, which == CRYPTO_CONTROL_STATS_JSON);
+  if(len < 0) {
+    free(c);
+    return len;
+  }
+
+  c->len = len;
+  *ctl = c;
+  return 0;
+}
+
+int crypto_control_read(struct crypto_control *ctl, char *buf, size_t size, off_t off){
+  if(off >= (off_t) ctl->len)
+    return 0;
+  if(size > ctl->len - off)
+    size = ctl->len - off;
+  memcpy(buf, ctl->text + off, size);
+  return size;
+}
+
+int crypto_control_write(size_t size){
+  crypto_stats_reset();
+  return size;
+}
+
+void crypto_control_release(struct crypto_control *ctl){
+  free(ctl->text);
+  free(ctl);
+}
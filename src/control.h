@@ -0,0 +1,42 @@
+#ifndef CRYPTOFS_CONTROL_H
+#define CRYPTOFS_CONTROL_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// The control directory at the root of every mount, in place of anything
+// the backing directory has under that name, with the stats in it. Both
+// frontends serve it. Nothing can be made, removed or renamed in it.
+
+#define CRYPTO_CONTROL_NAME ".cryptofs"
+
+enum {
+  CRYPTO_CONTROL_NONE,        // not in the control directory
+  CRYPTO_CONTROL_DIR,
+  CRYPTO_CONTROL_STATS,
+  CRYPTO_CONTROL_STATS_JSON,
+  CRYPTO_CONTROL_MISSING      // a name in it that isn't there
+};
+
+// Which of the above path, from the root of the mount, is.
+int crypto_control_path(const char *path);
+// Which of the above name in the control directory is.
+int crypto_control_name(const char *name);
+
+// What is in the control directory, in order, NULL at the end.
+extern const char *const crypto_control_names[];
+
+// The attributes of one of them, -ENOENT for CRYPTO_CONTROL_MISSING.
+int crypto_control_attr(int which, struct stat *st);
+
+// What is in a control file is rendered when it is opened and read out
+// of that copy, so a reader sees one consistent snapshot however small
+// its reads. Its size is only known once opened, so reads have to bypass
+// the page cache. Writing anything to one resets the stats.
+struct crypto_control;
+int crypto_control_open(int which, struct crypto_control **ctl);
+int crypto_control_read(struct crypto_control *ctl, char *buf, size_t size, off_t off);
+int crypto_control_write(size_t size);
+void crypto_control_release(struct crypto_control *ctl);
+
+#endif
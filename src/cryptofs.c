@@ -6,53 +6,773 @@
 #include <string.h>
 #include <errno.h>
 #include <dirent.h>
-#include <termios.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/resource.h>
 
 #include "lib/tweetnacl.h"
+#include "src/cache.h"
+#include "src/pool.h"
+#include "src/writer.h"
+#include "src/io.h"
+#include "src/volume.h"
+#include "src/suite.h"
+#include "src/gcm.h"
+#include "src/sizes.h"
+#include "src/dirs.h"
+#include "src/cryptofs.h"
+#include "src/lowlevel.h"
+#include "src/trace.h"
+#include "src/stats.h"
+#include "src/control.h"
 #include <fuse.h>
 
 static char *crypto_dir;
 static unsigned char key[crypto_secretbox_KEYBYTES];
-static const int crypto_PADDING = crypto_secretbox_NONCEBYTES + crypto_secretbox_BOXZEROBYTES;
-static const size_t block_size = 4096; // OSX Page Size
+static const int crypto_PADDING = CRYPTO_SUITE_NONCEBYTES + CRYPTO_SUITE_TAGBYTES;
+static const size_t pool_min = 4;     // blocks in a batch before it is spread over the pool
+
+static const size_t size_entries = 16384; // file sizes remembered when files have headers
+static const size_t dir_entries  = 1024;  // directory descriptors kept open, at most
+
+// Set from the volume header by _crypto_volume_setup, the batch sizes scale
+// so that a request covers about the same number of bytes whatever the
+// block size is.
+static size_t block_size  = CRYPTO_BLOCK_LEGACY;
+static size_t read_batch  = 32;   // blocks fetched per pread in crypto_read
+static size_t write_batch = 32;   // whole blocks sealed per pwrite in crypto_write
+static size_t dirty_max   = 16;   // written blocks buffered per file before sealing
+static size_t ahead_max   = 0;    // blocks a sequential reader is read ahead of at most
+static int write_behind   = 0;    // sealed blocks are queued to the writer threads
+static int file_headers   = 0;    // files start with a header holding their size
+static int holes          = 0;    // blocks of all zeros read as zeros
+static off_t data_start   = 0;    // where block 0 starts in the backing file
+
+// With file headers every backing file starts with a sealed block of
+//
+//   "cfs-file" | version (u32) | block_size (u32) | size (u64)
+//
+// in front of block 0. The size in the header only has to be right when
+// it is past the end of the blocks, which is all that truncate leaves
+// behind, so writes never have to touch it. An empty file gets its header
+// with the first write.
+#define HEADER_MAGIC "cfs-file"
+#define HEADER_VERSION 1
+#define HEADER_PLAIN 24
+#define HEADER_SIZE (CRYPTO_SUITE_NONCEBYTES + CRYPTO_SUITE_TAGBYTES + HEADER_PLAIN)
+
+static struct crypto_options {
+  unsigned long cache_mb;   // budget for decrypted blocks shared by all files
+  unsigned long readahead_kb; // most a sequential reader is read ahead of, 0 for none
+  long threads;             // crypto workers, -1 for one per online cpu
+  unsigned long writers;    // threads sealed blocks are written out on, 0 to write them inline
+  unsigned long io_depth;   // batches read ahead or written behind kept in flight at once
+  unsigned long block_size; // block size for a new volume, 0 for the default
+  int file_headers;         // give the files of a new volume headers
+  int holes;                // let a new volume leave unwritten blocks as holes
+  int lowlevel;             // serve through the inode based frontend
+  char *cipher;             // suite for a new volume, by name
+  char *profile;            // named set of mount options, see crypto_profiles
+  int writeback;            // let the kernel cache writes, where it can
+  char *trace;              // file to record every call to, see trace.h
+} crypto_opts = {
+  .cache_mb     = 32,
+  .readahead_kb = 4096,
+  .threads      = -1,
+  .writers      = 0,
+  .io_depth     = 8,
+  .block_size   = 0,
+  .file_headers = 0,
+  .holes        = 0,
+  .lowlevel     = 0,
+  .cipher       = NULL,
+  .profile      = NULL,
+  .writeback    = 0,
+  .trace        = NULL
+};
+
+#define CRYPTO_OPT(t, p) { t, offsetof(struct crypto_options, p), 1 }
+
+static const struct fuse_opt crypto_opt_spec[] = {
+  CRYPTO_OPT("cache_mb=%lu", cache_mb),
+  CRYPTO_OPT("readahead_kb=%lu", readahead_kb),
+  CRYPTO_OPT("crypto_threads=%ld", threads),
+  CRYPTO_OPT("write_threads=%lu", writers),
+  CRYPTO_OPT("io_depth=%lu", io_depth),
+  CRYPTO_OPT("block_size=%lu", block_size),
+  CRYPTO_OPT("file_headers", file_headers),
+  CRYPTO_OPT("holes", holes),
+  CRYPTO_OPT("lowlevel", lowlevel),
+  CRYPTO_OPT("cipher=%s", cipher),
+  CRYPTO_OPT("writeback_cache", writeback),
+  CRYPTO_OPT("trace=%s", trace),
+  FUSE_OPT_END
+};
+
+// Looked for on its own, the profile has to be in place before the rest
+// of the command line is parsed.
+static const struct fuse_opt crypto_profile_spec[] = {
+  CRYPTO_OPT("profile=%s", profile),
+  FUSE_OPT_END
+};
+
+// Mount options for common workloads, they go in front of the ones on the
+// command line so anything given there still wins. Apart from
+// write_threads they are libfuse's own, both frontends take them.
+static const struct crypto_profile {
+  const char *name;
+  const char *opts;
+} crypto_profiles[] = {
+  // Large files read and written front to back: the biggest requests the
+  // kernel will send, deep readahead, page cache kept across opens of
+  // files that didn't change, and sealed blocks written behind. Not
+  // writeback_cache, which libfuse 2 has no way to ask for.
+  { "throughput", "-obig_writes,max_write=131072,max_read=131072,max_readahead=1048576,"
+                  "async_read,auto_cache,write_threads=2" },
+  // Trees of many small files: names and attributes are trusted for
+  // longer, and so are names that don't exist.
+  { "metadata-heavy", "-obig_writes,auto_cache,entry_timeout=30,attr_timeout=30,negative_timeout=15" },
+  { NULL, NULL }
+};
 
-#define WITH_CRYPTO_PATH(line) \
-  char *cpath = _crypto_path(path); \
-  if(cpath == NULL) return -ENOMEM; \
+#define WITH_CRYPTO_AT(line) \
+  struct crypto_at at; \
+  int at_err = crypto_dirs_at(path, &at); \
+  if(at_err < 0) return at_err; \
   line; \
-  free(cpath);
+  crypto_dirs_done(&at);
 
 #define CHECK_ERR \
   if(err == -1) return -errno; \
   return 0;
 
+#define CRYPTO_FILE(inf) ((struct crypto_file *) (uintptr_t) (inf)->fh)
+#define NODE_BUCKETS 256
+
+// Plaintext of a block that has been written to but not sealed yet.
+struct crypto_dirty {
+  size_t idx;
+  size_t len;               // bytes of data that hold file contents
+  size_t lo, hi;            // run of data written since it was loaded
+  uint64_t stamp;           // when it was last written, the oldest is sealed first
+  unsigned char *data;
+};
+
+// State shared by every handle open on the same backing file.
+struct crypto_node {
+  dev_t dev;
+  ino_t ino;
+  int refs;                 // open handles, guarded by nodes_lock
+  int fd;                   // writable descriptor dirty blocks are sealed to, or -1
+  pthread_rwlock_t lock;    // reads share it, writes and flushes are exclusive
+  off_t size;               // plaintext size, counting dirty blocks
+  off_t data;               // plaintext that blocks exist for, the rest up to size reads as zeros
+  int headed;               // the backing file has its header, when files have them
+  size_t ndirty;
+  uint64_t clock;
+  struct crypto_dirty *dirty;   // dirty_max entries, allocated on first write
+  unsigned char *dirty_data;    // their buffers, which seals shuffle between entries
+  unsigned char *wbuf;          // write_batch sealed blocks, allocated on first use
+  struct crypto_writeq wq;      // sealed blocks on their way to fd, with write_behind
+  struct crypto_node *next;
+};
+
+// Per open file state, hung off of fuse_file_info::fh.
+struct crypto_file {
+  int fd;
+  int flags;                // flags the file was opened with
+  struct crypto_node *node;
+  pthread_mutex_t lock;     // guards scratch
+  unsigned char *scratch;   // read space for crypto_read, allocated on first use
+  pthread_mutex_t ahead_lock;   // guards ahead
+  struct {
+    off_t next;             // where a sequential reader reads next
+    size_t window;          // blocks to keep ahead of it, 0 while reads jump around
+    size_t end;             // blocks before this one have been fetched ahead
+  } ahead;
+};
+
+static struct crypto_node *nodes[NODE_BUCKETS];
+static pthread_mutex_t nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+static int ahead_jobs = 0;        // read ahead fetches queued or running
+
 char * _crypto_path(const char *path){
   char *ret;
   asprintf(&ret, path[0] == '/' ? "%s%s" : "%s/%s" , crypto_dir, path);
   return ret;
 }
 
-static int crypto_fsync(const char *path, int datasync, struct fuse_file_info *inf){
-  (void) path;
+static size_t _crypto_scale(size_t bytes, size_t min){
+  size_t n = bytes / block_size;
+  return n < min ? min : n;
+}
+
+static void _crypto_volume_setup(const struct crypto_volume *vol){
+  block_size   = vol->block_size;
+  read_batch   = _crypto_scale(128 << 10, 1);
+  write_batch  = _crypto_scale(128 << 10, 1);
+  dirty_max    = _crypto_scale(64 << 10, 2);
+  file_headers = (vol->flags & CRYPTO_VOLUME_HEADERS) != 0;
+  data_start   = file_headers ? HEADER_SIZE : 0;
+  holes        = (vol->flags & CRYPTO_VOLUME_HOLES) != 0;
+  crypto_suite_init(vol->suite, key);
+}
+
+static off_t _crypto_block_off(size_t idx){
+  return data_start + (off_t) block_size * idx;
+}
+
+// The file that holds the volume header isn't part of the file system,
+// and nothing can be made in the control directory.
+static int _crypto_reserved(const char *path){
+  return strcmp(path, "/" CRYPTO_VOLUME_FILE) == 0 || crypto_control_path(path) != CRYPTO_CONTROL_NONE;
+}
+
+// Plaintext size of a file with csize bytes of ciphertext.
+static off_t _crypto_plain_size(off_t csize){
+  csize -= data_start;
+  if(csize <= 0)
+    return 0;
+
+  off_t num_blocks = csize / block_size;
+  if(csize % block_size > 0)
+    num_blocks++;
+  return csize - num_blocks * crypto_PADDING;
+}
+
+// A block on disk is laid out as nonce | tag | ciphertext.
+#define BLOCK_TAG(block) ((block) + CRYPTO_SUITE_NONCEBYTES)
+#define BLOCK_DATA(block) ((block) + crypto_PADDING)
+
+// In volumes with holes, a block of clen zero bytes is a hole, what the
+// backing file holds wherever it was extended or had a hole punched into
+// it. It reads as zeros without going near the cipher. Sealed blocks have
+// random nonces, so they are never mistaken for one and bail out on the
+// first bytes. Whoever can write the backing file can still zero whole
+// blocks unnoticed, which is why holes are only for volumes created with
+// -o holes. Every other volume seals every block and fails zeroed ones.
+static int _crypto_block_hole(const unsigned char *block, size_t clen){
+  if(!holes)
+    return 0;
+  for(size_t i = 0; i < clen; i++)
+    if(block[i] != 0)
+      return 0;
+  return 1;
+}
+
+// Authenticates and decrypts the block of clen ciphertext bytes straight
+// into out, returning the number of plaintext bytes.
+static ssize_t _crypto_open_block(unsigned char *out, const unsigned char *block, size_t clen){
+  if(clen < crypto_PADDING || clen > block_size)
+    return -ENXIO;
+
+  if(_crypto_block_hole(block, clen)) {
+    crypto_stats_add(CRYPTO_STATS_HOLES, 1);
+    memset(out, 0, clen - crypto_PADDING);
+    return clen - crypto_PADDING;
+  }
+
+  if(crypto_suite_open(out, BLOCK_DATA(block), BLOCK_TAG(block), clen - crypto_PADDING, block) == -1) {
+    crypto_stats_add(CRYPTO_STATS_AUTH_FAILED, 1);
+    return -ENXIO;
+  }
+  crypto_stats_add(CRYPTO_STATS_OPENED, 1);
+  return clen - crypto_PADDING;
+}
+
+// Encrypts len bytes of plaintext under a fresh nonce into block, which
+// must have room for len + crypto_PADDING bytes.
+static int _crypto_seal_block(unsigned char *block, const unsigned char *in, size_t len){
+  randombytes(block, CRYPTO_SUITE_NONCEBYTES);
+
+  if(crypto_suite_seal(BLOCK_DATA(block), BLOCK_TAG(block), in, len, block) < 0)
+    return -ENXIO;
+  crypto_stats_add(CRYPTO_STATS_SEALED, 1);
+  crypto_stats_add(CRYPTO_STATS_BYTES_SEALED, len);
+  crypto_stats_add(CRYPTO_STATS_PADDING, crypto_PADDING);
+  return 0;
+}
+
+// Reads the plaintext size out of a file's header. A file without any
+// bytes has no header yet and is empty.
+static int _crypto_header_read(int fd, off_t *size){
+  unsigned char raw[HEADER_SIZE];
+  unsigned char plain[HEADER_PLAIN];
+
+  ssize_t res = pread(fd, raw, HEADER_SIZE, 0);
+  if(res == -1)
+    return -errno;
+  crypto_stats_add(CRYPTO_STATS_BACKING_READ, res);
+  if(res == 0) {
+    *size = 0;
+    return 0;
+  }
+
+  if(_crypto_open_block(plain, raw, res) != HEADER_PLAIN ||
+     memcmp(plain, HEADER_MAGIC, 8) != 0)
+    return -ENXIO;
+
+  uint64_t v = 0;
+  for(int i = 0; i < 8; i++)
+    v |= (uint64_t) plain[16 + i] << (8 * i);
+
+  uint32_t version = 0, bsize = 0;
+  for(int i = 0; i < 4; i++) {
+    version |= (uint32_t) plain[8 + i] << (8 * i);
+    bsize   |= (uint32_t) plain[12 + i] << (8 * i);
+  }
+  if(version != HEADER_VERSION || bsize != block_size || v > INT64_MAX)
+    return -ENXIO;
+
+  *size = v;
+  return 0;
+}
+
+static int _crypto_header_write(int fd, off_t size){
+  unsigned char raw[HEADER_SIZE];
+  unsigned char plain[HEADER_PLAIN];
+
+  memcpy(plain, HEADER_MAGIC, 8);
+  for(int i = 0; i < 4; i++) {
+    plain[8 + i]  = HEADER_VERSION >> (8 * i);
+    plain[12 + i] = block_size >> (8 * i);
+  }
+  for(int i = 0; i < 8; i++)
+    plain[16 + i] = (uint64_t) size >> (8 * i);
+
+  int err = _crypto_seal_block(raw, plain, HEADER_PLAIN);
+  if(err < 0)
+    return err;
+  ssize_t res = pwrite(fd, raw, HEADER_SIZE, 0);
+  if(res == -1)
+    return -errno;
+  crypto_stats_add(CRYPTO_STATS_BACKING_WRITTEN, res);
+  return res == HEADER_SIZE ? 0 : -EIO;
+}
+
+// Plaintext size of the regular file st, opened as fd or, if fd is -1,
+// found at name in dirfd. Sizes read out of headers are remembered.
+static int _crypto_file_size(int dirfd, const char *name, int fd, const struct stat *st, off_t *size){
+  off_t data = _crypto_plain_size(st->st_size);
+  if(!file_headers) {
+    *size = data;
+    return 0;
+  }
+
+  off_t hsize = 0;
+  if(st->st_size > 0 && crypto_sizes_get(st, &hsize) < 0) {
+    int hfd = fd != -1 ? fd : openat(dirfd, name, O_RDONLY);
+    if(hfd == -1)
+      return -errno;
+    int err = _crypto_header_read(hfd, &hsize);
+    if(hfd != fd)
+      close(hfd);
+    if(err < 0)
+      return err;
+    crypto_sizes_put(st, hsize);
+  }
+  *size = hsize > data ? hsize : data;
+  return 0;
+}
+
+// A run of blocks handed to the pool: cipher holds them block_size apart
+// and plain payload apart.
+struct crypto_batch {
+  unsigned char *cipher;
+  unsigned char *plain;
+  size_t clen;              // ciphertext bytes in cipher, when opening
+  ssize_t *plens;           // what _crypto_open_block said for each block
+  int err;                  // set if any block failed to seal
+};
+
+// Space to seal blocks into before they are written, write_batch blocks
+// of it. Only used with the node locked for writing.
+static unsigned char *_crypto_node_wbuf(struct crypto_node *node){
+  if(node->wbuf == NULL)
+    node->wbuf = malloc(write_batch * block_size);
+  return node->wbuf;
+}
+
+// Space to seal count blocks into. Blocks written behind take their
+// buffer along to the writer, so they each get one of their own.
+static unsigned char *_crypto_seal_buf(struct crypto_node *node, size_t count){
+  return write_behind ? malloc(count * block_size) : _crypto_node_wbuf(node);
+}
+
+// Writes len bytes of blocks sealed into buf, from _crypto_seal_buf, at
+// off. With write_behind they are only queued, buf goes along with them
+// and errors come back later out of the node's queue.
+static int _crypto_node_pwrite(int fd, struct crypto_node *node, unsigned char *buf,
+                               size_t len, off_t off){
+  crypto_stats_add(CRYPTO_STATS_BACKING_WRITTEN, len);
+  if(write_behind)
+    return crypto_writeq_push(&node->wq, node->fd, buf, len, off);
+
+  // A batch can be large enough to go out in pieces.
+  while(len > 0) {
+    ssize_t res = pwrite(fd, buf, len, off);
+    if(res == -1 && errno == EINTR)
+      continue;
+    if(res == -1)
+      return -errno;
+    if(res == 0)
+      return -EIO;
+    buf += res;
+    len -= res;
+    off += res;
+  }
+  return 0;
+}
+
+static void _crypto_seal_buf_free(struct crypto_node *node, unsigned char *buf){
+  if(buf != node->wbuf)
+    free(buf);
+}
+
+static void _crypto_batch_open(void *arg, size_t i){
+  struct crypto_batch *b = arg;
+  size_t pos  = i * block_size;
+  size_t clen = b->clen - pos < block_size ? b->clen - pos : block_size;
+  b->plens[i] = _crypto_open_block(b->plain + i * (block_size - crypto_PADDING), b->cipher + pos, clen);
+}
+
+static void _crypto_batch_seal(void *arg, size_t i){
+  struct crypto_batch *b = arg;
+  const size_t payload = block_size - crypto_PADDING;
+  int err = _crypto_seal_block(b->cipher + i * block_size, b->plain + i * payload, payload);
+  if(err < 0)
+    b->err = err;
+}
+
+// Small batches aren't worth waking anybody up for.
+static void _crypto_batch_run(size_t n, void (*fn)(void *, size_t), struct crypto_batch *b){
+  if(n >= pool_min) {
+    crypto_pool_run(n, fn, b);
+  } else {
+    for(size_t i = 0; i < n; i++)
+      fn(b, i);
+  }
+}
+
+// Seals len bytes of plaintext as block idx of the file. Blocks we expect
+// to be written again are kept in the block cache, others are dropped
+// from it. Called with the node locked for writing.
+static int _crypto_write_block(int fd, struct crypto_node *node, size_t idx,
+                               const unsigned char *plain, size_t len, int keep){
+  unsigned char *block = _crypto_seal_buf(node, 1);
+  if(block == NULL)
+    return -ENOMEM;
+
+  int err = _crypto_seal_block(block, plain, len);
+  if(err < 0) {
+    _crypto_seal_buf_free(node, block);
+    return err;
+  }
+
+  if((err = _crypto_node_pwrite(fd, node, block, len + crypto_PADDING, _crypto_block_off(idx))) < 0) {
+    crypto_cache_remove(node->dev, node->ino, idx);
+    return err;
+  }
+
+  if(keep)
+    crypto_cache_put(node->dev, node->ino, idx, plain, len);
+  else
+    crypto_cache_remove(node->dev, node->ino, idx);
+
+  return 0;
+}
+
+// Seals count whole blocks of plaintext starting at block idx, in parallel,
+// and writes them out with a single pwrite. Called with the node locked
+// for writing.
+static int _crypto_write_blocks(int fd, struct crypto_node *node, size_t idx,
+                                const unsigned char *plain, size_t count){
+  unsigned char *cipher = _crypto_seal_buf(node, count);
+  if(cipher == NULL)
+    return -ENOMEM;
+
+  struct crypto_batch b = { .cipher = cipher, .plain = (unsigned char *) plain, .err = 0 };
+  _crypto_batch_run(count, _crypto_batch_seal, &b);
+  if(b.err < 0) {
+    _crypto_seal_buf_free(node, cipher);
+    return b.err;
+  }
+
+  int err = _crypto_node_pwrite(fd, node, cipher, count * block_size, _crypto_block_off(idx));
+
+  for(size_t i = 0; i < count; i++)
+    crypto_cache_remove(node->dev, node->ino, idx + i);
+
+  return err;
+}
+
+static struct crypto_node **_crypto_node_bucket(dev_t dev, ino_t ino){
+  return &nodes[((uint64_t) ino ^ ((uint64_t) dev << 7)) % NODE_BUCKETS];
+}
+
+// Looks up the node for an open file, taking a reference to it.
+static struct crypto_node *_crypto_node_find(dev_t dev, ino_t ino){
+  pthread_mutex_lock(&nodes_lock);
+  struct crypto_node *node = *_crypto_node_bucket(dev, ino);
+  while(node != NULL && (node->ino != ino || node->dev != dev))
+    node = node->next;
+  if(node != NULL)
+    node->refs++;
+  pthread_mutex_unlock(&nodes_lock);
+  return node;
+}
+
+// Finds or makes the node for a file that is being opened through fd.
+static struct crypto_node *_crypto_node_get(const struct stat *st, int fd, int *err){
+  struct crypto_node *node = _crypto_node_find(st->st_dev, st->st_ino);
+  if(node != NULL)
+    return node;
+
+  struct crypto_node *fresh = calloc(1, sizeof(*fresh));
+  if(fresh == NULL) {
+    *err = -ENOMEM;
+    return NULL;
+  }
+
+  fresh->dev  = st->st_dev;
+  fresh->ino  = st->st_ino;
+  fresh->refs = 1;
+  fresh->fd   = -1;
+  fresh->size = fresh->data = _crypto_plain_size(st->st_size);
+  fresh->headed = st->st_size > 0;
+  if(file_headers && (*err = _crypto_file_size(AT_FDCWD, NULL, fd, st, &fresh->size)) < 0) {
+    free(fresh);
+    return NULL;
+  }
+  pthread_rwlock_init(&fresh->lock, NULL);
+  crypto_writeq_init(&fresh->wq);
+
+  // Somebody may have beaten us to it while we weren't holding the lock.
+  pthread_mutex_lock(&nodes_lock);
+  struct crypto_node **bucket = _crypto_node_bucket(st->st_dev, st->st_ino);
+  for(node = *bucket; node != NULL; node = node->next) {
+    if(node->ino == st->st_ino && node->dev == st->st_dev)
+      break;
+  }
+  if(node != NULL) {
+    node->refs++;
+  } else {
+    node = fresh;
+    node->next = *bucket;
+    *bucket = node;
+  }
+  pthread_mutex_unlock(&nodes_lock);
+
+  if(node != fresh) {
+    crypto_writeq_destroy(&fresh->wq);
+    pthread_rwlock_destroy(&fresh->lock);
+    free(fresh);
+  }
+  return node;
+}
+
+static struct crypto_dirty *_crypto_dirty_find(struct crypto_node *node, size_t idx){
+  for(size_t i = 0; i < node->ndirty; i++) {
+    if(node->dirty[i].idx == idx)
+      return &node->dirty[i];
+  }
+  return NULL;
+}
+
+// Seals a dirty block out to disk and frees up its slot. Called with the
+// node locked for writing.
+static int _crypto_dirty_seal(struct crypto_node *node, struct crypto_dirty *d){
+  int err = _crypto_write_block(node->fd, node, d->idx, d->data, d->len, 1);
+
+  // Swap the last entry into the hole, taking its buffer with it.
+  struct crypto_dirty *last = &node->dirty[--node->ndirty];
+  unsigned char *data = d->data;
+  *d = *last;
+  last->data = data;
+
+  return err;
+}
+
+static int _crypto_dirty_flush(struct crypto_node *node){
+  int err = 0;
+  while(node->ndirty > 0) {
+    int res = _crypto_dirty_seal(node, &node->dirty[node->ndirty - 1]);
+    if(res < 0)
+      err = res;
+  }
+  return err;
+}
+
+// Starts buffering block idx, seeding it with what is already in the file.
+// Called with the node locked for writing.
+static struct crypto_dirty *_crypto_dirty_load(struct crypto_file *cf, size_t idx, int *err){
+  struct crypto_node *node = cf->node;
+  const size_t payload = block_size - crypto_PADDING;
+
+  if(node->dirty == NULL) {
+    node->dirty = calloc(dirty_max, sizeof(*node->dirty));
+    node->dirty_data = malloc(dirty_max * payload);
+    if(node->dirty == NULL || node->dirty_data == NULL) {
+      free(node->dirty);
+      free(node->dirty_data);
+      node->dirty = NULL;
+      node->dirty_data = NULL;
+      *err = -ENOMEM;
+      return NULL;
+    }
+    for(size_t i = 0; i < dirty_max; i++)
+      node->dirty[i].data = node->dirty_data + i * payload;
+  }
+
+  if(node->ndirty == dirty_max) {
+    struct crypto_dirty *oldest = &node->dirty[0];
+    for(size_t i = 1; i < node->ndirty; i++) {
+      if(node->dirty[i].stamp < oldest->stamp)
+        oldest = &node->dirty[i];
+    }
+    if((*err = _crypto_dirty_seal(node, oldest)) < 0)
+      return NULL;
+  }
+
+  // Only blocks below node->data have anything in them.
+  struct crypto_dirty *d = &node->dirty[node->ndirty];
+  ssize_t plen = (off_t) (idx * payload) >= node->data ? 0 :
+                 crypto_cache_get(node->dev, node->ino, idx, d->data);
+  if(plen < 0) {
+    unsigned char *block = _crypto_node_wbuf(node);
+    if(block == NULL) {
+      *err = -ENOMEM;
+      return NULL;
+    }
+    crypto_writeq_drain(&node->wq);
+    ssize_t res = pread(cf->fd, block, block_size, _crypto_block_off(idx));
+    if(res == -1) {
+      *err = -errno;
+      return NULL;
+    }
+    crypto_stats_add(CRYPTO_STATS_BACKING_READ, res);
+
+    plen = 0;
+    if(res > 0) {
+      plen = _crypto_open_block(d->data, block, res);
+      if(plen < 0) {
+        *err = plen;
+        return NULL;
+      }
+      crypto_stats_add(CRYPTO_STATS_RMW, 1);
+    }
+  }
+
+  d->idx = idx;
+  d->len = plen;
+  d->lo  = d->hi = 0;
+  node->ndirty++;
+  return d;
+}
+
+// Seals whatever is dirty and waits for blocks written behind to land,
+// returning the first error of either. Called with the node locked for
+// writing, or by its last user.
+static int _crypto_node_settle(struct crypto_node *node){
+  int err = _crypto_dirty_flush(node);
+  crypto_writeq_drain(&node->wq);
+  int werr = crypto_writeq_error(&node->wq);
+  return err < 0 ? err : werr;
+}
+
+// Drops a handle's reference to its node, the last one out settles it.
+static int _crypto_node_put(struct crypto_node *node){
+  pthread_mutex_lock(&nodes_lock);
+  int last = --node->refs == 0;
+  if(last) {
+    struct crypto_node **p = _crypto_node_bucket(node->dev, node->ino);
+    while(*p != node)
+      p = &(*p)->next;
+    *p = node->next;
+  }
+  pthread_mutex_unlock(&nodes_lock);
+
+  if(!last)
+    return 0;
+
+  int err = _crypto_node_settle(node);
+  crypto_writeq_destroy(&node->wq);
+  if(node->fd != -1)
+    close(node->fd);
+  free(node->dirty_data);
+  free(node->dirty);
+  free(node->wbuf);
+  pthread_rwlock_destroy(&node->lock);
+  free(node);
+  return err;
+}
+
+int crypto_file_fsync(struct crypto_file *cf, int datasync){
   (void) datasync;
 
-  int err = fsync(inf->fh);
+  pthread_rwlock_wrlock(&cf->node->lock);
+  int res = _crypto_node_settle(cf->node);
+  pthread_rwlock_unlock(&cf->node->lock);
+  if(res < 0)
+    return res;
+
+  int err = fsync(cf->fd);
 
   CHECK_ERR
 }
 
+static int crypto_fsync(const char *path, int datasync, struct fuse_file_info *inf){
+  if(crypto_control_path(path) != CRYPTO_CONTROL_NONE)
+    return 0;
+  return crypto_file_fsync(CRYPTO_FILE(inf), datasync);
+}
+
+int crypto_file_attr(int dirfd, const char *name, struct stat *st){
+  if(!S_ISREG(st->st_mode))
+    return 0;
+
+  // Open files may have dirty blocks the backing file doesn't know about.
+  struct crypto_node *node = _crypto_node_find(st->st_dev, st->st_ino);
+  if(node == NULL)
+    return _crypto_file_size(dirfd, name, -1, st, &st->st_size);
+
+  st->st_size = __atomic_load_n(&node->size, __ATOMIC_RELAXED);
+  _crypto_node_put(node);
+  return 0;
+}
+
+int crypto_file_stat(int dirfd, const char *name, struct stat *st){
+  if(fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW) == -1)
+    return -errno;
+  return crypto_file_attr(dirfd, name, st);
+}
+
+// Where files have headers, entries are stat'ed in full, so the getattr
+// that mostly follows a listing finds the plaintext size already cached.
+// Otherwise the directory already says all a listing needs, and a stat
+// per entry would only slow it down.
+void crypto_file_entry(int dirfd, const char *name, ino_t ino, unsigned char type, struct stat *st){
+  if(file_headers && crypto_file_stat(dirfd, name, st) == 0)
+    return;
+  memset(st, 0, sizeof(*st));
+  st->st_ino  = ino;
+  st->st_mode = type << 12;
+}
+
+#define CRYPTO_CONTROL(inf) ((struct crypto_control *) (uintptr_t) (inf)->fh)
+
 static int crypto_getattr(const char *path, struct stat *st){
-  WITH_CRYPTO_PATH(int err = lstat(cpath, st))
+  int which = crypto_control_path(path);
+  if(which != CRYPTO_CONTROL_NONE)
+    return crypto_control_attr(which, st);
+  if(_crypto_reserved(path))
+    return -ENOENT;
 
-  if(S_ISREG(st->st_mode)) {
-    size_t num_blocks = st->st_size / block_size;
-    size_t total_overhead = num_blocks * crypto_PADDING;
-    if(st->st_size % block_size > 0)
-      total_overhead += crypto_PADDING;
-    st->st_size -= total_overhead;
-  }
+  WITH_CRYPTO_AT(int err = crypto_file_stat(at.fd, at.name, st))
 
-  CHECK_ERR
+  return err;
 }
 
 static int crypto_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
@@ -62,294 +782,1012 @@ static int crypto_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
   (void) offset;
   (void) inf;
-  char *cpath = _crypto_path(path);
-  if(cpath == NULL) return -ENOMEM;
+  struct stat st;
+  int which = crypto_control_path(path);
+  if(which == CRYPTO_CONTROL_DIR) {
+    crypto_control_attr(CRYPTO_CONTROL_DIR, &st);
+    if(filler(buf, ".", &st, 0) || filler(buf, "..", NULL, 0))
+      return 0;
+    for(int i = 0; crypto_control_names[i] != NULL; i++) {
+      crypto_control_attr(crypto_control_name(crypto_control_names[i]), &st);
+      if(filler(buf, crypto_control_names[i], &st, 0))
+        break;
+    }
+    return 0;
+  }
+  if(which != CRYPTO_CONTROL_NONE)
+    return which == CRYPTO_CONTROL_MISSING ? -ENOENT : -ENOTDIR;
 
-  dp = opendir(cpath);
-  if(dp == NULL) {
-    free(cpath);
-    return -errno;
+  WITH_CRYPTO_AT(int fd = openat(at.fd, at.name, O_RDONLY | O_DIRECTORY))
+
+  if(fd == -1 || (dp = fdopendir(fd)) == NULL) {
+    int err = -errno;
+    if(fd != -1)
+      close(fd);
+    return err;
   }
 
+  int root = strcmp(path, "/") == 0;
+  if(root) {
+    crypto_control_attr(CRYPTO_CONTROL_DIR, &st);
+    filler(buf, CRYPTO_CONTROL_NAME, &st, 0);
+  }
   while ((de = readdir(dp)) != NULL) {
-    struct stat st;
-    memset(&st, 0, sizeof(st));
-    st.st_ino = de->d_ino;
-    st.st_mode = de->d_type << 12;
+    if(root && (strcmp(de->d_name, CRYPTO_VOLUME_FILE) == 0 || strcmp(de->d_name, CRYPTO_CONTROL_NAME) == 0))
+      continue;
+
+    crypto_file_entry(dirfd(dp), de->d_name, de->d_ino, de->d_type, &st);
     int ret = filler(buf, de->d_name, &st, 0);
     if(ret) break;
   }
 
   closedir(dp);
-  free(cpath);
   return 0;
 }
 
 static int crypto_mknod(const char *path, mode_t mode, dev_t dev){
-  char *cpath = _crypto_path(path);
-  if(cpath == NULL) return -ENOMEM;
+  if(_crypto_reserved(path))
+    return -EACCES;
 
-  int err;
+  struct crypto_at at;
+  int err = crypto_dirs_at(path, &at);
+  if(err < 0)
+    return err;
 
   if(S_ISFIFO(mode)) {
-    err = mkfifo(cpath, mode);
+    err = mkfifoat(at.fd, at.name, mode);
   } else {
-    err = mknod(cpath, mode, dev);
+    err = mknodat(at.fd, at.name, mode, dev);
   }
 
-  free(cpath);
+  crypto_dirs_done(&at);
 
   CHECK_ERR
 }
 
-static int crypto_open(const char *path, struct fuse_file_info *inf){
-  WITH_CRYPTO_PATH(int fh = open(cpath, inf->flags))
+// The backing file is always opened readable, a partial block write has to
+// decrypt what is already in the block. O_APPEND is dropped as well, since
+// we place every block ourselves. Both are also what the kernel expects
+// with writeback caching, where it reads pages of files opened write only
+// and works out where appends go itself.
+static int _crypto_open_flags(int flags){
+  flags &= ~O_APPEND;
+  if((flags & O_ACCMODE) == O_WRONLY)
+    flags = (flags & ~O_ACCMODE) | O_RDWR;
+  return flags;
+}
 
-  if(fh == -1)
-    return -errno;
+static int _crypto_file_new(int fd, int flags, struct crypto_file **out){
+  struct stat st;
+  if(fstat(fd, &st) == -1) {
+    int err = -errno;
+    close(fd);
+    return err;
+  }
 
-  inf->fh = fh;
+  int err = -ENOMEM;
+  struct crypto_file *cf = calloc(1, sizeof(*cf));
+  if(cf == NULL || (cf->node = _crypto_node_get(&st, fd, &err)) == NULL) {
+    free(cf);
+    close(fd);
+    return err;
+  }
+
+  // Dirty blocks can outlive the handle that wrote them, so the node keeps
+  // its own descriptor to seal them through.
+  if((flags & O_ACCMODE) != O_RDONLY) {
+    pthread_mutex_lock(&nodes_lock);
+    if(cf->node->fd == -1)
+      cf->node->fd = dup(fd);
+    pthread_mutex_unlock(&nodes_lock);
+  }
+
+  cf->fd    = fd;
+  cf->flags = flags;
+  pthread_mutex_init(&cf->lock, NULL);
+  pthread_mutex_init(&cf->ahead_lock, NULL);
+  *out = cf;
 
   return 0;
 }
 
+int crypto_file_open(int dirfd, const char *name, int flags, mode_t mode, struct crypto_file **cf){
+  int fd = openat(dirfd, name, _crypto_open_flags(flags), mode);
+  if(fd == -1)
+    return -errno;
+
+  return _crypto_file_new(fd, flags, cf);
+}
+
+static int crypto_open(const char *path, struct fuse_file_info *inf){
+  int which = crypto_control_path(path);
+  if(which != CRYPTO_CONTROL_NONE) {
+    struct crypto_control *ctl = NULL;
+    int err = crypto_control_open(which, &ctl);
+    if(err == 0) {
+      inf->fh = (uintptr_t) ctl;
+      inf->direct_io = 1;
+    }
+    return err;
+  }
+
+  struct crypto_file *cf = NULL;
+  WITH_CRYPTO_AT(int err = crypto_file_open(at.fd, at.name, inf->flags, 0, &cf))
+
+  if(err == 0)
+    inf->fh = (uintptr_t) cf;
+  return err;
+}
+
 static int crypto_create(const char *path, mode_t mode,
                          struct fuse_file_info *inf){
-  WITH_CRYPTO_PATH(int fh = open(cpath, inf->flags, mode))
+  if(_crypto_reserved(path))
+    return -EACCES;
 
-  if(fh == -1)
-    return -errno;
+  struct crypto_file *cf = NULL;
+  WITH_CRYPTO_AT(int err = crypto_file_open(at.fd, at.name, inf->flags, mode, &cf))
+
+  if(err == 0)
+    inf->fh = (uintptr_t) cf;
+  return err;
+}
 
-  inf->fh = fh;
+// Called on every close(2) of the file, we seal any dirty blocks, wait for
+// blocks written behind and hand the close back to the backing file
+// system, so errors reach the caller.
+int crypto_file_flush(struct crypto_file *cf){
+  pthread_rwlock_wrlock(&cf->node->lock);
+  int res = _crypto_node_settle(cf->node);
+  pthread_rwlock_unlock(&cf->node->lock);
+  if(res < 0)
+    return res;
 
-  return 0;
+  int err = close(dup(cf->fd));
+
+  CHECK_ERR
+}
+
+static int crypto_flush(const char *path, struct fuse_file_info *inf){
+  if(crypto_control_path(path) != CRYPTO_CONTROL_NONE)
+    return 0;
+  return crypto_file_flush(CRYPTO_FILE(inf));
+}
+
+// Errors of blocks written behind are reported here as well, to whoever
+// still looks at what release returns.
+int crypto_file_release(struct crypto_file *cf){
+  int err = crypto_writeq_error(&cf->node->wq);
+  int res = _crypto_node_put(cf->node);
+  close(cf->fd);
+  pthread_mutex_destroy(&cf->lock);
+  pthread_mutex_destroy(&cf->ahead_lock);
+  free(cf->scratch);
+  free(cf);
+  return err < 0 ? err : res;
+}
+
+static int crypto_release(const char *path, struct fuse_file_info *inf){
+  if(crypto_control_path(path) != CRYPTO_CONTROL_NONE) {
+    crypto_control_release(CRYPTO_CONTROL(inf));
+    inf->fh = 0;
+    return 0;
+  }
+
+  int err = crypto_file_release(CRYPTO_FILE(inf));
+  inf->fh = 0;
+  return err;
+}
+
+void crypto_file_forget(const struct stat *st){
+  if(S_ISREG(st->st_mode) && st->st_nlink <= 1) {
+    crypto_cache_invalidate(st->st_dev, st->st_ino, 0, SIZE_MAX);
+    crypto_sizes_forget(st->st_dev, st->st_ino);
+  }
 }
 
 static int crypto_unlink(const char *path) {
-  WITH_CRYPTO_PATH(int err = unlink(cpath))
+  if(crypto_control_path(path) != CRYPTO_CONTROL_NONE)
+    return -EACCES;
+
+  struct stat st;
+  WITH_CRYPTO_AT(int err = fstatat(at.fd, at.name, &st, AT_SYMLINK_NOFOLLOW);
+                 if(err == 0) err = unlinkat(at.fd, at.name, 0))
+
+  if(err == 0)
+    crypto_file_forget(&st);
 
   CHECK_ERR
 }
 
-static int crypto_read(const char *path, char *buf, size_t size,
-                       off_t off, struct fuse_file_info *inf){
+// Blocks [first, end) of a file, to be pulled into the block cache ahead of
+// a reader. The job holds on to the node and a descriptor of its own, the
+// handle that queued it may be gone by the time it runs.
+struct crypto_ahead_job {
+  struct crypto_node *node;
+  int fd;
+  size_t first;
+  size_t end;
+};
+
+// Fetches a read ahead job in batches like the ones crypto_read reads,
+// leaving out blocks that are dirty or already cached. Up to io_depth
+// batches are in flight at once, and they are fetched under the node's
+// read lock, so no write gets between the fetch and the cache fill.
+static void _crypto_ahead_fetch(void *arg){
+  struct crypto_ahead_job *job = arg;
+  struct crypto_node *node = job->node;
+  const size_t payload = block_size - crypto_PADDING;
+  const size_t depth = crypto_io_depth();
+  struct crypto_io ios[CRYPTO_IO_MAX];
+  size_t firsts[CRYPTO_IO_MAX];
+  unsigned char *batch = malloc(read_batch * (depth * block_size + payload + sizeof(ssize_t)));
+  unsigned char *plains = batch + depth * read_batch * block_size;
+  ssize_t *plens = (ssize_t *) (plains + read_batch * payload);
+
+  size_t idx = job->first;
+  int more = batch != NULL;
+  while(more && idx < job->end) {
+    pthread_rwlock_rdlock(&node->lock);
+
+    size_t end = (node->data + payload - 1) / payload;
+    if(end > job->end)
+      end = job->end;
+    size_t n = 0;
+    while(n < depth && idx < end) {
+      while(idx < end && (_crypto_dirty_find(node, idx) != NULL ||
+                          crypto_cache_has(node->dev, node->ino, idx)))
+        idx++;
+      size_t count = 0;
+      while(idx + count < end && count < read_batch &&
+            _crypto_dirty_find(node, idx + count) == NULL &&
+            !crypto_cache_has(node->dev, node->ino, idx + count))
+        count++;
+      if(count == 0)
+        break;
+
+      firsts[n]    = idx;
+      ios[n].fd    = job->fd;
+      ios[n].write = 0;
+      ios[n].buf   = batch + n * read_batch * block_size;
+      ios[n].len   = count * block_size;
+      ios[n].off   = _crypto_block_off(idx);
+      n++;
+      idx += count;
+    }
+
+    uint64_t gen = crypto_cache_generation(node->dev, node->ino);
+    crypto_writeq_drain(&node->wq);
+    crypto_io_run(ios, n);
+
+    // A reader finds out about errors for itself.
+    more = n > 0;
+    for(size_t i = 0; i < n && more; i++) {
+      ssize_t res = ios[i].res;
+      if(res > 0) {
+        crypto_stats_add(CRYPTO_STATS_BACKING_READ, res);
+        struct crypto_batch b = { .cipher = ios[i].buf, .plain = plains, .clen = res, .plens = plens };
+        size_t blocks = (res + block_size - 1) / block_size;
+        _crypto_batch_run(blocks, _crypto_batch_open, &b);
+        for(size_t j = 0; j < blocks && plens[j] >= 0; j++)
+          crypto_cache_fill(node->dev, node->ino, firsts[i] + j, plains + j * payload, plens[j], gen);
+      }
+      more = res > 0 && (size_t) res == ios[i].len;
+    }
+
+    pthread_rwlock_unlock(&node->lock);
+  }
+
+  free(batch);
+  close(job->fd);
+  _crypto_node_put(node);
+  free(job);
+  __sync_fetch_and_sub(&ahead_jobs, 1);
+}
+
+// Called after every read of red bytes at off. A handle that is read front
+// to back gets a window that starts out at a batch and doubles with each
+// read up to ahead_max, and once the reader is within half a window of
+// the end of what was fetched ahead, the rest of the window is fetched in
+// the background. The block cache is where it goes, so the reads that
+// follow are only a copy, whichever handle makes them.
+static void _crypto_ahead(struct crypto_file *cf, off_t off, size_t red){
+  struct crypto_node *node = cf->node;
+  const size_t payload = block_size - crypto_PADDING;
+  if(ahead_max == 0)
+    return;
+
+  pthread_mutex_lock(&cf->ahead_lock);
+
+  // Async reads of one stream can come in a little out of order.
+  off_t slack = read_batch * payload;
+  if(off + slack >= cf->ahead.next && off <= cf->ahead.next + slack) {
+    size_t window = cf->ahead.window == 0 ? read_batch : cf->ahead.window * 2;
+    cf->ahead.window = window < ahead_max ? window : ahead_max;
+  } else {
+    cf->ahead.window = 0;
+    cf->ahead.end    = 0;
+  }
+  if(off + (off_t) red > cf->ahead.next || cf->ahead.window == 0)
+    cf->ahead.next = off + red;
+
+  size_t at    = (off + red) / payload;
+  size_t first = cf->ahead.end > at ? cf->ahead.end : at;
+  size_t end   = at + cf->ahead.window;
+  size_t last  = (__atomic_load_n(&node->data, __ATOMIC_RELAXED) + payload - 1) / payload;
+  if(end > last)
+    end = last;
+
+  // Nothing to do while more than half a window is still ahead, and runs
+  // shorter than a batch wait for the reader to get further, unless that
+  // is all there is left of the file.
+  if(cf->ahead.window == 0 || first >= end || first - at > cf->ahead.window / 2 ||
+     (end - first < read_batch && end < last)) {
+    pthread_mutex_unlock(&cf->ahead_lock);
+    return;
+  }
+
+  struct crypto_ahead_job *job = NULL;
+  if(__sync_add_and_fetch(&ahead_jobs, 1) <= (int) crypto_pool_size() &&
+     (job = malloc(sizeof(*job))) != NULL && (job->fd = dup(cf->fd)) != -1) {
+    pthread_mutex_lock(&nodes_lock);
+    node->refs++;
+    pthread_mutex_unlock(&nodes_lock);
+    job->node  = node;
+    job->first = first;
+    job->end   = end;
+    if(crypto_pool_submit(_crypto_ahead_fetch, job) == 0) {
+      cf->ahead.end = end;
+      crypto_stats_add(CRYPTO_STATS_AHEAD, 1);
+      pthread_mutex_unlock(&cf->ahead_lock);
+      return;
+    }
+    close(job->fd);
+    _crypto_node_put(node);
+  }
+  free(job);
+  __sync_fetch_and_sub(&ahead_jobs, 1);
+
+  pthread_mutex_unlock(&cf->ahead_lock);
+}
+
+// Reads are batched: we work out the span of ciphertext blocks covering the
+// request, pull up to read_batch of them in with a single pread and then
+// authenticate and decrypt each block out of that buffer, spread over the
+// worker pool. Blocks that land whole inside the request are decrypted
+// straight into buf, only the ragged ends go through scratch space. The
+// node knows where the file ends, so there is no need to stat the file.
+// Dirty and cached blocks are served from memory, and anything past the
+// last block, which truncate can leave behind when files have headers,
+// reads as zeros, and so do holes.
+int crypto_file_read(struct crypto_file *cf, char *buf, size_t size, off_t off){
+  struct crypto_node *node = cf->node;
+  const size_t payload = block_size - crypto_PADDING;
   size_t red = 0;
+  int err = 0;
+
+  // Concurrent reads on one handle are common with async reads, only the
+  // first gets the scratch buffer.
+  const size_t scratch_size = read_batch * (block_size + payload + sizeof(ssize_t)) + payload;
+  unsigned char *batch = NULL;
+  int locked = pthread_mutex_trylock(&cf->lock) == 0;
+  if(locked) {
+    if(cf->scratch == NULL)
+      cf->scratch = malloc(scratch_size);
+    batch = cf->scratch;
+  }
+  if(batch == NULL && (batch = malloc(scratch_size)) == NULL) {
+    if(locked) pthread_mutex_unlock(&cf->lock);
+    return -ENOMEM;
+  }
+
+  unsigned char *plains = batch + read_batch * block_size;
+  ssize_t *plens = (ssize_t *) (plains + read_batch * payload);
+  unsigned char *plain = (unsigned char *) (plens + read_batch);
+  size_t first = 0, count = 0;  // blocks [first, first + count) were fetched into batch
+  ssize_t res = 0;              // and this many ciphertext bytes came back
+  unsigned char *opened = NULL; // where they were decrypted to
+  uint64_t gen = 0;             // cache generation sampled before the fetch
+
+  pthread_rwlock_rdlock(&node->lock);
+
+  if(off >= node->size)
+    size = 0;
+  else if(size > (size_t) (node->size - off))
+    size = node->size - off;
 
   while(size > 0) {
-    int idx = off / (block_size - crypto_PADDING);
-    size_t delta = off % (block_size - crypto_PADDING);
-    size_t bsize = block_size, fudge = 0;
-
-    if(size < block_size - crypto_PADDING) {
-      // We have to check that we aren't in partial block land, when reading from
-      // the end of the file by stating the file and checking that the requested
-      // offset isn't a slice of a partial block.
-      struct stat st = {0};
-      int staterr = crypto_getattr(path, &st);
-      if(staterr < 0) return staterr;
-      size_t next_block = (idx + 1) * (block_size - crypto_PADDING);
-      if(st.st_size < next_block)
-        next_block = st.st_size;
-
-      if(next_block - off > size)
-        fudge = next_block - off - size;
+    size_t idx   = off / payload;
+    size_t delta = off % payload;
+    const unsigned char *src = plain;
+
+    struct crypto_dirty *d;
+    ssize_t plen = 0;
+    if(off >= node->data) {
+      // Nothing but zeros from here on.
+    } else if((d = _crypto_dirty_find(node, idx)) != NULL) {
+      plen = d->len;
+      src  = d->data;
+    } else if((plen = crypto_cache_get(node->dev, node->ino, idx, plain)) < 0) {
+      if(idx < first || idx >= first + count) {
+        count = (delta + size + payload - 1) / payload;
+        if(count > read_batch)
+          count = read_batch;
+
+        opened = plains;
+        if(delta == 0 && size >= payload) {
+          if(count > size / payload)
+            count = size / payload;
+          opened = (unsigned char *) buf + red;
+        }
+
+        first = idx;
+        gen   = crypto_cache_generation(node->dev, node->ino);
+        crypto_writeq_drain(&node->wq);
+        res = pread(cf->fd, batch, count * block_size, _crypto_block_off(idx));
+        if(res == -1) {
+          err = -errno;
+          break;
+        }
+        crypto_stats_add(CRYPTO_STATS_BACKING_READ, res);
+
+        struct crypto_batch b = { .cipher = batch, .plain = opened, .clen = res, .plens = plens };
+        _crypto_batch_run((res + block_size - 1) / block_size, _crypto_batch_open, &b);
+      }
+
+      size_t pos = (idx - first) * block_size;
+      if(pos >= (size_t) res) {
+        printf("missing block at index: %zu offset: %lld inode: %llu\n", idx, (long long) off,
+               (unsigned long long) node->ino);
+        err = -ENXIO;
+        break;
+      }
+
+      plen = plens[idx - first];
+      src  = opened + (idx - first) * payload;
+      if(plen < 0) {
+        printf("error at index: %zu offset: %lld read: %zd inode: %llu\n", idx, (long long) off, res,
+               (unsigned long long) node->ino);
+        err = plen;
+        break;
+      }
+
+      crypto_cache_fill(node->dev, node->ino, idx, src, plen, gen);
+    }
+
+    // The rest of a short block, up to where the next one starts, is zeros.
+    size_t n;
+    if(delta < (size_t) plen) {
+      n = plen - delta < size ? plen - delta : size;
+      if(src + delta != (unsigned char *) buf + red)
+        memcpy(buf + red, src + delta, n);
+    } else {
+      n = payload - delta < size ? payload - delta : size;
+      memset(buf + red, 0, n);
     }
 
-    if(bsize > block_size)
-      printf("bzize: %zu size: %zu delta: %zu\n", bsize, size, delta);
+    size  -= n;
+    red   += n;
+    off   += n;
+  }
 
-    char block[bsize];
-    int res = pread(inf->fh, block, bsize, block_size * idx);
-    if(res == -1)
-      return -errno;
+  pthread_rwlock_unlock(&node->lock);
 
-    if(res == 0)
-      return red;
+  if(locked)
+    pthread_mutex_unlock(&cf->lock);
+  else
+    free(batch);
 
-    unsigned char nonce[crypto_secretbox_NONCEBYTES];
-    memcpy(nonce, block, crypto_secretbox_NONCEBYTES);
+  crypto_stats_add(CRYPTO_STATS_BYTES_READ, red);
 
-    size_t csize = res - crypto_secretbox_NONCEBYTES + crypto_secretbox_BOXZEROBYTES;
-    unsigned char cpad[csize];
-    memset(cpad, 0, csize);
-    memcpy(cpad + crypto_secretbox_BOXZEROBYTES, block + crypto_secretbox_NONCEBYTES, csize);
+  if(err == 0 && red > 0)
+    _crypto_ahead(cf, off - red, red);
+
+  return err ? err : (int) red;
+}
+
+static int crypto_read(const char *path, char *buf, size_t size,
+                       off_t off, struct fuse_file_info *inf){
+  if(crypto_control_path(path) != CRYPTO_CONTROL_NONE)
+    return crypto_control_read(CRYPTO_CONTROL(inf), buf, size, off);
+  return crypto_file_read(CRYPTO_FILE(inf), buf, size, off);
+}
 
-    unsigned char mpad[csize];
-    memset(mpad, 0, csize);
+// Writes size bytes of buf at off, which must not be past node->data.
+// Called with the node locked for writing.
+static int _crypto_write_at(struct crypto_file *cf, const unsigned char *buf, size_t size,
+                            off_t off, size_t *written){
+  struct crypto_node *node = cf->node;
+  const size_t payload = block_size - crypto_PADDING;
+  int err = 0;
 
-    int ruroh = crypto_secretbox_open(mpad, cpad, csize, nonce, key);
-    if(ruroh == -1) {
-      printf("error at index: %i offset: %llu read: %i size: %zu path: %s\n", idx, off, res, bsize, path);
-      return -ENXIO;
+  while(size > 0) {
+    size_t idx   = off / payload;
+    size_t delta = off % payload;
+    size_t n     = payload - delta < size ? payload - delta : size;
+
+    struct crypto_dirty *d = _crypto_dirty_find(node, idx);
+    if(d == NULL && n == payload) {
+      size_t count = 1;
+      while(count < write_batch && size >= (count + 1) * payload &&
+            _crypto_dirty_find(node, idx + count) == NULL)
+        count++;
+
+      n = count * payload;
+      err = _crypto_write_blocks(cf->fd, node, idx, buf + *written, count);
+    } else if(d != NULL || (d = _crypto_dirty_load(cf, idx, &err)) != NULL) {
+      if(delta > d->len)
+        memset(d->data + d->len, 0, delta - d->len);
+      memcpy(d->data + delta, buf + *written, n);
+      if(delta + n > d->len)
+        d->len = delta + n;
+      d->stamp = ++node->clock;
+
+      // Keep the written run, or the longer one where they don't touch.
+      if(d->hi == d->lo || (delta <= d->hi && delta + n >= d->lo)) {
+        if(d->hi == d->lo || delta < d->lo)
+          d->lo = delta;
+        if(delta + n > d->hi)
+          d->hi = delta + n;
+      } else if(n > d->hi - d->lo) {
+        d->lo = delta;
+        d->hi = delta + n;
+      }
+
+      // A block that has been written all the way through, like one a
+      // stream of small appends just filled, won't be written again soon.
+      // Others wait to be pushed out, so overwrites within them add up.
+      if(d->lo == 0 && d->hi == payload)
+        err = _crypto_dirty_seal(node, d);
     }
+    if(err < 0)
+      break;
+
+    *written += n;
+    size     -= n;
+    off      += n;
+    if(off > node->data)
+      node->data = off;
+    if(off > node->size)
+      __atomic_store_n(&node->size, off, __ATOMIC_RELAXED);
+  }
 
-    memcpy(buf + red, mpad + delta + crypto_secretbox_ZEROBYTES, csize - delta - fudge - crypto_secretbox_ZEROBYTES);
+  return err;
+}
+
+// Gives the backing file its header before anything else goes in, when
+// files have them. Called with the node locked for writing.
+static int _crypto_node_head(struct crypto_node *node){
+  int err = 0;
+  if(file_headers && !node->headed && (err = _crypto_header_write(node->fd, 0)) == 0)
+    node->headed = 1;
+  return err;
+}
 
-    size -= res - crypto_PADDING - fudge - delta;
-    red  += res - crypto_PADDING - fudge - delta;
-    off  += res - crypto_PADDING - fudge - delta;
+// Grows the data to end at to, for a write past the end of it. Only the
+// last block is sealed again, topped up with zeros to a whole block, and
+// the rest becomes holes by extending the backing file, which costs no
+// crypto and, where the backing file system is sparse, no space either.
+// Volumes without holes get sealed blocks of zeros all the way.
+// Called with the node locked for writing.
+static int _crypto_extend(struct crypto_file *cf, off_t to){
+  static const unsigned char zeros[1 << 16];
+  struct crypto_node *node = cf->node;
+  const size_t payload = block_size - crypto_PADDING;
+  int err = 0;
+
+  while(err == 0 && node->data < to && (!holes || node->data % payload != 0)) {
+    size_t n = payload - node->data % payload;
+    if((off_t) n > to - node->data)
+      n = to - node->data;
+    if(n > sizeof(zeros))
+      n = sizeof(zeros);
+    size_t done = 0;
+    err = _crypto_write_at(cf, zeros, n, node->data, &done);
   }
+  if(err < 0 || node->data >= to)
+    return err;
 
-  return red;
+  size_t rem = to % payload;
+  crypto_writeq_drain(&node->wq);
+  if(ftruncate(node->fd, _crypto_block_off(to / payload) + (rem > 0 ? rem + crypto_PADDING : 0)) == -1)
+    return -errno;
+  node->data = to;
+  if(to > node->size)
+    __atomic_store_n(&node->size, to, __ATOMIC_RELAXED);
+  return 0;
 }
 
 // We encrypt like GDBE each sector has a random
 // nonce prepended to each sector.
-static int crypto_write(const char *path, const char *buf, size_t size,
-                        off_t off, struct fuse_file_info *inf){
+//
+// Writes that cover whole blocks are sealed straight away, in parallel. Anything
+// smaller is collected in the node's dirty blocks, which are only sealed
+// once they have been written all the way through, get pushed out by newer
+// ones, or on flush/fsync and the final release, so a run of tiny writes
+// costs one seal per block, appending or overwriting.
+//
+// With write_threads the sealed blocks are queued to the writer threads
+// instead of written here, so sealing the next request overlaps writing
+// out this one. Anything that reads the backing file waits for the queue
+// first. A failed write is reported by the next write, flush, fsync or
+// release, like an error writing back the page cache.
+int crypto_file_write(struct crypto_file *cf, const char *buf, size_t size, off_t off){
   size_t written = 0;
 
-  while(size > 0) {
-    int idx = off / (block_size - crypto_PADDING);
-
-    // Grab a random nonce
-    unsigned char nonce[crypto_secretbox_NONCEBYTES];
-    randombytes(nonce, crypto_secretbox_NONCEBYTES);
-
-    // Set up the necessary buffers
-    size_t to_write = size < block_size - crypto_PADDING ? size + crypto_PADDING : block_size;
-    size_t msize = to_write - crypto_PADDING;
-    size_t fudge = 0;
-
-    char padding[block_size];
-    if(off % (block_size - crypto_PADDING) != 0) {
-      // At partial block, have to read the rest of the data
-      // and append the new stuff to our buffer.
-      size_t leftovers = off % (block_size - crypto_PADDING);
-      off_t  block_off = idx * (block_size - crypto_PADDING);
-      struct fuse_file_info of = {.flags = O_RDONLY};
-      int fd = crypto_open(path, &of);
-      if(fd == -1) return -errno;
-      int res = crypto_read(path, padding, leftovers, block_off, &of);
-      if(res < 0) return res;
-      close(fd);
-      if(to_write + res < block_size - crypto_PADDING)
-        to_write += res;
-      fudge = res;
-    }
-
-    unsigned char mpad[to_write];
-    unsigned char cpad[to_write];
-    memset(mpad, 0, to_write);
-    memset(cpad, 0, to_write);
-    memcpy(mpad + crypto_secretbox_ZEROBYTES, padding, fudge);
-    memcpy(mpad + crypto_secretbox_ZEROBYTES + fudge, buf + written, msize);
+  pthread_rwlock_wrlock(&cf->node->lock);
+  int err = crypto_writeq_error(&cf->node->wq);
+  if(err == 0)
+    err = _crypto_node_head(cf->node);
+  if(err == 0)
+    err = _crypto_extend(cf, off);
+  if(err == 0)
+    err = _crypto_write_at(cf, (const unsigned char *) buf, size, off, &written);
+  pthread_rwlock_unlock(&cf->node->lock);
 
-    int ohno = crypto_secretbox(cpad, mpad, msize + crypto_secretbox_ZEROBYTES, nonce, key);
-    if(ohno < 0) return -ENXIO;
+  crypto_stats_add(CRYPTO_STATS_BYTES_WRITTEN, written);
 
-    unsigned char block[to_write];
-    memset(block, 0, to_write);
-    memcpy(block, nonce, crypto_secretbox_NONCEBYTES);
-    memcpy(block + crypto_secretbox_NONCEBYTES, cpad + crypto_secretbox_BOXZEROBYTES, msize + crypto_secretbox_BOXZEROBYTES);
+  return err < 0 ? err : (int) written;
+}
 
-    int res = pwrite(inf->fh, block, to_write, block_size * idx);
-    if(res == -1) return -errno;
+static int crypto_write(const char *path, const char *buf, size_t size,
+                        off_t off, struct fuse_file_info *inf){
+  if(crypto_control_path(path) != CRYPTO_CONTROL_NONE)
+    return crypto_control_write(size);
+  return crypto_file_write(CRYPTO_FILE(inf), buf, size, off);
+}
 
-    res     -= crypto_PADDING;
-    written += res - fudge;
-    size    -= res - fudge;
-    off     += res - fudge;
+// Cuts the blocks back to end at off, resealing the block it falls in.
+// Called with the node locked for writing and nothing dirty.
+static int _crypto_cut_blocks(struct crypto_file *cf, off_t off){
+  struct crypto_node *node = cf->node;
+  const size_t payload = block_size - crypto_PADDING;
+  size_t idx = off / payload;
+  size_t rem = off % payload;
+  off_t end  = _crypto_block_off(idx);
+  int err    = 0;
+
+  if(rem > 0) {
+    struct crypto_dirty *d = _crypto_dirty_load(cf, idx, &err);
+    if(d == NULL)
+      return err;
+    if(d->len > rem)
+      d->len = rem;
+    end += d->len + crypto_PADDING;
+    if((err = _crypto_dirty_seal(node, d)) < 0)
+      return err;
   }
 
-  return written;
+  crypto_writeq_drain(&node->wq);
+  if(ftruncate(node->fd, end) == -1)
+    return -errno;
+  crypto_cache_invalidate(node->dev, node->ino, idx + (rem > 0), SIZE_MAX);
+  node->data = off;
+  return 0;
+}
+
+// Truncation works on whole blocks, whatever the new size. Shrinking cuts
+// the backing file at the block boundary and seals only the block the new
+// end falls in again. Growing without file headers extends the data the
+// way a write past the end does, with headers the blocks are left alone
+// and the new size goes in the header. Either way, in volumes with holes,
+// the cost doesn't depend on how much the size changes by.
+int crypto_file_truncate(struct crypto_file *cf, off_t off){
+  struct crypto_node *node = cf->node;
+  pthread_rwlock_wrlock(&node->lock);
+
+  int err = _crypto_dirty_flush(node);
+  crypto_writeq_drain(&node->wq);
+  if(err == 0 && off < node->data)
+    err = _crypto_cut_blocks(cf, off);
+  else if(err == 0 && !file_headers && off > node->data && (err = _crypto_extend(cf, off)) == 0)
+    err = _crypto_dirty_flush(node);
+  if(err == 0 && file_headers && (err = _crypto_header_write(node->fd, off)) == 0)
+    node->headed = 1;
+  if(err == 0)
+    __atomic_store_n(&node->size, off, __ATOMIC_RELAXED);
+  if(file_headers)
+    crypto_sizes_forget(node->dev, node->ino);
+
+  pthread_rwlock_unlock(&node->lock);
+  return err;
 }
 
+// Goes through a handle of our own, so truncating a file works the same
+// whether or not anybody has it open.
 static int crypto_truncate(const char *path, off_t off){
-  WITH_CRYPTO_PATH(int err = truncate(cpath, off))
+  int which = crypto_control_path(path);
+  if(which != CRYPTO_CONTROL_NONE)
+    return which == CRYPTO_CONTROL_DIR ? -EISDIR : which == CRYPTO_CONTROL_MISSING ? -ENOENT : 0;
 
-  CHECK_ERR
+  struct fuse_file_info inf;
+  memset(&inf, 0, sizeof(inf));
+  inf.flags = O_WRONLY;
+
+  int err = crypto_open(path, &inf);
+  if(err < 0)
+    return err;
+
+  err = crypto_file_truncate(CRYPTO_FILE(&inf), off);
+  int res = crypto_release(path, &inf);
+  return err < 0 ? err : res;
 }
 
 static int crypto_ftruncate(const char *path, off_t off,
                             struct fuse_file_info *inf){
-  (void) path;
+  if(crypto_control_path(path) != CRYPTO_CONTROL_NONE)
+    return 0;
+  return crypto_file_truncate(CRYPTO_FILE(inf), off);
+}
 
-  int err = ftruncate(inf->fh, off);
+#if FUSE_VERSION >= 29 && defined(__linux__)
+static int crypto_fallocate(const char *path, int mode, off_t off, off_t len,
+                            struct fuse_file_info *inf){
+  if(crypto_control_path(path) != CRYPTO_CONTROL_NONE)
+    return -EOPNOTSUPP;
+  return crypto_file_fallocate(CRYPTO_FILE(inf), mode, off, len);
+}
+#endif
+
+#ifdef __linux__
+// Turns the blocks in [from, to) into holes, by punching them out of the
+// backing file or, where it can't, overwriting them with zeros. Called
+// with the node locked for writing and nothing dirty.
+static int _crypto_punch_blocks(struct crypto_node *node, size_t from, size_t to){
+  static const unsigned char zeros[1 << 16];
+  off_t start = _crypto_block_off(from), end = _crypto_block_off(to);
+
+  crypto_writeq_drain(&node->wq);
+  crypto_cache_invalidate(node->dev, node->ino, from, to);
+  if(fallocate(node->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start) == 0)
+    return 0;
+  if(errno != EOPNOTSUPP)
+    return -errno;
 
-  CHECK_ERR
+  struct stat st;
+  if(fstat(node->fd, &st) == -1)
+    return -errno;
+  if(end > st.st_size)
+    end = st.st_size;
+  while(start < end) {
+    size_t n = end - start < (off_t) sizeof(zeros) ? (size_t) (end - start) : sizeof(zeros);
+    ssize_t res = pwrite(node->fd, zeros, n, start);
+    if(res == -1)
+      return -errno;
+    crypto_stats_add(CRYPTO_STATS_BACKING_WRITTEN, res);
+    start += res;
+  }
+  return 0;
+}
+
+// Zeros [from, to), which must not be past node->data. With holes whole
+// blocks are punched and only the blocks the range starts or ends inside
+// are sealed again, without them it is all sealed zeros. Called with the
+// node locked for writing.
+static int _crypto_zero_range(struct crypto_file *cf, off_t from, off_t to){
+  static const unsigned char zeros[1 << 16];
+  struct crypto_node *node = cf->node;
+  const size_t payload = block_size - crypto_PADDING;
+  size_t first = (from + payload - 1) / payload;
+  size_t last  = to == node->data ? (to + payload - 1) / payload : to / payload;
+
+  int err = _crypto_dirty_flush(node);
+  if(err == 0 && holes && first < last) {
+    err = _crypto_punch_blocks(node, first, last);
+    off_t head = (off_t) (first * payload);
+    off_t tail = (off_t) (last * payload) < to ? (off_t) (last * payload) : to;
+    while(err == 0 && tail < to) {
+      size_t n = to - tail < (off_t) sizeof(zeros) ? (size_t) (to - tail) : sizeof(zeros);
+      size_t done = 0;
+      err = _crypto_write_at(cf, zeros, n, tail, &done);
+      tail += n;
+    }
+    to = head;
+  }
+  while(err == 0 && from < to) {
+    size_t n = to - from < (off_t) sizeof(zeros) ? (size_t) (to - from) : sizeof(zeros);
+    size_t done = 0;
+    err = _crypto_write_at(cf, zeros, n, from, &done);
+    from += n;
+  }
+  return err;
+}
+
+// fallocate(2) with no mode, FALLOC_FL_KEEP_SIZE, FALLOC_FL_PUNCH_HOLE or
+// FALLOC_FL_ZERO_RANGE. Growing the file extends it the same way a write
+// past the end does. Allocating reserves the space the blocks will take
+// in the backing file, past the end of it, where it is never read.
+int crypto_file_fallocate(struct crypto_file *cf, int mode, off_t off, off_t len){
+  struct crypto_node *node = cf->node;
+  const size_t payload = block_size - crypto_PADDING;
+  int zero = FALLOC_FL_PUNCH_HOLE;
+#ifdef FALLOC_FL_ZERO_RANGE
+  zero |= FALLOC_FL_ZERO_RANGE;
+#endif
+
+  if(off < 0 || len <= 0)
+    return -EINVAL;
+  if((mode & ~(zero | FALLOC_FL_KEEP_SIZE)) != 0 ||
+     ((mode & FALLOC_FL_PUNCH_HOLE) && mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)))
+    return -EOPNOTSUPP;
+  if((cf->flags & O_ACCMODE) == O_RDONLY)
+    return -EBADF;
+
+  pthread_rwlock_wrlock(&node->lock);
+  off_t end = off + len;
+  int err = _crypto_node_head(node);
+  if(err == 0 && (mode & zero) && off < node->data)
+    err = _crypto_zero_range(cf, off, end < node->data ? end : node->data);
+  if(err == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && end > node->size)
+    err = _crypto_extend(cf, end);
+  if(err == 0 && !(mode & zero)) {
+    off_t start = _crypto_block_off(off / payload);
+    if(fallocate(node->fd, FALLOC_FL_KEEP_SIZE, start, _crypto_block_off((end + payload - 1) / payload) - start) == -1)
+      err = -errno;
+  }
+  pthread_rwlock_unlock(&node->lock);
+  return err;
 }
+#endif
 
 static int crypto_statfs(const char *path, struct statvfs *stat){
-  WITH_CRYPTO_PATH(int err = statvfs(cpath, stat))
+  (void) path;
+  int err = statvfs(crypto_dir, stat);
 
   CHECK_ERR
 }
 
 static int crypto_mkdir(const char *path, mode_t mode){
-  WITH_CRYPTO_PATH(int err = mkdir(cpath, mode))
+  if(_crypto_reserved(path))
+    return -EACCES;
+
+  WITH_CRYPTO_AT(int err = mkdirat(at.fd, at.name, mode))
 
   CHECK_ERR
 }
 
 static int crypto_rmdir(const char *path){
-  WITH_CRYPTO_PATH(int err = rmdir(cpath))
+  if(crypto_control_path(path) != CRYPTO_CONTROL_NONE)
+    return -EACCES;
+
+  WITH_CRYPTO_AT(int err = unlinkat(at.fd, at.name, AT_REMOVEDIR))
 
+  if(err == 0)
+    crypto_dirs_forget(path);
   CHECK_ERR
 }
 
 static int crypto_rename(const char *from, const char *to){
-  char *cfrom = _crypto_path(from);
-  char *cto   = _crypto_path(to);
-  int err     = rename(cfrom, cto);
-  free(cfrom);
-  free(cto);
+  if(_crypto_reserved(to) || crypto_control_path(from) != CRYPTO_CONTROL_NONE)
+    return -EACCES;
+
+  struct crypto_at afrom, ato;
+  int err = crypto_dirs_at(from, &afrom);
+  if(err < 0)
+    return err;
+  if((err = crypto_dirs_at(to, &ato)) < 0) {
+    crypto_dirs_done(&afrom);
+    return err;
+  }
+
+  // Only a directory can replace a directory, so if there was one at to,
+  // from is one too. Otherwise what got renamed has to be looked at.
+  struct stat st, moved;
+  int replaced = fstatat(ato.fd, ato.name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+  err = renameat(afrom.fd, afrom.name, ato.fd, ato.name);
+  int dir = replaced && S_ISDIR(st.st_mode);
+  if(err == 0 && !replaced)
+    dir = fstatat(ato.fd, ato.name, &moved, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(moved.st_mode);
+  crypto_dirs_done(&afrom);
+  crypto_dirs_done(&ato);
+  if(err == 0) {
+    if(dir)
+      crypto_dirs_forget_all();
+    if(replaced)
+      crypto_file_forget(&st);
+  }
   CHECK_ERR
 }
 
 static int crypto_symlink(const char *from, const char *to){
+  if(_crypto_reserved(to))
+    return -EACCES;
+
   char *cfrom = _crypto_path(from);
-  char *cto   = _crypto_path(to);
-  int err     = symlink(cfrom, cto);
+  if(cfrom == NULL) return -ENOMEM;
+
+  struct crypto_at ato;
+  int err = crypto_dirs_at(to, &ato);
+  if(err < 0) {
+    free(cfrom);
+    return err;
+  }
+
+  err = symlinkat(cfrom, ato.fd, ato.name);
+  crypto_dirs_done(&ato);
   free(cfrom);
-  free(cto);
   CHECK_ERR
 }
 
 static int crypto_link(const char *from, const char *to){
-  char *cfrom = _crypto_path(from);
-  char *cto   = _crypto_path(to);
-  int err     = link(cfrom, cto);
-  free(cfrom);
-  free(cto);
+  if(_crypto_reserved(to))
+    return -EACCES;
+
+  struct crypto_at afrom, ato;
+  int err = crypto_dirs_at(from, &afrom);
+  if(err < 0)
+    return err;
+  if((err = crypto_dirs_at(to, &ato)) < 0) {
+    crypto_dirs_done(&afrom);
+    return err;
+  }
+
+  err = linkat(afrom.fd, afrom.name, ato.fd, ato.name, 0);
+  crypto_dirs_done(&afrom);
+  crypto_dirs_done(&ato);
   CHECK_ERR
 }
 
 // todo decrypt buf here
 static int crypto_readlink(const char *path, char *buf, size_t size){
-  WITH_CRYPTO_PATH(int err = readlink(cpath, buf, size - 1))
+  WITH_CRYPTO_AT(ssize_t res = readlinkat(at.fd, at.name, buf, size - 1))
 
-  if(err == -1)
+  if(res == -1)
     return -errno;
 
-  buf[size] = '\0';
+  buf[res] = '\0';
   return 0;
 }
 
 static int crypto_chmod(const char *path, mode_t mode){
-  WITH_CRYPTO_PATH(int err = chmod(cpath, mode))
+  if(crypto_control_path(path) != CRYPTO_CONTROL_NONE)
+    return -EACCES;
+
+  WITH_CRYPTO_AT(int err = fchmodat(at.fd, at.name, mode, 0))
 
   CHECK_ERR
 }
 
 static int crypto_chown(const char *path, uid_t uid, gid_t gid){
-  WITH_CRYPTO_PATH(int err = chown(cpath, uid, gid))
+  if(crypto_control_path(path) != CRYPTO_CONTROL_NONE)
+    return -EACCES;
+
+  WITH_CRYPTO_AT(int err = fchownat(at.fd, at.name, uid, gid, 0))
 
   CHECK_ERR
 }
 
+void crypto_conn_init(struct fuse_conn_info *conn){
+  // Whole blocks are the cheapest thing to write, never settle for 4K.
+  conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | FUSE_CAP_ASYNC_READ);
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+  if(crypto_opts.writeback)
+    conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+#endif
+}
+
+static void *crypto_init(struct fuse_conn_info *conn){
+  crypto_conn_init(conn);
+  return NULL;
+}
+
 static struct fuse_operations crypto_ops = {
+  .init      = crypto_init,
   .fsync     = crypto_fsync,
   .getattr   = crypto_getattr,
   .readdir   = crypto_readdir,
   .mknod     = crypto_mknod,
   .open      = crypto_open,
+  .flush     = crypto_flush,
+  .release   = crypto_release,
   .unlink    = crypto_unlink,
   .create    = crypto_create,
   .read      = crypto_read,
   .write     = crypto_write,
   .truncate  = crypto_truncate,
   .ftruncate = crypto_ftruncate,
+#if FUSE_VERSION >= 29 && defined(__linux__)
+  .fallocate = crypto_fallocate,
+#endif
   .statfs    = crypto_statfs,
   .mkdir     = crypto_mkdir,
   .rmdir     = crypto_rmdir,
@@ -361,60 +1799,194 @@ static struct fuse_operations crypto_ops = {
   .chown     = crypto_chown
 };
 
-// from: http://www.gnu.org/software/libc/manual/html_node/getpass.html
-ssize_t _crypto_getpass(char **lineptr, size_t *n, FILE *stream){
-  struct termios old, new;
-  int nread = 0;
+// Reads the volume header, or writes one if crypto_dir is a fresh volume.
+// Directories that already hold files but no header predate it and keep
+// the legacy block size.
+static int _crypto_volume_open(struct crypto_volume *vol){
+  int err = crypto_volume_load(crypto_dir, key, vol);
+  if(err != -ENOENT)
+    return err;
 
-  if(isatty(fileno(stream))){
-    if (tcgetattr(fileno(stream), &old) != 0)
-      return -1;
-    new = old;
-    new.c_lflag &= ~ECHO;
-    if (tcsetattr(fileno(stream), TCSAFLUSH, &new) != 0)
-      return -1;
+  DIR *dp = opendir(crypto_dir);
+  if(dp == NULL)
+    return -errno;
+  int empty = 1;
+  struct dirent *de;
+  while(empty && (de = readdir(dp)) != NULL)
+    empty = strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0;
+  closedir(dp);
+
+  if(!empty) {
+    vol->block_size = CRYPTO_BLOCK_LEGACY;
+    vol->flags      = 0;
+    vol->suite      = CRYPTO_SUITE_XSALSA20_POLY1305;
+    return 0;
   }
 
-  nread = getline(lineptr, n, stream);
+  vol->block_size = crypto_opts.block_size ? crypto_opts.block_size : CRYPTO_BLOCK_LEGACY;
+  vol->flags      = (crypto_opts.file_headers ? CRYPTO_VOLUME_HEADERS : 0) |
+                    (crypto_opts.holes ? CRYPTO_VOLUME_HOLES : 0);
+  vol->suite      = crypto_opts.cipher ? crypto_suite_find(crypto_opts.cipher)
+                                       : CRYPTO_SUITE_XSALSA20_POLY1305;
+  return crypto_volume_create(crypto_dir, key, vol);
+}
+
+int crypto_options_parse(struct fuse_args *args){
+  if(fuse_opt_parse(args, &crypto_opts, crypto_profile_spec, NULL) == -1)
+    return -1;
 
-  if(isatty(fileno(stream)))
-    (void) tcsetattr(fileno(stream), TCSAFLUSH, &old);
+  if(crypto_opts.profile != NULL) {
+    const struct crypto_profile *p = crypto_profiles;
+    while(p->name != NULL && strcmp(p->name, crypto_opts.profile) != 0)
+      p++;
+    if(p->name == NULL) {
+      printf("unknown profile %s\n", crypto_opts.profile);
+      return -1;
+    }
+    if(fuse_opt_insert_arg(args, 1, p->opts) == -1)
+      return -1;
+  }
+  if(fuse_opt_parse(args, &crypto_opts, crypto_opt_spec, NULL) == -1)
+    return -1;
 
-  return nread;
+  if(crypto_opts.block_size != 0 && !crypto_volume_block_ok(crypto_opts.block_size)) {
+    printf("block_size must be a power of two from %d to %d\n", CRYPTO_BLOCK_MIN, CRYPTO_BLOCK_MAX);
+    return -1;
+  }
+  if(crypto_opts.cipher != NULL && crypto_suite_find(crypto_opts.cipher) == -1) {
+    printf("cipher must be one of %s, %s or %s\n", crypto_suite_name(CRYPTO_SUITE_XSALSA20_POLY1305),
+           crypto_suite_name(CRYPTO_SUITE_XAES256_GCM), crypto_suite_name(CRYPTO_SUITE_XCHACHA20_POLY1305));
+    return -1;
+  }
+#ifndef FUSE_CAP_WRITEBACK_CACHE
+  if(crypto_opts.writeback)
+    printf("this libfuse has no writeback_cache, writes are not cached\n");
+#endif
+  return 0;
 }
 
+int crypto_engine_init(const char *dir, const unsigned char *k){
+  if((crypto_dir = strdup(dir)) == NULL) {
+    printf("%s\n", strerror(errno));
+    return -1;
+  }
+  memcpy(key, k, sizeof(key));
+
+  struct crypto_volume vol;
+  int res = _crypto_volume_open(&vol);
+  if(res == -EINVAL) {
+    printf("wrong password, or the volume header is damaged\n");
+    return -1;
+  } else if(res < 0) {
+    printf("could not set up the volume: %s\n", strerror(-res));
+    return -1;
+  }
+  if(crypto_opts.block_size != 0 && crypto_opts.block_size != vol.block_size) {
+    printf("this volume uses %zu byte blocks\n", vol.block_size);
+    return -1;
+  }
+  if(crypto_opts.file_headers && !(vol.flags & CRYPTO_VOLUME_HEADERS)) {
+    printf("file_headers can only be chosen for a new volume\n");
+    return -1;
+  }
+  if(crypto_opts.holes && !(vol.flags & CRYPTO_VOLUME_HOLES)) {
+    printf("holes can only be chosen for a new volume\n");
+    return -1;
+  }
+  if(crypto_opts.cipher != NULL && crypto_suite_find(crypto_opts.cipher) != (int) vol.suite) {
+    printf("this volume uses %s\n", crypto_suite_name(vol.suite));
+    return -1;
+  }
+  if(vol.suite == CRYPTO_SUITE_XAES256_GCM && !crypto_gcm_hw())
+    printf("this cpu has no AES-NI, %s will be slow\n", crypto_suite_name(vol.suite));
+  _crypto_volume_setup(&vol);
 
-int main(int argc, char *argv[]) {
-  if(argc < 3) {
-    printf("not enough arguments, usage: cryptofs <encdir> <mount>\n");
-    return 1;
+  if(file_headers && crypto_sizes_init(size_entries) == -1) {
+    printf("could not allocate the size cache\n");
+    return -1;
   }
 
-  struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
-  for(int i = 0; i < argc; i++) {
-    if(i == 1) {
-      crypto_dir = realpath(argv[i], NULL);
-    } else {
-      fuse_opt_add_arg(&args, argv[i]);
+  // Cached directories, open files and, in the low level frontend, every
+  // inode the kernel holds on to take a descriptor each. Take as many as
+  // we are allowed and leave the directory cache a quarter of them, since
+  // nothing evicts it short of a collision.
+  struct rlimit rl;
+  size_t dirs = dir_entries;
+  if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    if(rl.rlim_cur < rl.rlim_max) {
+      rl.rlim_cur = rl.rlim_max;
+      if(setrlimit(RLIMIT_NOFILE, &rl) == -1)
+        getrlimit(RLIMIT_NOFILE, &rl);
     }
+    if(rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur / 4 < dirs)
+      dirs = rl.rlim_cur / 4;
+  }
+  if((res = crypto_dirs_init(crypto_dir, dirs)) < 0) {
+    printf("%s: %s\n", crypto_dir, strerror(-res));
+    return -1;
   }
 
-  printf("enter password: ");
-  char *pw;
-  size_t pwsize;
-  ssize_t nread = _crypto_getpass(&pw, &pwsize, stdin);
-  puts("");
+  if(crypto_opts.threads < 0)
+    crypto_opts.threads = sysconf(_SC_NPROCESSORS_ONLN);
+  crypto_pool_init(crypto_opts.threads);
 
-  if(nread < 0){
-    printf("%s\n", strerror(errno));
-    return errno;
+  if(crypto_cache_init(crypto_opts.cache_mb << 20, block_size - crypto_PADDING) == -1) {
+    printf("could not allocate a %lu MiB block cache\n", crypto_opts.cache_mb);
+    return -1;
   }
 
-  crypto_hash(key, (unsigned char *) pw, nread);
-  memset(pw, 0, nread);
-  free(pw);
-  int ret = fuse_main(args.argc, args.argv, &crypto_ops, NULL);
-  fuse_opt_free_args(&args);
-  free(crypto_dir);
+  // Enough queued to write behind to keep io_depth writes in flight.
+  crypto_io_init(crypto_opts.io_depth);
+  write_behind = crypto_opts.writers > 0;
+  crypto_writer_init(crypto_opts.writers, (crypto_io_depth() < 4 ? 4 : crypto_io_depth()) *
+                                          write_batch * block_size);
+
+  // Read ahead lands in the block cache, and mustn't push out much of it.
+  ahead_max = (crypto_opts.readahead_kb << 10) / (block_size - crypto_PADDING);
+  if(ahead_max > crypto_cache_blocks() / 4)
+    ahead_max = crypto_cache_blocks() / 4;
+
+  return 0;
+}
+
+size_t crypto_engine_payload(void){
+  return block_size - crypto_PADDING;
+}
+
+const struct fuse_operations *crypto_engine_ops(void){
+  return &crypto_ops;
+}
+
+// Calls go through the trace layer whether or not there is a trace, it
+// times them for the stats. The trace is opened before FUSE daemonizes
+// and leaves the working directory behind.
+int crypto_engine_serve(struct fuse_args *args){
+  if(crypto_opts.lowlevel) {
+    if(crypto_opts.trace != NULL) {
+      printf("trace only works without lowlevel\n");
+      return 1;
+    }
+    return crypto_lowlevel_main(args, crypto_dir);
+  }
+
+  int err = crypto_opts.trace != NULL ? crypto_trace_open(crypto_opts.trace) : 0;
+  if(err < 0) {
+    printf("%s: %s\n", crypto_opts.trace, strerror(-err));
+    return 1;
+  }
+  int ret = fuse_main(args->argc, args->argv, crypto_trace_wrap(&crypto_ops), NULL);
+  crypto_trace_close();
   return ret;
 }
+
+void crypto_engine_destroy(void){
+  crypto_writer_destroy();
+  crypto_pool_destroy();
+  crypto_io_destroy();
+  crypto_cache_destroy();
+  crypto_sizes_destroy();
+  crypto_dirs_destroy();
+  crypto_suite_destroy();
+  free(crypto_dir);
+  crypto_dir = NULL;
+}
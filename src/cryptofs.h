@@ -0,0 +1,74 @@
+#ifndef CRYPTOFS_CRYPTOFS_H
+#define CRYPTOFS_CRYPTOFS_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// The encrypting file engine both frontends sit on. A crypto_file is an
+// open backing file; everything it reads comes out decrypted and
+// everything written to it goes in sealed. Errors are negative errnos and
+// read and write return byte counts, the same as the FUSE operations.
+
+struct crypto_file;
+struct fuse_conn_info;
+struct fuse_args;
+struct fuse_operations;
+
+// Takes the engine's own options, and those of the profile they name, out
+// of the mount options in args and checks them. Prints what is wrong with
+// them and returns -1.
+int crypto_options_parse(struct fuse_args *args);
+
+// Sets the engine up to serve the encrypted directory dir, an absolute
+// path, with the 32 byte volume key, creating the volume header if dir is
+// a fresh volume. Prints why it can't and returns -1. Needs no mount, the
+// crypto_file calls work as soon as it returns.
+int crypto_engine_init(const char *dir, const unsigned char *key);
+void crypto_engine_destroy(void);
+
+// Plaintext bytes each block of the volume holds.
+size_t crypto_engine_payload(void);
+
+// Mounts through the frontend the options asked for and serves until it
+// is unmounted. Returns the process exit status.
+int crypto_engine_serve(struct fuse_args *args);
+
+// The path based frontend's op table, which also works without a mount,
+// once crypto_engine_init has returned.
+const struct fuse_operations *crypto_engine_ops(void);
+
+// Path of path inside the encrypted directory, which the caller frees.
+char *_crypto_path(const char *path);
+
+// Opens name relative to dirfd with the open(2) flags and mode of the
+// caller, O_CREAT and O_EXCL included.
+int crypto_file_open(int dirfd, const char *name, int flags, mode_t mode, struct crypto_file **cf);
+int crypto_file_read(struct crypto_file *cf, char *buf, size_t size, off_t off);
+int crypto_file_write(struct crypto_file *cf, const char *buf, size_t size, off_t off);
+int crypto_file_truncate(struct crypto_file *cf, off_t off);
+// In volumes with holes, blocks the backing file has holes under read as
+// zeros. The same as fallocate(2), Linux only.
+int crypto_file_fallocate(struct crypto_file *cf, int mode, off_t off, off_t len);
+int crypto_file_flush(struct crypto_file *cf);
+int crypto_file_fsync(struct crypto_file *cf, int datasync);
+int crypto_file_release(struct crypto_file *cf);
+
+// Turns the backing file's size in st, lstat'ed at name in dirfd, into
+// the plaintext size. Anything but a regular file is left alone.
+int crypto_file_attr(int dirfd, const char *name, struct stat *st);
+
+// fstatat of name in dirfd, not following links, with the plaintext size.
+int crypto_file_stat(int dirfd, const char *name, struct stat *st);
+
+// Attributes for listing the directory entry name in dirfd, of inode ino
+// and dirent type type.
+void crypto_file_entry(int dirfd, const char *name, ino_t ino, unsigned char type, struct stat *st);
+
+// Negotiates what the mount options asked for with the kernel, from the
+// frontend's init callback.
+void crypto_conn_init(struct fuse_conn_info *conn);
+
+// Drops what is remembered about the file st, which is losing its last name.
+void crypto_file_forget(const struct stat *st);
+
+#endif
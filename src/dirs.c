@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "src/dirs.h"
+
+// Only Linux can open a directory just to resolve names against it.
+#ifndef O_PATH
+#define O_PATH O_RDONLY
+#endif
+
+#define DIRS_LOCKS 16
+
+// Direct mapped like the size cache. An entry that is still in use when
+// it is forgotten is closed by whoever hands it back last, one still in use
+// when another path wants its slot stays and the newcomer goes uncached.
+// Entries from before the last crypto_dirs_forget_all are forgotten, and
+// are closed as they are next come across.
+struct dirs_entry {
+  char *path;               // relative to the root, without leading or trailing slashes
+  size_t len;
+  int fd;
+  int refs;                 // lookups not yet handed back through crypto_dirs_done
+  int stale;                // forgotten while in use
+  uint64_t epoch;           // the epoch it was opened in
+};
+
+static int root = -1;
+static struct dirs_entry *entries = NULL;
+static size_t nentries = 0;
+static pthread_mutex_t locks[DIRS_LOCKS];
+static uint64_t generation = 0;   // bumped by every forget
+static uint64_t epoch = 0;        // bumped by crypto_dirs_forget_all
+
+static size_t _dirs_slot(const char *path, size_t len){
+  uint64_t h = 0xCBF29CE484222325ULL;
+  for(size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char) path[i]) * 0x100000001B3ULL;
+  // FNV barely carries the last bytes out of the low bits, and siblings
+  // differ in little else, so mix before taking a slot.
+  h ^= h >> 29;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  h ^= h >> 32;
+  return h & (nentries - 1);
+}
+
+static pthread_mutex_t *_dirs_lock(size_t slot){
+  return &locks[slot % DIRS_LOCKS];
+}
+
+static void _dirs_clear(struct dirs_entry *e){
+  close(e->fd);
+  free(e->path);
+  memset(e, 0, sizeof(*e));
+}
+
+static int _dirs_stale(const struct dirs_entry *e){
+  return e->stale || e->epoch != __atomic_load_n(&epoch, __ATOMIC_ACQUIRE);
+}
+
+int crypto_dirs_init(const char *dir, size_t want){
+  if((root = open(dir, O_PATH | O_DIRECTORY)) == -1)
+    return -errno;
+  if(want == 0)
+    return 0;
+
+  // Rounded down, want is what the descriptor budget allows.
+  size_t n = 1;
+  while(n * 2 <= want)
+    n <<= 1;
+  if((entries = calloc(n, sizeof(*entries))) == NULL)
+    return -ENOMEM;
+
+  for(int i = 0; i < DIRS_LOCKS; i++)
+    pthread_mutex_init(&locks[i], NULL);
+  nentries = n;
+  return 0;
+}
+
+void crypto_dirs_destroy(void){
+  if(root != -1)
+    close(root);
+  root = -1;
+  if(entries == NULL)
+    return;
+  for(size_t i = 0; i < nentries; i++) {
+    if(entries[i].path != NULL)
+      _dirs_clear(&entries[i]);
+  }
+  for(int i = 0; i < DIRS_LOCKS; i++)
+    pthread_mutex_destroy(&locks[i]);
+  free(entries);
+  entries  = NULL;
+  nentries = 0;
+}
+
+int crypto_dirs_at(const char *path, struct crypto_at *at){
+  while(*path == '/')
+    path++;
+
+  at->slot = NULL;
+  const char *slash = strrchr(path, '/');
+  if(slash == NULL) {
+    at->fd   = root;
+    at->name = *path != '\0' ? path : ".";
+    return 0;
+  }
+  at->name = slash + 1;
+
+  size_t len  = slash - path;
+  size_t slot = 0;
+  struct dirs_entry *e = NULL;
+  uint64_t gen = 0, ep = 0;
+  if(entries != NULL) {
+    slot = _dirs_slot(path, len);
+    e    = &entries[slot];
+    pthread_mutex_lock(_dirs_lock(slot));
+    if(e->path != NULL && !_dirs_stale(e) && e->len == len && memcmp(e->path, path, len) == 0) {
+      e->refs++;
+      at->fd   = e->fd;
+      at->slot = e;
+      pthread_mutex_unlock(_dirs_lock(slot));
+      return 0;
+    }
+    // Read in this order, crypto_dirs_forget_all bumps them the other way.
+    gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+    ep  = __atomic_load_n(&epoch, __ATOMIC_ACQUIRE);
+    pthread_mutex_unlock(_dirs_lock(slot));
+  }
+
+  char *dir = strndup(path, len);
+  if(dir == NULL)
+    return -ENOMEM;
+  if((at->fd = openat(root, dir, O_PATH | O_DIRECTORY)) == -1) {
+    int err = -errno;
+    free(dir);
+    return err;
+  }
+
+  // A forget since we looked may have been about this very directory.
+  if(e != NULL) {
+    pthread_mutex_lock(_dirs_lock(slot));
+    if(gen == __atomic_load_n(&generation, __ATOMIC_ACQUIRE) && e->refs == 0) {
+      if(e->path != NULL)
+        _dirs_clear(e);
+      e->path  = dir;
+      e->len   = len;
+      e->fd    = at->fd;
+      e->refs  = 1;
+      e->epoch = ep;
+      at->slot = e;
+      dir = NULL;
+    }
+    pthread_mutex_unlock(_dirs_lock(slot));
+  }
+  free(dir);
+  return 0;
+}
+
+// Leaves errno alone, callers still want to look at what the call they
+// made with at->fd set.
+void crypto_dirs_done(struct crypto_at *at){
+  int saved = errno;
+  if(at->slot == NULL) {
+    if(at->fd != root)
+      close(at->fd);
+  } else {
+    struct dirs_entry *e = at->slot;
+    size_t slot = e - entries;
+    pthread_mutex_lock(_dirs_lock(slot));
+    if(--e->refs == 0 && _dirs_stale(e))
+      _dirs_clear(e);
+    pthread_mutex_unlock(_dirs_lock(slot));
+  }
+  errno = saved;
+}
+
+void crypto_dirs_forget(const char *path){
+  if(entries == NULL)
+    return;
+
+  while(*path == '/')
+    path++;
+  size_t len  = strlen(path);
+  size_t slot = _dirs_slot(path, len);
+  struct dirs_entry *e = &entries[slot];
+
+  pthread_mutex_lock(_dirs_lock(slot));
+  __atomic_fetch_add(&generation, 1, __ATOMIC_ACQ_REL);
+  if(e->path != NULL && e->len == len && memcmp(e->path, path, len) == 0) {
+    if(e->refs == 0)
+      _dirs_clear(e);
+    else
+      e->stale = 1;
+  }
+  pthread_mutex_unlock(_dirs_lock(slot));
+}
+
+void crypto_dirs_forget_all(void){
+  __atomic_fetch_add(&epoch, 1, __ATOMIC_ACQ_REL);
+  __atomic_fetch_add(&generation, 1, __ATOMIC_ACQ_REL);
+}
@@ -0,0 +1,36 @@
+#ifndef CRYPTOFS_DIRS_H
+#define CRYPTOFS_DIRS_H
+
+#include <sys/types.h>
+
+// Descriptors of the volume's directories, so that the path based
+// operations can use the *at() calls on a short name instead of handing
+// the kernel the whole absolute path every time. Directories are opened
+// relative to the root of the encrypted directory and the most recently
+// used ones stay open, keyed by their path.
+
+struct crypto_at {
+  int fd;                   // directory to resolve name against
+  const char *name;         // last component of the path, "." for the root
+  void *slot;               // cache entry fd belongs to, if any
+};
+
+// Opens the volume root at dir and keeps at most entries directories
+// below it open, 0 disables the cache. Returns 0 or a negative errno.
+int crypto_dirs_init(const char *dir, size_t entries);
+void crypto_dirs_destroy(void);
+
+// Splits path, relative to the volume root, into a directory descriptor
+// and a name. name points into path. Returns 0 or a negative errno, every
+// successful call is paired with crypto_dirs_done.
+int crypto_dirs_at(const char *path, struct crypto_at *at);
+void crypto_dirs_done(struct crypto_at *at);
+
+// Drops the directory at path, for when it is removed. Only an empty
+// directory can be, so nothing below it is cached.
+void crypto_dirs_forget(const char *path);
+// Drops every directory, for when one is renamed and takes everything
+// below it along. Takes no time, entries are closed as they come up.
+void crypto_dirs_forget_all(void);
+
+#endif
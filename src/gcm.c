@@ -0,0 +1,491 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "lib/tweetnacl.h"
+#include "src/gcm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GCM_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#define GCM_HW __attribute__((target("aes,pclmul,ssse3")))
+#endif
+
+// Blocks the instructions work on at once, enough to keep the AES units
+// busy while one product of the hash is reduced per batch. GCM_EACH runs
+// stmt for each of them with a constant i, which keeps the batch in
+// registers where a loop, left rolled at -O2, would spill it.
+#define GCM_WAYS 8
+#define GCM_EACH(stmt) { \
+  { const int i = 0; stmt; } { const int i = 1; stmt; } { const int i = 2; stmt; } \
+  { const int i = 3; stmt; } { const int i = 4; stmt; } { const int i = 5; stmt; } \
+  { const int i = 6; stmt; } { const int i = 7; stmt; } }
+
+static const unsigned char sbox[256] = {
+  0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+  0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+  0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+  0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+  0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+  0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+  0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+  0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+  0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+  0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+  0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+  0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+  0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+  0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+  0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+  0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static uint64_t _gcm_get64(const unsigned char *p){
+  uint64_t v = 0;
+  for(int i = 0; i < 8; i++)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static void _gcm_put64(unsigned char *p, uint64_t v){
+  for(int i = 7; i >= 0; i--, v >>= 8)
+    p[i] = v;
+}
+
+static void _gcm_put32(unsigned char *p, uint32_t v){
+  for(int i = 3; i >= 0; i--, v >>= 8)
+    p[i] = v;
+}
+
+static void _gcm_wipe(void *p, size_t len){
+  volatile unsigned char *v = p;
+  for(size_t i = 0; i < len; i++)
+    v[i] = 0;
+}
+
+static unsigned char _gcm_xtime(unsigned char x){
+  return (x << 1) ^ ((x >> 7) * 0x1b);
+}
+
+// AES-256 key schedule, the 60 words of it laid end to end in rk.
+static void _gcm_expand(unsigned char rk[15][16], const unsigned char *key){
+  unsigned char *w = rk[0];
+  unsigned char rcon = 1;
+
+  memcpy(w, key, 32);
+  for(int i = 8; i < 60; i++) {
+    unsigned char t[4];
+    memcpy(t, w + 4 * (i - 1), 4);
+    if(i % 8 == 0) {
+      unsigned char t0 = t[0];
+      t[0] = sbox[t[1]] ^ rcon;
+      t[1] = sbox[t[2]];
+      t[2] = sbox[t[3]];
+      t[3] = sbox[t0];
+      rcon = _gcm_xtime(rcon);
+    } else if(i % 8 == 4) {
+      for(int j = 0; j < 4; j++)
+        t[j] = sbox[t[j]];
+    }
+    for(int j = 0; j < 4; j++)
+      w[4 * i + j] = w[4 * (i - 8) + j] ^ t[j];
+  }
+}
+
+static void _gcm_aes(const unsigned char rk[15][16], unsigned char *out, const unsigned char *in){
+  unsigned char s[16], t[16];
+
+  for(int i = 0; i < 16; i++)
+    s[i] = in[i] ^ rk[0][i];
+  for(int r = 1; r < 15; r++) {
+    // SubBytes and ShiftRows, the state is a column after another.
+    for(int c = 0; c < 4; c++)
+      for(int j = 0; j < 4; j++)
+        t[4 * c + j] = sbox[s[4 * ((c + j) % 4) + j]];
+    // MixColumns, all but the last round.
+    for(int c = 0; r < 14 && c < 4; c++) {
+      unsigned char *a = t + 4 * c;
+      unsigned char x = a[0] ^ a[1] ^ a[2] ^ a[3], a0 = a[0];
+      a[0] ^= x ^ _gcm_xtime(a[0] ^ a[1]);
+      a[1] ^= x ^ _gcm_xtime(a[1] ^ a[2]);
+      a[2] ^= x ^ _gcm_xtime(a[2] ^ a[3]);
+      a[3] ^= x ^ _gcm_xtime(a[3] ^ a0);
+    }
+    for(int i = 0; i < 16; i++)
+      s[i] = t[i] ^ rk[r][i];
+  }
+  memcpy(out, s, 16);
+}
+
+// x *= h in GF(2^128), a bit at a time without branching on either.
+static void _gcm_mul(uint64_t x[2], const uint64_t h[2]){
+  uint64_t z0 = 0, z1 = 0, v0 = h[0], v1 = h[1];
+
+  for(int i = 0; i < 128; i++) {
+    uint64_t bit = -((x[i >> 6] >> (63 - (i & 63))) & 1);
+    z0 ^= v0 & bit;
+    z1 ^= v1 & bit;
+    uint64_t carry = -(v1 & 1);
+    v1 = (v1 >> 1) | (v0 << 63);
+    v0 = (v0 >> 1) ^ (0xe100000000000000ULL & carry);
+  }
+  x[0] = z0;
+  x[1] = z1;
+}
+
+// Hashes len bytes into x, the last block padded with zeros.
+static void _gcm_ghash(const struct crypto_gcm *g, uint64_t x[2], const unsigned char *p, size_t len){
+  unsigned char b[16];
+
+  while(len > 0) {
+    size_t n = len < 16 ? len : 16;
+    memset(b, 0, 16);
+    memcpy(b, p, n);
+    x[0] ^= _gcm_get64(b);
+    x[1] ^= _gcm_get64(b + 8);
+    _gcm_mul(x, g->hp);
+    p += n;
+    len -= n;
+  }
+}
+
+static void _gcm_crypt_sw(const struct crypto_gcm *g, unsigned char *out, const unsigned char *in,
+                          size_t len, const unsigned char *n, unsigned char *tag, int enc){
+  unsigned char ctr[16], ks[16];
+  uint64_t x[2] = { 0, 0 };
+  uint32_t i = 2;
+
+  // Decrypting may be in place, hash the ciphertext while it is there.
+  if(!enc)
+    _gcm_ghash(g, x, in, len);
+
+  memcpy(ctr, n, 12);
+  for(size_t off = 0; off < len; off += 16) {
+    _gcm_put32(ctr + 12, i++);
+    _gcm_aes(g->rk, ks, ctr);
+    for(size_t j = 0; j < 16 && off + j < len; j++)
+      out[off + j] = in[off + j] ^ ks[j];
+  }
+
+  if(enc)
+    _gcm_ghash(g, x, out, len);
+  x[1] ^= (uint64_t) len * 8;
+  _gcm_mul(x, g->hp);
+
+  _gcm_put32(ctr + 12, 1);
+  _gcm_aes(g->rk, ks, ctr);
+  _gcm_put64(tag, x[0]);
+  _gcm_put64(tag + 8, x[1]);
+  for(int j = 0; j < 16; j++)
+    tag[j] ^= ks[j];
+}
+
+#ifdef GCM_X86
+
+GCM_HW static inline __m128i _gcm_bswap(__m128i x){
+  return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+// Adds the 256 bit carry-less product of a and b into lo | hi.
+GCM_HW static inline void _gcm_clmul(__m128i a, __m128i b, __m128i *lo, __m128i *hi){
+  __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+  *lo = _mm_xor_si128(*lo, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00), _mm_slli_si128(mid, 8)));
+  *hi = _mm_xor_si128(*hi, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11), _mm_srli_si128(mid, 8)));
+}
+
+// Reduces lo | hi modulo the field polynomial. Operands are byte reversed
+// so the bits come out reflected and the product is shifted left by one
+// first, as in Intel's carry-less multiplication white paper. Both steps
+// are linear, so a sum of products can be reduced once.
+GCM_HW static inline __m128i _gcm_reduce(__m128i lo, __m128i hi){
+  __m128i t7 = _mm_srli_epi32(lo, 31), t8 = _mm_srli_epi32(hi, 31);
+  __m128i t9 = _mm_srli_si128(t7, 12);
+  lo = _mm_or_si128(_mm_slli_epi32(lo, 1), _mm_slli_si128(t7, 4));
+  hi = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(hi, 1), _mm_slli_si128(t8, 4)), t9);
+
+  t7 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)),
+                     _mm_slli_epi32(lo, 25));
+  t8 = _mm_srli_si128(t7, 4);
+  lo = _mm_xor_si128(lo, _mm_slli_si128(t7, 12));
+  __m128i t2 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)),
+                             _mm_srli_epi32(lo, 7));
+  lo = _mm_xor_si128(lo, _mm_xor_si128(t2, t8));
+  return _mm_xor_si128(hi, lo);
+}
+
+GCM_HW static inline __m128i _gcm_mul_hw(__m128i a, __m128i b){
+  __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+  _gcm_clmul(a, b, &lo, &hi);
+  return _gcm_reduce(lo, hi);
+}
+
+GCM_HW static inline __m128i _gcm_aes_hw(const __m128i *rk, __m128i b){
+  b = _mm_xor_si128(b, rk[0]);
+  for(int r = 1; r < 14; r++)
+    b = _mm_aesenc_si128(b, rk[r]);
+  return _mm_aesenclast_si128(b, rk[14]);
+}
+
+GCM_HW static inline __m128i _gcm_expand_step(__m128i a, __m128i t){
+  a = _mm_xor_si128(a, _mm_slli_si128(a, 4));
+  a = _mm_xor_si128(a, _mm_slli_si128(a, 4));
+  a = _mm_xor_si128(a, _mm_slli_si128(a, 4));
+  return _mm_xor_si128(a, t);
+}
+
+// The key schedule with AESKEYGENASSIST, which unlike _gcm_expand doesn't
+// look up the key in a table. XAES runs it for every block it seals.
+GCM_HW static void _gcm_expand_hw(unsigned char rk[15][16], const unsigned char *key){
+  __m128i a = _mm_loadu_si128((const __m128i *) key);
+  __m128i b = _mm_loadu_si128((const __m128i *) (key + 16));
+  _mm_storeu_si128((__m128i *) rk[0], a);
+  _mm_storeu_si128((__m128i *) rk[1], b);
+
+#define GCM_EXPAND_A(r, rcon) \
+  a = _gcm_expand_step(a, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(b, rcon), 0xff)); \
+  _mm_storeu_si128((__m128i *) rk[r], a);
+#define GCM_EXPAND_B(r) \
+  b = _gcm_expand_step(b, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(a, 0), 0xaa)); \
+  _mm_storeu_si128((__m128i *) rk[r], b);
+  GCM_EXPAND_A(2, 0x01)  GCM_EXPAND_B(3)
+  GCM_EXPAND_A(4, 0x02)  GCM_EXPAND_B(5)
+  GCM_EXPAND_A(6, 0x04)  GCM_EXPAND_B(7)
+  GCM_EXPAND_A(8, 0x08)  GCM_EXPAND_B(9)
+  GCM_EXPAND_A(10, 0x10) GCM_EXPAND_B(11)
+  GCM_EXPAND_A(12, 0x20) GCM_EXPAND_B(13)
+  GCM_EXPAND_A(14, 0x40)
+#undef GCM_EXPAND_A
+#undef GCM_EXPAND_B
+}
+
+// n blocks of in through AES under rk into out.
+GCM_HW static void _gcm_aes_blocks_hw(const unsigned char rk[15][16], unsigned char *out,
+                                      const unsigned char *in, int n){
+  __m128i k[15];
+  for(int i = 0; i < 15; i++)
+    k[i] = _mm_loadu_si128((const __m128i *) rk[i]);
+  for(int i = 0; i < n; i++)
+    _mm_storeu_si128((__m128i *) (out + 16 * i),
+                     _gcm_aes_hw(k, _mm_loadu_si128((const __m128i *) (in + 16 * i))));
+}
+
+GCM_HW static void _gcm_powers(struct crypto_gcm *g){
+  __m128i h = _gcm_bswap(_mm_loadu_si128((const __m128i *) g->h[0]));
+  __m128i p = h;
+  for(int i = 0; i < GCM_WAYS; i++) {
+    _mm_storeu_si128((__m128i *) g->h[i], p);
+    p = _gcm_mul_hw(p, h);
+  }
+}
+
+GCM_HW static void _gcm_crypt_hw(const struct crypto_gcm *g, unsigned char *out, const unsigned char *in,
+                                  size_t len, const unsigned char *n, unsigned char *tag, int enc){
+  __m128i rk[15], h[GCM_WAYS];
+  unsigned char buf[16];
+
+  for(int i = 0; i < 15; i++)
+    rk[i] = _mm_loadu_si128((const __m128i *) g->rk[i]);
+  for(int i = 0; i < GCM_WAYS; i++)
+    h[i] = _mm_loadu_si128((const __m128i *) g->h[i]);
+
+  // Byte reversed the counter is the low lane, which counts up with a
+  // plain 32 bit add.
+  memcpy(buf, n, 12);
+  _gcm_put32(buf + 12, 1);
+  __m128i j0 = _mm_loadu_si128((const __m128i *) buf);
+  __m128i ctr = _gcm_bswap(j0), one = _mm_set_epi32(0, 0, 0, 1);
+  __m128i x = _mm_setzero_si128();
+
+  size_t off = 0;
+  for(; off + 16 * GCM_WAYS <= len; off += 16 * GCM_WAYS) {
+    __m128i b[GCM_WAYS], c[GCM_WAYS];
+    GCM_EACH(ctr = _mm_add_epi32(ctr, one); b[i] = _mm_xor_si128(_gcm_bswap(ctr), rk[0]))
+    for(int r = 1; r < 14; r++)
+      GCM_EACH(b[i] = _mm_aesenc_si128(b[i], rk[r]))
+    GCM_EACH(
+      __m128i d = _mm_loadu_si128((const __m128i *) (in + off + 16 * i));
+      __m128i o = _mm_xor_si128(d, _mm_aesenclast_si128(b[i], rk[14]));
+      _mm_storeu_si128((__m128i *) (out + off + 16 * i), o);
+      c[i] = _gcm_bswap(enc ? o : d)
+    )
+
+    // x = (x + c0) H^8 + c1 H^7 + ... + c7 H, reduced once.
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    c[0] = _mm_xor_si128(c[0], x);
+    GCM_EACH(_gcm_clmul(c[i], h[GCM_WAYS - 1 - i], &lo, &hi))
+    x = _gcm_reduce(lo, hi);
+  }
+
+  for(; off < len; off += 16) {
+    size_t m = len - off < 16 ? len - off : 16;
+    memset(buf, 0, 16);
+    memcpy(buf, in + off, m);
+    ctr = _mm_add_epi32(ctr, one);
+    __m128i d = _mm_loadu_si128((const __m128i *) buf);
+    __m128i o = _mm_xor_si128(d, _gcm_aes_hw(rk, _gcm_bswap(ctr)));
+    _mm_storeu_si128((__m128i *) buf, o);
+    memcpy(out + off, buf, m);
+    if(enc) {
+      memset(buf + m, 0, 16 - m);
+      d = _mm_loadu_si128((const __m128i *) buf);
+    }
+    x = _gcm_mul_hw(_mm_xor_si128(x, _gcm_bswap(d)), h[0]);
+  }
+
+  memset(buf, 0, 8);
+  _gcm_put64(buf + 8, (uint64_t) len * 8);
+  x = _gcm_mul_hw(_mm_xor_si128(x, _gcm_bswap(_mm_loadu_si128((const __m128i *) buf))), h[0]);
+  x = _mm_xor_si128(_gcm_bswap(x), _gcm_aes_hw(rk, j0));
+  _mm_storeu_si128((__m128i *) tag, x);
+}
+
+#endif
+
+int crypto_gcm_hw(void){
+#ifdef GCM_X86
+  unsigned int a, b, c, d;
+  if(!__get_cpuid(1, &a, &b, &c, &d))
+    return 0;
+  // AES, PCLMULQDQ and SSSE3 for the byte shuffles.
+  return (c & (1 << 25)) && (c & (1 << 1)) && (c & (1 << 9));
+#else
+  return 0;
+#endif
+}
+
+// n blocks of in through AES under rk into out, on the instructions if hw.
+static void _gcm_aes_blocks(const unsigned char rk[15][16], unsigned char *out,
+                            const unsigned char *in, int n, int hw){
+#ifdef GCM_X86
+  if(hw) {
+    _gcm_aes_blocks_hw(rk, out, in, n);
+    return;
+  }
+#endif
+  (void) hw;
+  for(int i = 0; i < n; i++)
+    _gcm_aes(rk, out + 16 * i, in + 16 * i);
+}
+
+static void _gcm_expand_any(unsigned char rk[15][16], const unsigned char *key, int hw){
+#ifdef GCM_X86
+  if(hw) {
+    _gcm_expand_hw(rk, key);
+    return;
+  }
+#endif
+  (void) hw;
+  _gcm_expand(rk, key);
+}
+
+// crypto_gcm_init without asking the cpu what it has, which is slow
+// enough to matter once per block.
+static void _gcm_setup(struct crypto_gcm *g, const unsigned char *key, int hw){
+  unsigned char zero[16] = { 0 };
+
+  _gcm_expand_any(g->rk, key, hw);
+  _gcm_aes_blocks(g->rk, g->h[0], zero, 1, hw);
+  g->hp[0] = _gcm_get64(g->h[0]);
+  g->hp[1] = _gcm_get64(g->h[0] + 8);
+  g->hw    = hw;
+
+#ifdef GCM_X86
+  if(hw)
+    _gcm_powers(g);
+#endif
+}
+
+void crypto_gcm_init(struct crypto_gcm *g, const unsigned char *key){
+  memset(g, 0, sizeof(*g));
+  _gcm_setup(g, key, crypto_gcm_hw());
+}
+
+void crypto_gcm_wipe(struct crypto_gcm *g){
+  _gcm_wipe(g, sizeof(*g));
+}
+
+static void _gcm_crypt(const struct crypto_gcm *g, unsigned char *out, const unsigned char *in,
+                       size_t len, const unsigned char *n, unsigned char *tag, int enc){
+#ifdef GCM_X86
+  if(g->hw) {
+    _gcm_crypt_hw(g, out, in, len, n, tag, enc);
+    return;
+  }
+#endif
+  _gcm_crypt_sw(g, out, in, len, n, tag, enc);
+}
+
+void crypto_gcm_seal(const struct crypto_gcm *g, unsigned char *c, unsigned char *tag,
+                     const unsigned char *m, size_t len, const unsigned char *n){
+  _gcm_crypt(g, c, m, len, n, tag, 1);
+}
+
+int crypto_gcm_open(const struct crypto_gcm *g, unsigned char *m, const unsigned char *c,
+                    const unsigned char *tag, size_t len, const unsigned char *n){
+  unsigned char want[16];
+
+  _gcm_crypt(g, m, c, len, n, want, 0);
+  if(crypto_verify_16(want, tag) != 0) {
+    memset(m, 0, len);
+    return -1;
+  }
+  return 0;
+}
+
+void crypto_xaes_init(struct crypto_xaes *x, const unsigned char *key){
+  unsigned char zero[16] = { 0 }, l[16];
+
+  memset(x, 0, sizeof(*x));
+  x->hw = crypto_gcm_hw();
+  _gcm_expand_any(x->rk, key, x->hw);
+
+  // K1 = AES(0) doubled in GF(2^128), as in CMAC.
+  _gcm_aes_blocks(x->rk, l, zero, 1, x->hw);
+  for(int i = 0; i < 16; i++)
+    x->k1[i] = (l[i] << 1) | (i < 15 ? l[i + 1] >> 7 : 0);
+  x->k1[15] ^= 0x87 & -(l[0] >> 7);
+  _gcm_wipe(l, sizeof(l));
+}
+
+void crypto_xaes_wipe(struct crypto_xaes *x){
+  _gcm_wipe(x, sizeof(*x));
+}
+
+// The GCM key for nonce n, the CMAC of 0x00 0x01 'X' 0x00 | n[0:12] and of
+// 0x00 0x02 'X' 0x00 | n[0:12] side by side. Each is one whole block, so
+// CMAC comes down to a single AES of it xored with K1.
+static void _xaes_derive(const struct crypto_xaes *x, struct crypto_gcm *g, const unsigned char *n){
+  unsigned char m[32], k[32];
+
+  for(int i = 0; i < 2; i++) {
+    unsigned char *b = m + 16 * i;
+    b[0] = 0;
+    b[1] = i + 1;
+    b[2] = 'X';
+    b[3] = 0;
+    memcpy(b + 4, n, 12);
+    for(int j = 0; j < 16; j++)
+      b[j] ^= x->k1[j];
+  }
+  _gcm_aes_blocks(x->rk, k, m, 2, x->hw);
+  _gcm_setup(g, k, x->hw);
+  _gcm_wipe(m, sizeof(m));
+  _gcm_wipe(k, sizeof(k));
+}
+
+void crypto_xaes_seal(const struct crypto_xaes *x, unsigned char *c, unsigned char *tag,
+                      const unsigned char *m, size_t len, const unsigned char *n){
+  struct crypto_gcm g;
+  _xaes_derive(x, &g, n);
+  crypto_gcm_seal(&g, c, tag, m, len, n + 12);
+  crypto_gcm_wipe(&g);
+}
+
+int crypto_xaes_open(const struct crypto_xaes *x, unsigned char *m, const unsigned char *c,
+                     const unsigned char *tag, size_t len, const unsigned char *n){
+  struct crypto_gcm g;
+  _xaes_derive(x, &g, n);
+  int res = crypto_gcm_open(&g, m, c, tag, len, n + 12);
+  crypto_gcm_wipe(&g);
+  return res;
+}
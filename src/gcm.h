@@ -0,0 +1,61 @@
+#ifndef CRYPTOFS_GCM_H
+#define CRYPTOFS_GCM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// AES-256-GCM with a 96 bit nonce, a 128 bit tag and no associated data.
+// It runs on AES-NI and PCLMULQDQ when the cpu has them. Otherwise it
+// falls back to portable C, which is many times slower and, unlike the
+// instructions, not constant time.
+
+#define CRYPTO_GCM_KEYBYTES 32
+#define CRYPTO_GCM_NONCEBYTES 12
+#define CRYPTO_GCM_TAGBYTES 16
+
+struct crypto_gcm {
+  unsigned char rk[15][16];   // expanded key
+  unsigned char h[8][16];     // H to H^8 byte reversed, for PCLMULQDQ
+  uint64_t hp[2];             // H as two big endian halves, for the portable code
+  int hw;                     // use the instructions
+};
+
+void crypto_gcm_init(struct crypto_gcm *g, const unsigned char *key);
+void crypto_gcm_wipe(struct crypto_gcm *g);
+
+// Whether crypto_gcm_init picks the instructions on this cpu.
+int crypto_gcm_hw(void);
+
+void crypto_gcm_seal(const struct crypto_gcm *g, unsigned char *c, unsigned char *tag,
+                     const unsigned char *m, size_t len, const unsigned char *n);
+
+// Returns -1 and clears m if the tag doesn't match.
+int crypto_gcm_open(const struct crypto_gcm *g, unsigned char *m, const unsigned char *c,
+                    const unsigned char *tag, size_t len, const unsigned char *n);
+
+// XAES-256-GCM, as specified at c2sp.org/XAES-256-GCM: every 24 byte
+// nonce gets an AES-256-GCM key of its own, derived with AES-CMAC under
+// the main key from the first 12 bytes, and the last 12 are the GCM
+// nonce. Plain GCM with random 96 bit nonces is good for about 2^32
+// seals under a key, which a busy volume goes through, while this is
+// good for about 2^80.
+
+#define CRYPTO_XAES_NONCEBYTES 24
+
+struct crypto_xaes {
+  unsigned char rk[15][16];   // the main key, expanded
+  unsigned char k1[16];       // the CMAC subkey
+  int hw;
+};
+
+void crypto_xaes_init(struct crypto_xaes *x, const unsigned char *key);
+void crypto_xaes_wipe(struct crypto_xaes *x);
+
+void crypto_xaes_seal(const struct crypto_xaes *x, unsigned char *c, unsigned char *tag,
+                      const unsigned char *m, size_t len, const unsigned char *n);
+
+// Returns -1 and clears m if the tag doesn't match.
+int crypto_xaes_open(const struct crypto_xaes *x, unsigned char *m, const unsigned char *c,
+                     const unsigned char *tag, size_t len, const unsigned char *n);
+
+#endif
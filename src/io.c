@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "src/io.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#ifdef __NR_io_uring_setup
+#define IO_URING
+#endif
+#endif
+#endif
+
+static size_t depth = 1;
+
+static ssize_t _io_one(struct crypto_io *io){
+  ssize_t res;
+  do {
+    res = io->write ? pwrite(io->fd, io->buf, io->len, io->off)
+                    : pread(io->fd, io->buf, io->len, io->off);
+  } while(res == -1 && errno == EINTR);
+  return res == -1 ? -errno : res;
+}
+
+#ifdef IO_URING
+
+// The rings are mapped straight out of the kernel, with no liburing in
+// between. Every thread gets a ring of its own the first time it runs a
+// batch, so nothing about them needs locking.
+struct io_ring {
+  int fd;
+  unsigned entries;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  size_t sq_len, cq_len, sqes_len;
+};
+
+static pthread_key_t ring_key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static int broken = 0;    // the kernel turned down a ring, stick to pread and pwrite
+
+static void _io_ring_free(void *arg){
+  struct io_ring *r = arg;
+  if(r->sqes != NULL)
+    munmap(r->sqes, r->sqes_len);
+  if(r->cq_map != NULL && r->cq_map != r->sq_map)
+    munmap(r->cq_map, r->cq_len);
+  if(r->sq_map != NULL)
+    munmap(r->sq_map, r->sq_len);
+  close(r->fd);
+  free(r);
+}
+
+static void _io_key(void){
+  if(pthread_key_create(&ring_key, _io_ring_free) != 0)
+    broken = 1;
+}
+
+static void *_io_map(int fd, size_t len, off_t off){
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, off);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+static struct io_ring *_io_ring_new(void){
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, (unsigned) depth, &p);
+  if(fd == -1)
+    return NULL;
+
+  struct io_ring *r = calloc(1, sizeof(*r));
+  if(r == NULL) {
+    close(fd);
+    return NULL;
+  }
+  r->fd       = fd;
+  r->entries  = p.sq_entries;
+  r->sq_len   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    if(r->cq_len > r->sq_len)
+      r->sq_len = r->cq_len;
+    r->cq_len = r->sq_len;
+  }
+
+  r->sq_map = _io_map(fd, r->sq_len, IORING_OFF_SQ_RING);
+  if(r->sq_map != NULL)
+    r->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_map
+                                                      : _io_map(fd, r->cq_len, IORING_OFF_CQ_RING);
+  if(r->cq_map != NULL)
+    r->sqes = _io_map(fd, r->sqes_len, IORING_OFF_SQES);
+  if(r->sqes == NULL) {
+    _io_ring_free(r);
+    return NULL;
+  }
+
+  unsigned char *sq = r->sq_map, *cq = r->cq_map;
+  r->sq_tail  = (unsigned *) (sq + p.sq_off.tail);
+  r->sq_mask  = (unsigned *) (sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *) (sq + p.sq_off.array);
+  r->cq_head  = (unsigned *) (cq + p.cq_off.head);
+  r->cq_tail  = (unsigned *) (cq + p.cq_off.tail);
+  r->cq_mask  = (unsigned *) (cq + p.cq_off.ring_mask);
+  r->cqes     = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return r;
+}
+
+static struct io_ring *_io_ring(void){
+  pthread_once(&once, _io_key);
+  if(broken)
+    return NULL;
+
+  struct io_ring *r = pthread_getspecific(ring_key);
+  if(r == NULL) {
+    if((r = _io_ring_new()) == NULL || pthread_setspecific(ring_key, r) != 0) {
+      if(r != NULL)
+        _io_ring_free(r);
+      broken = 1;
+      return NULL;
+    }
+  }
+  return r;
+}
+
+// Takes whatever has completed off of the ring.
+static size_t _io_reap(struct io_ring *r, struct crypto_io *ios){
+  unsigned head = *r->cq_head, tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  size_t done = 0;
+  for(; head != tail; head++, done++) {
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    ios[cqe->user_data].res = cqe->res;
+  }
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  return done;
+}
+
+// Runs up to r->entries requests through the ring. Returns -1, with
+// nothing submitted, if the kernel won't take them at all.
+static int _io_ring_run(struct io_ring *r, struct crypto_io *ios, size_t n){
+  unsigned tail = *r->sq_tail;
+  for(size_t i = 0; i < n; i++, tail++) {
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    ios[i].iov.iov_base = ios[i].buf;
+    ios[i].iov.iov_len  = ios[i].len;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = ios[i].write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd        = ios[i].fd;
+    sqe->addr      = (uintptr_t) &ios[i].iov;
+    sqe->len       = 1;
+    sqe->off       = ios[i].off;
+    sqe->user_data = i;
+    r->sq_array[idx] = idx;
+  }
+  __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+  // Until everything is submitted only wait for one completion, there may
+  // be no more in flight than that.
+  size_t submitted = 0, done = 0;
+  while(done < n) {
+    unsigned submit = n - submitted;
+    unsigned wait   = submit > 0 ? 1 : n - done;
+    int res = syscall(__NR_io_uring_enter, r->fd, submit, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+    if(res >= 0) {
+      submitted += res;
+    } else if(errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      // Entries the kernel didn't take would go out with the next batch,
+      // so the rings are done with.
+      broken = 1;
+      if(submitted == 0)
+        return -1;
+      for(size_t i = submitted; i < n; i++)
+        ios[i].res = -errno;
+      n = submitted;
+    }
+    done += _io_reap(r, ios);
+  }
+  return 0;
+}
+
+#endif
+
+void crypto_io_init(size_t n){
+  depth = n < 1 ? 1 : n > CRYPTO_IO_MAX ? CRYPTO_IO_MAX : n;
+}
+
+void crypto_io_destroy(void){
+#ifdef IO_URING
+  pthread_once(&once, _io_key);
+  if(!broken) {
+    struct io_ring *r = pthread_getspecific(ring_key);
+    if(r != NULL)
+      _io_ring_free(r);
+    pthread_setspecific(ring_key, NULL);
+  }
+#endif
+}
+
+size_t crypto_io_depth(void){
+  return depth;
+}
+
+// Short transfers are finished off with plain pread and pwrite, short
+// reads only where they didn't stop at the end of the file.
+void crypto_io_run(struct crypto_io *ios, size_t n){
+  size_t i = 0;
+
+#ifdef IO_URING
+  struct io_ring *r = depth > 1 && n > 1 ? _io_ring() : NULL;
+  while(r != NULL && i < n) {
+    size_t m = n - i < r->entries ? n - i : r->entries;
+    if(_io_ring_run(r, ios + i, m) < 0)
+      break;
+    i += m;
+  }
+#endif
+
+  for(; i < n; i++)
+    ios[i].res = _io_one(&ios[i]);
+
+  for(i = 0; i < n; i++) {
+    struct crypto_io *io = &ios[i];
+    while(io->res > 0 && (size_t) io->res < io->len) {
+      struct crypto_io rest = *io;
+      rest.buf = (unsigned char *) io->buf + io->res;
+      rest.len = io->len - io->res;
+      rest.off = io->off + io->res;
+      ssize_t more = _io_one(&rest);
+      if(more < 0)
+        io->res = more;
+      else if(more == 0)
+        break;
+      else
+        io->res += more;
+    }
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef CRYPTOFS_IO_H
+#define CRYPTOFS_IO_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stddef.h>
+
+// Batches of reads and writes of backing files, kept in flight together.
+// They go through an io_uring of the calling thread's own, submitted with
+// a single system call, where the kernel has io_uring, and are made one by
+// one with pread and pwrite where it doesn't.
+
+#define CRYPTO_IO_MAX 64
+
+struct crypto_io {
+  int fd;
+  int write;
+  void *buf;
+  size_t len;
+  off_t off;
+  ssize_t res;              // what pread or pwrite would have returned, -errno on failure
+  struct iovec iov;         // for the ring
+};
+
+// Sets how many requests are kept in flight, at most CRYPTO_IO_MAX. Up
+// to 1 makes them one at a time.
+void crypto_io_init(size_t depth);
+void crypto_io_destroy(void);
+size_t crypto_io_depth(void);
+
+// Makes all n requests, crypto_io_depth() at a time, and returns once
+// they are done. They are made in no particular order, so a write mustn't
+// overlap any other request of the batch.
+void crypto_io_run(struct crypto_io *ios, size_t n);
+
+#endif
@@ -0,0 +1,1051 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "src/lowlevel.h"
+
+#ifdef __linux__
+
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "src/cryptofs.h"
+#include "src/volume.h"
+#include "src/control.h"
+#include "src/stats.h"
+#include "src/trace.h"
+#include <fuse_lowlevel.h>
+
+// Every inode the kernel knows about holds an O_PATH descriptor of its
+// backing file, so an operation starts from the file itself instead of
+// walking a path, and renames don't invalidate anything. The kernel
+// counts the lookups it has been answered and hands them back through
+// forget, the inode goes once they are all returned. Node ids are the
+// address of the inode, apart from the root which is always FUSE_ROOT_ID.
+struct crypto_inode {
+  int fd;
+  dev_t dev;
+  ino_t ino;
+  uint64_t nlookup;         // guarded by inodes_lock
+  struct timespec mtime;    // the backing file's as of the last open, guarded by inodes_lock
+  off_t csize;              // and its size
+  struct crypto_inode *next;
+};
+
+// An open directory, readdir picks up where the last call left off.
+struct crypto_ll_dir {
+  DIR *dp;                  // NULL for the control directory
+  off_t offset;
+  struct dirent *entry;     // read but not handed out yet
+  int root;
+};
+
+static struct crypto_inode root = { .fd = -1 };
+// The control directory and what is in it, indexed by CRYPTO_CONTROL_*.
+// They have no backing file and are never forgotten.
+static struct crypto_inode controls[CRYPTO_CONTROL_MISSING] = {
+  { .fd = -1 }, { .fd = -1 }, { .fd = -1 }, { .fd = -1 }
+};
+static struct crypto_inode **inodes;
+static size_t inode_buckets = 1024;
+static size_t inode_count   = 0;
+static pthread_mutex_t inodes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// How long the kernel may trust what we told it, in seconds, and whether
+// it may keep the pages of a file it opens again. The names match what
+// fuse_main takes.
+static struct crypto_ll_options {
+  double entry_timeout;
+  double attr_timeout;
+  double negative_timeout;  // for names that don't exist, 0 doesn't remember them
+  int kernel_cache;         // always keep them
+  int auto_cache;           // keep them if the file didn't change since it was last opened
+} ll_opts = {
+  .entry_timeout    = 1.0,
+  .attr_timeout     = 1.0,
+  .negative_timeout = 0.0,
+  .kernel_cache     = 0,
+  .auto_cache       = 0
+};
+
+#define LL_OPT(t, p) { t, offsetof(struct crypto_ll_options, p), 1 }
+
+static const struct fuse_opt ll_opt_spec[] = {
+  LL_OPT("entry_timeout=%lf", entry_timeout),
+  LL_OPT("attr_timeout=%lf", attr_timeout),
+  LL_OPT("negative_timeout=%lf", negative_timeout),
+  LL_OPT("kernel_cache", kernel_cache),
+  LL_OPT("auto_cache", auto_cache),
+  FUSE_OPT_END
+};
+
+#define LL_FILE(fi) ((struct crypto_file *) (uintptr_t) (fi)->fh)
+#define LL_DIR(fi) ((struct crypto_ll_dir *) (uintptr_t) (fi)->fh)
+#define LL_CONTROL(fi) ((struct crypto_control *) (uintptr_t) (fi)->fh)
+
+// Nothing can be read or written through an O_PATH descriptor, files are
+// reopened by way of /proc instead.
+#define PROC_PATH_MAX 32
+
+static void _crypto_ll_proc(char *buf, int fd){
+  snprintf(buf, PROC_PATH_MAX, "/proc/self/fd/%d", fd);
+}
+
+static struct crypto_inode *_crypto_ll_inode(fuse_ino_t ino){
+  return ino == FUSE_ROOT_ID ? &root : (struct crypto_inode *) (uintptr_t) ino;
+}
+
+static fuse_ino_t _crypto_ll_ino(struct crypto_inode *in){
+  return in == &root ? FUSE_ROOT_ID : (fuse_ino_t) (uintptr_t) in;
+}
+
+// Which CRYPTO_CONTROL_* in is, CRYPTO_CONTROL_NONE for every other inode.
+static int _crypto_ll_control(struct crypto_inode *in){
+  for(int i = CRYPTO_CONTROL_DIR; i < CRYPTO_CONTROL_MISSING; i++)
+    if(in == &controls[i])
+      return i;
+  return CRYPTO_CONTROL_NONE;
+}
+
+// The volume header lives at the top of the encrypted directory, next to
+// the control directory, and nothing goes in that.
+static int _crypto_ll_reserved(struct crypto_inode *parent, const char *name){
+  return (parent == &root && (strcmp(name, CRYPTO_VOLUME_FILE) == 0 || strcmp(name, CRYPTO_CONTROL_NAME) == 0)) ||
+         _crypto_ll_control(parent) != CRYPTO_CONTROL_NONE;
+}
+
+static struct crypto_inode **_crypto_ll_bucket(struct crypto_inode **table, size_t n,
+                                               dev_t dev, ino_t ino){
+  uint64_t h = ((uint64_t) ino ^ ((uint64_t) dev << 7)) * 0x9E3779B97F4A7C15ULL;
+  return &table[(h >> 32) & (n - 1)];
+}
+
+// Doubles the table once it holds more inodes than buckets, a tree with
+// millions of files in the kernel's cache shouldn't walk long chains.
+// Called with inodes_lock held.
+static void _crypto_ll_grow(void){
+  size_t n = inode_buckets * 2;
+  struct crypto_inode **table = calloc(n, sizeof(*table));
+  if(table == NULL)
+    return;
+
+  for(size_t i = 0; i < inode_buckets; i++) {
+    struct crypto_inode *in = inodes[i];
+    while(in != NULL) {
+      struct crypto_inode *next = in->next;
+      struct crypto_inode **b = _crypto_ll_bucket(table, n, in->dev, in->ino);
+      in->next = *b;
+      *b = in;
+      in = next;
+    }
+  }
+  free(inodes);
+  inodes = table;
+  inode_buckets = n;
+}
+
+// Counts a lookup of the file st, opened as fd, against its inode. The
+// descriptor is the inode's from now on, or closed if it already had one.
+static struct crypto_inode *_crypto_ll_remember(int fd, const struct stat *st, int *err){
+  if(st->st_dev == root.dev && st->st_ino == root.ino) {
+    close(fd);
+    return &root;
+  }
+
+  pthread_mutex_lock(&inodes_lock);
+  struct crypto_inode **b = _crypto_ll_bucket(inodes, inode_buckets, st->st_dev, st->st_ino);
+  struct crypto_inode *in = *b;
+  while(in != NULL && (in->ino != st->st_ino || in->dev != st->st_dev))
+    in = in->next;
+
+  if(in != NULL) {
+    in->nlookup++;
+    pthread_mutex_unlock(&inodes_lock);
+    close(fd);
+    return in;
+  }
+
+  if((in = calloc(1, sizeof(*in))) == NULL) {
+    pthread_mutex_unlock(&inodes_lock);
+    close(fd);
+    *err = -ENOMEM;
+    return NULL;
+  }
+  in->fd      = fd;
+  in->dev     = st->st_dev;
+  in->ino     = st->st_ino;
+  in->nlookup = 1;
+  in->next    = *b;
+  *b = in;
+  if(++inode_count > inode_buckets)
+    _crypto_ll_grow();
+  pthread_mutex_unlock(&inodes_lock);
+  return in;
+}
+
+static void _crypto_ll_unref(struct crypto_inode *in, uint64_t n){
+  if(in == &root || _crypto_ll_control(in) != CRYPTO_CONTROL_NONE)
+    return;
+
+  pthread_mutex_lock(&inodes_lock);
+  int gone = (in->nlookup -= n) == 0;
+  if(gone) {
+    struct crypto_inode **p = _crypto_ll_bucket(inodes, inode_buckets, in->dev, in->ino);
+    while(*p != in)
+      p = &(*p)->next;
+    *p = in->next;
+    inode_count--;
+  }
+  pthread_mutex_unlock(&inodes_lock);
+
+  if(gone) {
+    close(in->fd);
+    free(in);
+  }
+}
+
+// Stats the backing file behind fd, with the plaintext size.
+static int _crypto_ll_stat(int fd, struct stat *st){
+  if(fstatat(fd, "", st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1)
+    return -errno;
+
+  char proc[PROC_PATH_MAX];
+  _crypto_ll_proc(proc, fd);
+  return crypto_file_attr(AT_FDCWD, proc, st);
+}
+
+// The attributes of in, with the plaintext size.
+static int _crypto_ll_attr(struct crypto_inode *in, struct stat *st){
+  int which = _crypto_ll_control(in);
+  if(which == CRYPTO_CONTROL_NONE)
+    return _crypto_ll_stat(in->fd, st);
+
+  int err = crypto_control_attr(which, st);
+  st->st_ino = _crypto_ll_ino(in);
+  return err;
+}
+
+static int _crypto_ll_lookup(struct crypto_inode *parent, const char *name,
+                             struct fuse_entry_param *e){
+  int which = CRYPTO_CONTROL_NONE;
+  if(parent == &root && strcmp(name, CRYPTO_CONTROL_NAME) == 0)
+    which = CRYPTO_CONTROL_DIR;
+  else if(_crypto_ll_control(parent) == CRYPTO_CONTROL_DIR)
+    which = crypto_control_name(name);
+  else if(_crypto_ll_control(parent) != CRYPTO_CONTROL_NONE)
+    return -ENOTDIR;
+
+  if(which == CRYPTO_CONTROL_MISSING || (which == CRYPTO_CONTROL_NONE && _crypto_ll_reserved(parent, name)))
+    return -ENOENT;
+  if(which != CRYPTO_CONTROL_NONE) {
+    _crypto_ll_attr(&controls[which], &e->attr);
+    e->ino           = _crypto_ll_ino(&controls[which]);
+    e->attr_timeout  = ll_opts.attr_timeout;
+    e->entry_timeout = ll_opts.entry_timeout;
+    return 0;
+  }
+
+  int fd = openat(parent->fd, name, O_PATH | O_NOFOLLOW);
+  if(fd == -1)
+    return -errno;
+
+  int err = _crypto_ll_stat(fd, &e->attr);
+  if(err < 0) {
+    close(fd);
+    return err;
+  }
+
+  struct crypto_inode *in = _crypto_ll_remember(fd, &e->attr, &err);
+  if(in == NULL)
+    return err;
+
+  e->ino           = _crypto_ll_ino(in);
+  e->attr_timeout  = ll_opts.attr_timeout;
+  e->entry_timeout = ll_opts.entry_timeout;
+  return 0;
+}
+
+// Answers a request that found or made name in parent with its entry.
+// A reply that doesn't reach the kernel must not count as a lookup.
+static void _crypto_ll_entry(fuse_req_t req, struct crypto_inode *parent, const char *name){
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+
+  int err = _crypto_ll_lookup(parent, name, &e);
+  if(err == -ENOENT && ll_opts.negative_timeout > 0) {
+    e.entry_timeout = ll_opts.negative_timeout;
+    fuse_reply_entry(req, &e);
+  } else if(err < 0) {
+    fuse_reply_err(req, -err);
+  } else if(fuse_reply_entry(req, &e) == -ENOENT) {
+    _crypto_ll_unref(_crypto_ll_inode(e.ino), 1);
+  }
+}
+
+static void crypto_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name){
+  _crypto_ll_entry(req, _crypto_ll_inode(parent), name);
+}
+
+static void crypto_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup){
+  _crypto_ll_unref(_crypto_ll_inode(ino), nlookup);
+  fuse_reply_none(req);
+}
+
+#if FUSE_VERSION >= 29
+static void crypto_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets){
+  for(size_t i = 0; i < count; i++)
+    _crypto_ll_unref(_crypto_ll_inode(forgets[i].ino), forgets[i].nlookup);
+  fuse_reply_none(req);
+}
+#endif
+
+static void crypto_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  (void) fi;
+  struct stat st;
+
+  int err = _crypto_ll_attr(_crypto_ll_inode(ino), &st);
+  if(err < 0)
+    fuse_reply_err(req, -err);
+  else
+    fuse_reply_attr(req, &st, ll_opts.attr_timeout);
+}
+
+// Truncates through a handle of our own when the caller has none, the
+// same as crypto_truncate.
+static int _crypto_ll_truncate(const char *proc, off_t off){
+  struct crypto_file *cf;
+  int err = crypto_file_open(AT_FDCWD, proc, O_WRONLY, 0, &cf);
+  if(err < 0)
+    return err;
+
+  err = crypto_file_truncate(cf, off);
+  int res = crypto_file_release(cf);
+  return err < 0 ? err : res;
+}
+
+static void crypto_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                              int to_set, struct fuse_file_info *fi){
+  struct crypto_inode *in = _crypto_ll_inode(ino);
+  // Truncating a control file is what opening it O_TRUNC to write does.
+  if(_crypto_ll_control(in) != CRYPTO_CONTROL_NONE) {
+    if(to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+      fuse_reply_err(req, EACCES);
+    else
+      crypto_ll_getattr(req, ino, fi);
+    return;
+  }
+
+  char proc[PROC_PATH_MAX];
+  _crypto_ll_proc(proc, in->fd);
+  int err = 0;
+
+  if(to_set & FUSE_SET_ATTR_MODE) {
+    if(chmod(proc, attr->st_mode) == -1)
+      err = -errno;
+  }
+
+  if(err == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+    uid_t uid = to_set & FUSE_SET_ATTR_UID ? attr->st_uid : (uid_t) -1;
+    gid_t gid = to_set & FUSE_SET_ATTR_GID ? attr->st_gid : (gid_t) -1;
+    if(fchownat(in->fd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1)
+      err = -errno;
+  }
+
+  if(err == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+    if(fi != NULL && fi->fh != 0)
+      err = crypto_file_truncate(LL_FILE(fi), attr->st_size);
+    else
+      err = _crypto_ll_truncate(proc, attr->st_size);
+  }
+
+  if(err == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+    struct timespec tv[2] = { { 0, UTIME_OMIT }, { 0, UTIME_OMIT } };
+    if(to_set & FUSE_SET_ATTR_ATIME)
+      tv[0] = attr->st_atim;
+    if(to_set & FUSE_SET_ATTR_MTIME)
+      tv[1] = attr->st_mtim;
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+    if(to_set & FUSE_SET_ATTR_ATIME_NOW)
+      tv[0].tv_nsec = UTIME_NOW;
+    if(to_set & FUSE_SET_ATTR_MTIME_NOW)
+      tv[1].tv_nsec = UTIME_NOW;
+#endif
+    if(utimensat(AT_FDCWD, proc, tv, 0) == -1)
+      err = -errno;
+  }
+
+  if(err < 0) {
+    fuse_reply_err(req, -err);
+    return;
+  }
+  crypto_ll_getattr(req, ino, fi);
+}
+
+// todo decrypt buf here
+static void crypto_ll_readlink(fuse_req_t req, fuse_ino_t ino){
+  char buf[PATH_MAX + 1];
+  if(_crypto_ll_control(_crypto_ll_inode(ino)) != CRYPTO_CONTROL_NONE) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+
+  ssize_t res = readlinkat(_crypto_ll_inode(ino)->fd, "", buf, PATH_MAX);
+  if(res == -1) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+
+  buf[res] = '\0';
+  fuse_reply_readlink(req, buf);
+}
+
+static void crypto_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                            mode_t mode, dev_t rdev){
+  struct crypto_inode *dir = _crypto_ll_inode(parent);
+  if(_crypto_ll_reserved(dir, name)) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  int err = S_ISFIFO(mode) ? mkfifoat(dir->fd, name, mode) : mknodat(dir->fd, name, mode, rdev);
+  if(err == -1)
+    fuse_reply_err(req, errno);
+  else
+    _crypto_ll_entry(req, dir, name);
+}
+
+static void crypto_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode){
+  struct crypto_inode *dir = _crypto_ll_inode(parent);
+  if(_crypto_ll_reserved(dir, name)) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  if(mkdirat(dir->fd, name, mode) == -1)
+    fuse_reply_err(req, errno);
+  else
+    _crypto_ll_entry(req, dir, name);
+}
+
+// Link targets are stored the way crypto_symlink stores them, so either
+// frontend can read the other's.
+static void crypto_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                              const char *name){
+  struct crypto_inode *dir = _crypto_ll_inode(parent);
+  if(_crypto_ll_reserved(dir, name)) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  char *target = _crypto_path(link);
+  if(target == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  int err = symlinkat(target, dir->fd, name) == -1 ? errno : 0;
+  free(target);
+  if(err)
+    fuse_reply_err(req, err);
+  else
+    _crypto_ll_entry(req, dir, name);
+}
+
+static void crypto_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name){
+  struct crypto_inode *dir = _crypto_ll_inode(parent);
+  struct stat st;
+
+  int err = 0;
+  if(_crypto_ll_reserved(dir, name))
+    err = dir == &root && strcmp(name, CRYPTO_VOLUME_FILE) == 0 ? ENOENT : EACCES;
+  else if(fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 || unlinkat(dir->fd, name, 0) == -1)
+    err = errno;
+  else
+    crypto_file_forget(&st);
+
+  fuse_reply_err(req, err);
+}
+
+static void crypto_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name){
+  struct crypto_inode *dir = _crypto_ll_inode(parent);
+  int err = 0;
+  if(_crypto_ll_reserved(dir, name))
+    err = EACCES;
+  else if(unlinkat(dir->fd, name, AT_REMOVEDIR) == -1)
+    err = errno;
+  fuse_reply_err(req, err);
+}
+
+static void crypto_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                             fuse_ino_t newparent, const char *newname){
+  struct crypto_inode *from = _crypto_ll_inode(parent);
+  struct crypto_inode *to   = _crypto_ll_inode(newparent);
+  if(_crypto_ll_reserved(from, name) || _crypto_ll_reserved(to, newname)) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  struct stat st;
+  int replaced = fstatat(to->fd, newname, &st, AT_SYMLINK_NOFOLLOW) == 0;
+  int err      = renameat(from->fd, name, to->fd, newname) == -1 ? errno : 0;
+  if(err == 0 && replaced)
+    crypto_file_forget(&st);
+  fuse_reply_err(req, err);
+}
+
+static void crypto_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                           const char *newname){
+  struct crypto_inode *dir = _crypto_ll_inode(newparent);
+  if(_crypto_ll_reserved(dir, newname) || _crypto_ll_control(_crypto_ll_inode(ino)) != CRYPTO_CONTROL_NONE) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  char proc[PROC_PATH_MAX];
+  _crypto_ll_proc(proc, _crypto_ll_inode(ino)->fd);
+  if(linkat(AT_FDCWD, proc, dir->fd, newname, AT_SYMLINK_FOLLOW) == -1)
+    fuse_reply_err(req, errno);
+  else
+    _crypto_ll_entry(req, dir, newname);
+}
+
+// Remembers the backing file's mtime and size as of this open and says
+// whether they are what the last open saw.
+static int _crypto_ll_unchanged(struct crypto_inode *in){
+  struct stat st;
+  if(fstatat(in->fd, "", &st, AT_EMPTY_PATH) == -1)
+    return 0;
+
+  pthread_mutex_lock(&inodes_lock);
+  int same = in->csize == st.st_size && in->mtime.tv_sec == st.st_mtim.tv_sec &&
+             in->mtime.tv_nsec == st.st_mtim.tv_nsec;
+  in->mtime = st.st_mtim;
+  in->csize = st.st_size;
+  pthread_mutex_unlock(&inodes_lock);
+  return same;
+}
+
+static void crypto_ll_init(void *userdata, struct fuse_conn_info *conn){
+  (void) userdata;
+  crypto_conn_init(conn);
+}
+
+// Control files are read through a snapshot taken when they are opened.
+static void _crypto_ll_control_open(fuse_req_t req, int which, struct fuse_file_info *fi){
+  struct crypto_control *ctl;
+  int err = crypto_control_open(which, &ctl);
+  if(err < 0) {
+    fuse_reply_err(req, -err);
+    return;
+  }
+
+  fi->fh        = (uintptr_t) ctl;
+  fi->direct_io = 1;
+  if(fuse_reply_open(req, fi) == -ENOENT)
+    crypto_control_release(ctl);
+}
+
+static void crypto_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  struct crypto_inode *in = _crypto_ll_inode(ino);
+  int which = _crypto_ll_control(in);
+  if(which != CRYPTO_CONTROL_NONE) {
+    _crypto_ll_control_open(req, which, fi);
+    return;
+  }
+
+  char proc[PROC_PATH_MAX];
+  _crypto_ll_proc(proc, in->fd);
+
+  struct crypto_file *cf;
+  int err = crypto_file_open(AT_FDCWD, proc, fi->flags, 0, &cf);
+  if(err < 0) {
+    fuse_reply_err(req, -err);
+    return;
+  }
+
+  if(ll_opts.kernel_cache)
+    fi->keep_cache = 1;
+  else if(ll_opts.auto_cache)
+    fi->keep_cache = _crypto_ll_unchanged(in);
+
+  fi->fh = (uintptr_t) cf;
+  if(fuse_reply_open(req, fi) == -ENOENT)
+    crypto_file_release(cf);
+}
+
+static void crypto_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                             mode_t mode, struct fuse_file_info *fi){
+  struct crypto_inode *dir = _crypto_ll_inode(parent);
+  if(_crypto_ll_reserved(dir, name)) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  struct crypto_file *cf;
+  int err = crypto_file_open(dir->fd, name, fi->flags, mode, &cf);
+  if(err < 0) {
+    fuse_reply_err(req, -err);
+    return;
+  }
+
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  if((err = _crypto_ll_lookup(dir, name, &e)) < 0) {
+    crypto_file_release(cf);
+    fuse_reply_err(req, -err);
+    return;
+  }
+
+  fi->fh = (uintptr_t) cf;
+  if(fuse_reply_create(req, &e, fi) == -ENOENT) {
+    crypto_file_release(cf);
+    _crypto_ll_unref(_crypto_ll_inode(e.ino), 1);
+  }
+}
+
+static void crypto_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                           struct fuse_file_info *fi){
+  char *buf = malloc(size > 0 ? size : 1);
+  if(buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  int res = _crypto_ll_control(_crypto_ll_inode(ino)) != CRYPTO_CONTROL_NONE ?
+            crypto_control_read(LL_CONTROL(fi), buf, size, off) :
+            crypto_file_read(LL_FILE(fi), buf, size, off);
+  if(res < 0)
+    fuse_reply_err(req, -res);
+  else
+    fuse_reply_buf(req, buf, res);
+  free(buf);
+}
+
+static void crypto_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                            off_t off, struct fuse_file_info *fi){
+  int res = _crypto_ll_control(_crypto_ll_inode(ino)) != CRYPTO_CONTROL_NONE ?
+            crypto_control_write(size) : crypto_file_write(LL_FILE(fi), buf, size, off);
+  if(res < 0)
+    fuse_reply_err(req, -res);
+  else
+    fuse_reply_write(req, res);
+}
+
+static void crypto_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  if(_crypto_ll_control(_crypto_ll_inode(ino)) != CRYPTO_CONTROL_NONE)
+    fuse_reply_err(req, 0);
+  else
+    fuse_reply_err(req, -crypto_file_flush(LL_FILE(fi)));
+}
+
+static void crypto_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  if(_crypto_ll_control(_crypto_ll_inode(ino)) != CRYPTO_CONTROL_NONE) {
+    crypto_control_release(LL_CONTROL(fi));
+    fuse_reply_err(req, 0);
+  } else {
+    fuse_reply_err(req, -crypto_file_release(LL_FILE(fi)));
+  }
+}
+
+static void crypto_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                            struct fuse_file_info *fi){
+  if(_crypto_ll_control(_crypto_ll_inode(ino)) != CRYPTO_CONTROL_NONE)
+    fuse_reply_err(req, 0);
+  else
+    fuse_reply_err(req, -crypto_file_fsync(LL_FILE(fi), datasync));
+}
+
+#if FUSE_VERSION >= 29
+static void crypto_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t off, off_t len,
+                                struct fuse_file_info *fi){
+  if(_crypto_ll_control(_crypto_ll_inode(ino)) != CRYPTO_CONTROL_NONE)
+    fuse_reply_err(req, EOPNOTSUPP);
+  else
+    fuse_reply_err(req, -crypto_file_fallocate(LL_FILE(fi), mode, off, len));
+}
+#endif
+
+static void crypto_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  struct crypto_inode *in = _crypto_ll_inode(ino);
+  int which = _crypto_ll_control(in);
+  if(which != CRYPTO_CONTROL_NONE && which != CRYPTO_CONTROL_DIR) {
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+
+  struct crypto_ll_dir *d = calloc(1, sizeof(*d));
+  if(d == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  int fd = -1;
+  if(which == CRYPTO_CONTROL_NONE &&
+     ((fd = openat(in->fd, ".", O_RDONLY | O_DIRECTORY)) == -1 || (d->dp = fdopendir(fd)) == NULL)) {
+    int err = errno;
+    if(fd != -1)
+      close(fd);
+    free(d);
+    fuse_reply_err(req, err);
+    return;
+  }
+
+  d->root = in == &root;
+  fi->fh  = (uintptr_t) d;
+  if(fuse_reply_open(req, fi) == -ENOENT) {
+    if(d->dp != NULL)
+      closedir(d->dp);
+    free(d);
+  }
+}
+
+// The control directory has ".", ".." and then the control files, each
+// entry's offset being its index plus one.
+static size_t _crypto_ll_readdir_control(fuse_req_t req, char *buf, size_t size, off_t off){
+  off_t n = 2;
+  while(crypto_control_names[n - 2] != NULL)
+    n++;
+
+  size_t rem = size;
+  for(off_t i = off; i < n; i++) {
+    const char *name = i == 0 ? "." : i == 1 ? ".." : crypto_control_names[i - 2];
+    struct crypto_inode *in = i == 0 ? &controls[CRYPTO_CONTROL_DIR] :
+                              i == 1 ? &root : &controls[crypto_control_name(name)];
+    struct stat st;
+    if(_crypto_ll_attr(in, &st) < 0) {
+      memset(&st, 0, sizeof(st));
+      st.st_mode = S_IFDIR;
+    }
+    size_t used = fuse_add_direntry(req, buf + size - rem, rem, name, &st, i + 1);
+    if(used > rem)
+      break;
+    rem -= used;
+  }
+  return size - rem;
+}
+
+// With file headers, entries carry full attributes with the plaintext
+// size. The libfuse 2 protocol has no readdirplus to hand them to the
+// kernel as lookups, so it still looks up each name it wants, but those
+// find the header sizes already cached.
+static void crypto_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                              struct fuse_file_info *fi){
+  (void) ino;
+  struct crypto_ll_dir *d = LL_DIR(fi);
+  char *buf = malloc(size > 0 ? size : 1);
+  if(buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  if(d->dp == NULL) {
+    fuse_reply_buf(req, buf, _crypto_ll_readdir_control(req, buf, size, off));
+    free(buf);
+    return;
+  }
+
+  if(off != d->offset) {
+    seekdir(d->dp, off);
+    d->entry  = NULL;
+    d->offset = off;
+  }
+
+  size_t rem = size;
+  int err = 0;
+  for(;;) {
+    if(d->entry == NULL) {
+      errno = 0;
+      if((d->entry = readdir(d->dp)) == NULL) {
+        err = errno;
+        break;
+      }
+    }
+
+    const char *name = d->entry->d_name;
+    if(!(d->root && (strcmp(name, CRYPTO_VOLUME_FILE) == 0 || strcmp(name, CRYPTO_CONTROL_NAME) == 0))) {
+      struct stat st;
+      crypto_file_entry(dirfd(d->dp), name, d->entry->d_ino, d->entry->d_type, &st);
+      size_t used = fuse_add_direntry(req, buf + size - rem, rem, name, &st, d->entry->d_off);
+      // The control directory goes out with "." of the root, under the
+      // same offset, so neither is listed twice or skipped.
+      if(used <= rem && d->root && strcmp(name, ".") == 0) {
+        _crypto_ll_attr(&controls[CRYPTO_CONTROL_DIR], &st);
+        used += fuse_add_direntry(req, buf + size - rem + used, rem - used, CRYPTO_CONTROL_NAME,
+                                  &st, d->entry->d_off);
+      }
+      if(used > rem)
+        break;
+      rem -= used;
+    }
+    d->offset = d->entry->d_off;
+    d->entry  = NULL;
+  }
+
+  // Whatever made it in goes out, an error can wait for the next call.
+  if(err && rem == size)
+    fuse_reply_err(req, err);
+  else
+    fuse_reply_buf(req, buf, size - rem);
+  free(buf);
+}
+
+static void crypto_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  (void) ino;
+  struct crypto_ll_dir *d = LL_DIR(fi);
+  if(d->dp != NULL)
+    closedir(d->dp);
+  free(d);
+  fuse_reply_err(req, 0);
+}
+
+static void crypto_ll_statfs(fuse_req_t req, fuse_ino_t ino){
+  struct crypto_inode *in = _crypto_ll_inode(ino);
+  struct statvfs st;
+  if(fstatvfs(in->fd != -1 ? in->fd : root.fd, &st) == -1)
+    fuse_reply_err(req, errno);
+  else
+    fuse_reply_statfs(req, &st);
+}
+
+static uint64_t _crypto_ll_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Every op is timed into the stats as the op the path frontend would have
+// seen for it, so the counters read the same whichever frontend is used:
+// a lookup is a getattr, a setattr whichever of truncate, chmod or chown
+// it does first. forget and opening and closing directories aren't timed.
+#define LL_TIMED(op, call) do {                     \
+    uint64_t t0 = _crypto_ll_now();                 \
+    call;                                           \
+    crypto_stats_op(op, _crypto_ll_now() - t0);     \
+  } while(0)
+
+static void _crypto_ll_timed_lookup(fuse_req_t req, fuse_ino_t parent, const char *name){
+  LL_TIMED(CRYPTO_TRACE_GETATTR, crypto_ll_lookup(req, parent, name));
+}
+
+static void _crypto_ll_timed_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  LL_TIMED(CRYPTO_TRACE_GETATTR, crypto_ll_getattr(req, ino, fi));
+}
+
+static void _crypto_ll_timed_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                                     int to_set, struct fuse_file_info *fi){
+  unsigned int op = 0;
+  if(to_set & FUSE_SET_ATTR_SIZE)
+    op = fi != NULL ? CRYPTO_TRACE_FTRUNCATE : CRYPTO_TRACE_TRUNCATE;
+  else if(to_set & FUSE_SET_ATTR_MODE)
+    op = CRYPTO_TRACE_CHMOD;
+  else if(to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+    op = CRYPTO_TRACE_CHOWN;
+
+  if(op == 0)
+    crypto_ll_setattr(req, ino, attr, to_set, fi);
+  else
+    LL_TIMED(op, crypto_ll_setattr(req, ino, attr, to_set, fi));
+}
+
+static void _crypto_ll_timed_readlink(fuse_req_t req, fuse_ino_t ino){
+  LL_TIMED(CRYPTO_TRACE_READLINK, crypto_ll_readlink(req, ino));
+}
+
+static void _crypto_ll_timed_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                                   mode_t mode, dev_t rdev){
+  LL_TIMED(CRYPTO_TRACE_MKNOD, crypto_ll_mknod(req, parent, name, mode, rdev));
+}
+
+static void _crypto_ll_timed_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode){
+  LL_TIMED(CRYPTO_TRACE_MKDIR, crypto_ll_mkdir(req, parent, name, mode));
+}
+
+static void _crypto_ll_timed_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                                     const char *name){
+  LL_TIMED(CRYPTO_TRACE_SYMLINK, crypto_ll_symlink(req, link, parent, name));
+}
+
+static void _crypto_ll_timed_unlink(fuse_req_t req, fuse_ino_t parent, const char *name){
+  LL_TIMED(CRYPTO_TRACE_UNLINK, crypto_ll_unlink(req, parent, name));
+}
+
+static void _crypto_ll_timed_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name){
+  LL_TIMED(CRYPTO_TRACE_RMDIR, crypto_ll_rmdir(req, parent, name));
+}
+
+static void _crypto_ll_timed_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                                    fuse_ino_t newparent, const char *newname){
+  LL_TIMED(CRYPTO_TRACE_RENAME, crypto_ll_rename(req, parent, name, newparent, newname));
+}
+
+static void _crypto_ll_timed_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                                  const char *newname){
+  LL_TIMED(CRYPTO_TRACE_LINK, crypto_ll_link(req, ino, newparent, newname));
+}
+
+static void _crypto_ll_timed_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  LL_TIMED(CRYPTO_TRACE_OPEN, crypto_ll_open(req, ino, fi));
+}
+
+static void _crypto_ll_timed_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                                    mode_t mode, struct fuse_file_info *fi){
+  LL_TIMED(CRYPTO_TRACE_CREATE, crypto_ll_create(req, parent, name, mode, fi));
+}
+
+static void _crypto_ll_timed_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                                  struct fuse_file_info *fi){
+  LL_TIMED(CRYPTO_TRACE_READ, crypto_ll_read(req, ino, size, off, fi));
+}
+
+static void _crypto_ll_timed_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                                   off_t off, struct fuse_file_info *fi){
+  LL_TIMED(CRYPTO_TRACE_WRITE, crypto_ll_write(req, ino, buf, size, off, fi));
+}
+
+static void _crypto_ll_timed_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  LL_TIMED(CRYPTO_TRACE_FLUSH, crypto_ll_flush(req, ino, fi));
+}
+
+static void _crypto_ll_timed_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  LL_TIMED(CRYPTO_TRACE_RELEASE, crypto_ll_release(req, ino, fi));
+}
+
+static void _crypto_ll_timed_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                                   struct fuse_file_info *fi){
+  LL_TIMED(CRYPTO_TRACE_FSYNC, crypto_ll_fsync(req, ino, datasync, fi));
+}
+
+#if FUSE_VERSION >= 29
+static void _crypto_ll_timed_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t off, off_t len,
+                                       struct fuse_file_info *fi){
+  LL_TIMED(CRYPTO_TRACE_FALLOCATE, crypto_ll_fallocate(req, ino, mode, off, len, fi));
+}
+#endif
+
+static void _crypto_ll_timed_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                                     struct fuse_file_info *fi){
+  LL_TIMED(CRYPTO_TRACE_READDIR, crypto_ll_readdir(req, ino, size, off, fi));
+}
+
+static void _crypto_ll_timed_statfs(fuse_req_t req, fuse_ino_t ino){
+  LL_TIMED(CRYPTO_TRACE_STATFS, crypto_ll_statfs(req, ino));
+}
+
+static struct fuse_lowlevel_ops crypto_ll_ops = {
+  .init         = crypto_ll_init,
+  .lookup       = _crypto_ll_timed_lookup,
+  .forget       = crypto_ll_forget,
+#if FUSE_VERSION >= 29
+  .forget_multi = crypto_ll_forget_multi,
+#endif
+  .getattr      = _crypto_ll_timed_getattr,
+  .setattr      = _crypto_ll_timed_setattr,
+  .readlink     = _crypto_ll_timed_readlink,
+  .mknod        = _crypto_ll_timed_mknod,
+  .mkdir        = _crypto_ll_timed_mkdir,
+  .symlink      = _crypto_ll_timed_symlink,
+  .unlink       = _crypto_ll_timed_unlink,
+  .rmdir        = _crypto_ll_timed_rmdir,
+  .rename       = _crypto_ll_timed_rename,
+  .link         = _crypto_ll_timed_link,
+  .open         = _crypto_ll_timed_open,
+  .create       = _crypto_ll_timed_create,
+  .read         = _crypto_ll_timed_read,
+  .write        = _crypto_ll_timed_write,
+  .flush        = _crypto_ll_timed_flush,
+  .release      = _crypto_ll_timed_release,
+  .fsync        = _crypto_ll_timed_fsync,
+#if FUSE_VERSION >= 29
+  .fallocate    = _crypto_ll_timed_fallocate,
+#endif
+  .opendir      = crypto_ll_opendir,
+  .readdir      = _crypto_ll_timed_readdir,
+  .releasedir   = crypto_ll_releasedir,
+  .statfs       = _crypto_ll_timed_statfs
+};
+
+static void _crypto_ll_destroy(void){
+  for(size_t i = 0; inodes != NULL && i < inode_buckets; i++) {
+    while(inodes[i] != NULL) {
+      struct crypto_inode *in = inodes[i];
+      inodes[i] = in->next;
+      close(in->fd);
+      free(in);
+    }
+  }
+  free(inodes);
+  inodes = NULL;
+  inode_count = 0;
+  if(root.fd != -1)
+    close(root.fd);
+  root.fd = -1;
+}
+
+int crypto_lowlevel_main(struct fuse_args *args, const char *dir){
+  if(fuse_opt_parse(args, &ll_opts, ll_opt_spec, NULL) == -1)
+    return 1;
+
+  struct stat st;
+  root.fd = open(dir, O_PATH | O_DIRECTORY);
+  if(root.fd == -1 || fstat(root.fd, &st) == -1) {
+    printf("%s: %s\n", dir, strerror(errno));
+    _crypto_ll_destroy();
+    return 1;
+  }
+  root.dev = st.st_dev;
+  root.ino = st.st_ino;
+
+  if((inodes = calloc(inode_buckets, sizeof(*inodes))) == NULL) {
+    printf("could not allocate the inode table\n");
+    _crypto_ll_destroy();
+    return 1;
+  }
+
+  char *mountpoint = NULL;
+  int multithreaded, foreground;
+  int ret = 1;
+  if(fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) {
+    _crypto_ll_destroy();
+    return 1;
+  }
+
+  struct fuse_chan *ch = fuse_mount(mountpoint, args);
+  if(ch != NULL) {
+    struct fuse_session *se = fuse_lowlevel_new(args, &crypto_ll_ops, sizeof(crypto_ll_ops), NULL);
+    if(se != NULL) {
+      if(fuse_set_signal_handlers(se) != -1) {
+        fuse_session_add_chan(se, ch);
+        if(fuse_daemonize(foreground) != -1)
+          ret = (multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se)) == 0 ? 0 : 1;
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+
+  free(mountpoint);
+  _crypto_ll_destroy();
+  return ret;
+}
+
+#else
+
+int crypto_lowlevel_main(struct fuse_args *args, const char *dir){
+  (void) args;
+  (void) dir;
+  printf("the lowlevel frontend is only available on Linux\n");
+  return 1;
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef CRYPTOFS_LOWLEVEL_H
+#define CRYPTOFS_LOWLEVEL_H
+
+struct fuse_args;
+
+// Serves the encrypted directory dir through the inode based low level
+// FUSE API instead of fuse_main, which saves rebuilding and walking a
+// path on every call. Only built on Linux, elsewhere it refuses to run.
+// Returns the process exit status.
+int crypto_lowlevel_main(struct fuse_args *args, const char *dir);
+
+#endif
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <termios.h>
+
+#include "lib/tweetnacl.h"
+#include "src/cryptofs.h"
+#include <fuse.h>
+
+// from: http://www.gnu.org/software/libc/manual/html_node/getpass.html
+static ssize_t _crypto_getpass(char **lineptr, size_t *n, FILE *stream){
+  struct termios old, new;
+  int nread = 0;
+
+  if(isatty(fileno(stream))){
+    if (tcgetattr(fileno(stream), &old) != 0)
+      return -1;
+    new = old;
+    new.c_lflag &= ~ECHO;
+    if (tcsetattr(fileno(stream), TCSAFLUSH, &new) != 0)
+      return -1;
+  }
+
+  nread = getline(lineptr, n, stream);
+
+  if(isatty(fileno(stream)))
+    (void) tcsetattr(fileno(stream), TCSAFLUSH, &old);
+
+  return nread;
+}
+
+int main(int argc, char *argv[]) {
+  if(argc < 3) {
+    printf("not enough arguments, usage: cryptofs <encdir> <mount> [-o cache_mb=N,readahead_kb=N,crypto_threads=N,write_threads=N,io_depth=N,block_size=N,file_headers,holes,cipher=NAME,lowlevel,profile=throughput|metadata-heavy,writeback_cache,trace=FILE]\n");
+    return 1;
+  }
+
+  char *dir = NULL;
+  struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+  for(int i = 0; i < argc; i++) {
+    if(i == 1) {
+      dir = realpath(argv[i], NULL);
+    } else {
+      fuse_opt_add_arg(&args, argv[i]);
+    }
+  }
+
+  if(dir == NULL) {
+    printf("%s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+
+  if(crypto_options_parse(&args) == -1)
+    return 1;
+
+  printf("enter password: ");
+  char *pw = NULL;
+  size_t pwsize = 0;
+  ssize_t nread = _crypto_getpass(&pw, &pwsize, stdin);
+  puts("");
+
+  if(nread < 0){
+    printf("%s\n", strerror(errno));
+    return errno;
+  }
+
+  // The key is the first half of the password's hash.
+  unsigned char hash[crypto_hash_BYTES];
+  crypto_hash(hash, (unsigned char *) pw, nread);
+  memset(pw, 0, nread);
+  free(pw);
+
+  int res = crypto_engine_init(dir, hash);
+  memset(hash, 0, sizeof(hash));
+  free(dir);
+  if(res == -1)
+    return 1;
+
+  int ret = crypto_engine_serve(&args);
+  fuse_opt_free_args(&args);
+  crypto_engine_destroy();
+  return ret;
+}
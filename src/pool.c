@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "src/pool.h"
+
+struct pool_job {
+  void (*fn)(void *arg, size_t i);
+  void *arg;
+  size_t n;
+  size_t next;              // next index to hand out, taken atomically
+  size_t done;              // indices that have run, guarded by lock
+  int active;               // workers holding on to the job, guarded by lock
+  pthread_cond_t finished;
+  struct pool_job *link;
+};
+
+// Work nobody waits on, picked up when there is no job to help with.
+struct pool_task {
+  void (*fn)(void *arg);
+  void *arg;
+  struct pool_task *link;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work  = PTHREAD_COND_INITIALIZER;
+static pthread_once_t once  = PTHREAD_ONCE_INIT;
+static struct pool_job *queue = NULL;
+static struct pool_task *tasks = NULL, **tasks_tail = &tasks;
+static pthread_t *threads = NULL;
+static size_t nthreads = 0, started = 0;
+static int stopping = 0;
+
+// Runs indices of job until there are none left, returning how many.
+static size_t _pool_drain(struct pool_job *job){
+  size_t did = 0, i;
+  while((i = __sync_fetch_and_add(&job->next, 1)) < job->n) {
+    job->fn(job->arg, i);
+    did++;
+  }
+  return did;
+}
+
+// Takes job off of the queue, if it is still there. Called with lock held.
+static void _pool_dequeue(struct pool_job *job){
+  struct pool_job **p = &queue;
+  while(*p != NULL && *p != job)
+    p = &(*p)->link;
+  if(*p != NULL)
+    *p = job->link;
+}
+
+static void *_pool_worker(void *unused){
+  (void) unused;
+
+  pthread_mutex_lock(&lock);
+  for(;;) {
+    while(queue == NULL && tasks == NULL && !stopping)
+      pthread_cond_wait(&work, &lock);
+    if(stopping)
+      break;
+
+    if(queue == NULL) {
+      struct pool_task *task = tasks;
+      if((tasks = task->link) == NULL)
+        tasks_tail = &tasks;
+      pthread_mutex_unlock(&lock);
+
+      task->fn(task->arg);
+      free(task);
+
+      pthread_mutex_lock(&lock);
+      continue;
+    }
+
+    struct pool_job *job = queue;
+    job->active++;
+    pthread_mutex_unlock(&lock);
+
+    size_t did = _pool_drain(job);
+
+    pthread_mutex_lock(&lock);
+    _pool_dequeue(job);
+    job->done += did;
+    if(--job->active == 0 && job->done == job->n)
+      pthread_cond_signal(&job->finished);
+  }
+  pthread_mutex_unlock(&lock);
+
+  return NULL;
+}
+
+static void _pool_start(void){
+  if(nthreads < 2)
+    return;
+
+  threads = calloc(nthreads, sizeof(*threads));
+  if(threads == NULL)
+    return;
+
+  for(started = 0; started < nthreads; started++) {
+    if(pthread_create(&threads[started], NULL, _pool_worker, NULL) != 0)
+      break;
+  }
+}
+
+void crypto_pool_init(size_t threads){
+  nthreads = threads;
+}
+
+void crypto_pool_destroy(void){
+  pthread_mutex_lock(&lock);
+  stopping = 1;
+  pthread_cond_broadcast(&work);
+  pthread_mutex_unlock(&lock);
+
+  for(size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  threads = NULL;
+  started = 0;
+
+  // Tasks may hold on to things that only they let go of.
+  while(tasks != NULL) {
+    struct pool_task *task = tasks;
+    tasks = task->link;
+    task->fn(task->arg);
+    free(task);
+  }
+  tasks_tail = &tasks;
+}
+
+int crypto_pool_submit(void (*fn)(void *arg), void *arg){
+  pthread_once(&once, _pool_start);
+  if(started == 0)
+    return -1;
+
+  struct pool_task *task = malloc(sizeof(*task));
+  if(task == NULL)
+    return -1;
+  task->fn   = fn;
+  task->arg  = arg;
+  task->link = NULL;
+
+  pthread_mutex_lock(&lock);
+  if(stopping) {
+    pthread_mutex_unlock(&lock);
+    free(task);
+    return -1;
+  }
+  *tasks_tail = task;
+  tasks_tail = &task->link;
+  pthread_cond_signal(&work);
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+size_t crypto_pool_size(void){
+  pthread_once(&once, _pool_start);
+  return started;
+}
+
+void crypto_pool_run(size_t n, void (*fn)(void *arg, size_t i), void *arg){
+  pthread_once(&once, _pool_start);
+
+  if(started == 0 || n < 2) {
+    for(size_t i = 0; i < n; i++)
+      fn(arg, i);
+    return;
+  }
+
+  struct pool_job job = {
+    .fn = fn, .arg = arg, .n = n, .next = 0, .done = 0, .active = 0, .link = NULL
+  };
+  pthread_cond_init(&job.finished, NULL);
+
+  pthread_mutex_lock(&lock);
+  struct pool_job **p = &queue;
+  while(*p != NULL)
+    p = &(*p)->link;
+  *p = &job;
+  for(size_t i = 1; i < n && i <= started; i++)
+    pthread_cond_signal(&work);
+  pthread_mutex_unlock(&lock);
+
+  size_t did = _pool_drain(&job);
+
+  pthread_mutex_lock(&lock);
+  _pool_dequeue(&job);
+  job.done += did;
+  while(job.active > 0 || job.done < job.n)
+    pthread_cond_wait(&job.finished, &lock);
+  pthread_mutex_unlock(&lock);
+
+  pthread_cond_destroy(&job.finished);
+}
@@ -0,0 +1,27 @@
+#ifndef CRYPTOFS_POOL_H
+#define CRYPTOFS_POOL_H
+
+#include <stddef.h>
+
+// A fixed set of worker threads that block encryption and decryption are
+// fanned out over. The threads are started on first use, after FUSE has
+// daemonized.
+
+// Sets the number of workers, 0 or 1 runs everything on the caller.
+void crypto_pool_init(size_t threads);
+void crypto_pool_destroy(void);
+
+// Calls fn(arg, i) for every i in [0, n) and returns once all of them
+// have run. The calling thread pitches in as well.
+void crypto_pool_run(size_t n, void (*fn)(void *arg, size_t i), void *arg);
+
+// Queues fn(arg) to run on a worker once it has nothing better to do, and
+// returns without waiting for it. Returns -1, without queueing anything,
+// if there are no workers. Tasks still queued at crypto_pool_destroy run
+// there.
+int crypto_pool_submit(void (*fn)(void *arg), void *arg);
+
+// Workers running, 0 if everything runs on the caller.
+size_t crypto_pool_size(void);
+
+#endif
@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "src/sizes.h"
+
+#ifdef __APPLE__
+#define st_ctim st_ctimespec
+#endif
+
+#define SIZES_LOCKS 16
+
+// Direct mapped, a collision just replaces the older entry.
+struct sizes_entry {
+  dev_t dev;
+  ino_t ino;
+  off_t csize;              // backing file size the entry was stored for
+  struct timespec ctime;    // and its change time
+  off_t size;
+  int used;
+};
+
+static struct sizes_entry *entries = NULL;
+static size_t nentries = 0;
+static pthread_mutex_t locks[SIZES_LOCKS];
+
+static size_t _sizes_slot(dev_t dev, ino_t ino){
+  uint64_t h = ((uint64_t) ino ^ ((uint64_t) dev << 29)) * 0x9E3779B97F4A7C15ULL;
+  return (h >> 17) & (nentries - 1);
+}
+
+static pthread_mutex_t *_sizes_lock(size_t slot){
+  return &locks[slot % SIZES_LOCKS];
+}
+
+int crypto_sizes_init(size_t want){
+  if(want == 0)
+    return 0;
+
+  size_t n = 1;
+  while(n < want)
+    n <<= 1;
+  if((entries = calloc(n, sizeof(*entries))) == NULL)
+    return -1;
+
+  for(int i = 0; i < SIZES_LOCKS; i++)
+    pthread_mutex_init(&locks[i], NULL);
+  nentries = n;
+  return 0;
+}
+
+void crypto_sizes_destroy(void){
+  if(entries == NULL)
+    return;
+  for(int i = 0; i < SIZES_LOCKS; i++)
+    pthread_mutex_destroy(&locks[i]);
+  free(entries);
+  entries  = NULL;
+  nentries = 0;
+}
+
+int crypto_sizes_get(const struct stat *st, off_t *size){
+  if(entries == NULL)
+    return -1;
+
+  size_t slot = _sizes_slot(st->st_dev, st->st_ino);
+  struct sizes_entry *e = &entries[slot];
+  int ret = -1;
+
+  pthread_mutex_lock(_sizes_lock(slot));
+  if(e->used && e->ino == st->st_ino && e->dev == st->st_dev && e->csize == st->st_size &&
+     e->ctime.tv_sec == st->st_ctim.tv_sec && e->ctime.tv_nsec == st->st_ctim.tv_nsec) {
+    *size = e->size;
+    ret = 0;
+  }
+  pthread_mutex_unlock(_sizes_lock(slot));
+
+  return ret;
+}
+
+void crypto_sizes_put(const struct stat *st, off_t size){
+  if(entries == NULL)
+    return;
+
+  size_t slot = _sizes_slot(st->st_dev, st->st_ino);
+  struct sizes_entry *e = &entries[slot];
+
+  pthread_mutex_lock(_sizes_lock(slot));
+  e->dev   = st->st_dev;
+  e->ino   = st->st_ino;
+  e->csize = st->st_size;
+  e->ctime = st->st_ctim;
+  e->size  = size;
+  e->used  = 1;
+  pthread_mutex_unlock(_sizes_lock(slot));
+}
+
+void crypto_sizes_forget(dev_t dev, ino_t ino){
+  if(entries == NULL)
+    return;
+
+  size_t slot = _sizes_slot(dev, ino);
+  struct sizes_entry *e = &entries[slot];
+
+  pthread_mutex_lock(_sizes_lock(slot));
+  if(e->ino == ino && e->dev == dev)
+    e->used = 0;
+  pthread_mutex_unlock(_sizes_lock(slot));
+}
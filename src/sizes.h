@@ -0,0 +1,22 @@
+#ifndef CRYPTOFS_SIZES_H
+#define CRYPTOFS_SIZES_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Plaintext sizes read out of file headers, so that stat doesn't have to
+// open and decrypt the header of a file every time. An entry is only
+// trusted while the backing file's size and change time match what they
+// were when it was stored, so anything that rewrites the file behind our
+// back simply misses.
+
+// Makes room for about entries sizes, 0 disables the cache.
+int crypto_sizes_init(size_t entries);
+void crypto_sizes_destroy(void);
+
+// Sets *size and returns 0 if st has a current entry, -1 otherwise.
+int crypto_sizes_get(const struct stat *st, off_t *size);
+void crypto_sizes_put(const struct stat *st, off_t size);
+void crypto_sizes_forget(dev_t dev, ino_t ino);
+
+#endif
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "src/trace.h"
+#include "src/stats.h"
+
+#define STATS_BUCKETS 40      // bucket b counts calls of 2^b ns up to 2^(b+1)
+
+static const char *counter_names[CRYPTO_STATS_COUNTERS] = {
+  [CRYPTO_STATS_SEALED]          = "blocks_sealed",
+  [CRYPTO_STATS_OPENED]          = "blocks_opened",
+  [CRYPTO_STATS_AUTH_FAILED]     = "auth_failures",
+  [CRYPTO_STATS_HOLES]           = "holes_read",
+  [CRYPTO_STATS_RMW]             = "rmw",
+  [CRYPTO_STATS_CACHE_HITS]      = "cache_hits",
+  [CRYPTO_STATS_CACHE_MISSES]    = "cache_misses",
+  [CRYPTO_STATS_AHEAD]           = "read_ahead",
+  [CRYPTO_STATS_BYTES_READ]      = "bytes_read",
+  [CRYPTO_STATS_BYTES_WRITTEN]   = "bytes_written",
+  [CRYPTO_STATS_BYTES_SEALED]    = "bytes_sealed",
+  [CRYPTO_STATS_PADDING]         = "padding_bytes",
+  [CRYPTO_STATS_BACKING_READ]    = "backing_read",
+  [CRYPTO_STATS_BACKING_WRITTEN] = "backing_written"
+};
+
+struct stats_counts {
+  uint64_t counters[CRYPTO_STATS_COUNTERS];
+  uint64_t calls[CRYPTO_TRACE_OPS][STATS_BUCKETS];
+  uint64_t ns[CRYPTO_TRACE_OPS];
+};
+
+// Only the thread that owns a slot writes to it. When the thread goes
+// the slot is handed to the next new one, counts and all, so nothing
+// counted is ever lost.
+struct stats_slot {
+  struct stats_counts c;
+  int owned;                  // guarded by lock
+  struct stats_slot *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once  = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+static int keyed = 0;
+static struct stats_slot *slots = NULL;
+static struct stats_counts base;  // what the counts were at the last reset, guarded by lock
+
+static void _stats_release(void *arg){
+  struct stats_slot *s = arg;
+  pthread_mutex_lock(&lock);
+  s->owned = 0;
+  pthread_mutex_unlock(&lock);
+}
+
+static void _stats_key(void){
+  keyed = pthread_key_create(&slot_key, _stats_release) == 0;
+}
+
+static struct stats_slot *_stats_slot(void){
+  pthread_once(&once, _stats_key);
+  if(!keyed)
+    return NULL;
+
+  struct stats_slot *s = pthread_getspecific(slot_key);
+  if(s != NULL)
+    return s;
+
+  pthread_mutex_lock(&lock);
+  for(s = slots; s != NULL && s->owned; s = s->next)
+    ;
+  if(s == NULL && posix_memalign((void **) &s, 64, sizeof(*s)) == 0) {
+    memset(s, 0, sizeof(*s));
+    s->next = slots;
+    slots = s;
+  }
+  if(s != NULL)
+    s->owned = 1;
+  pthread_mutex_unlock(&lock);
+
+  if(s != NULL && pthread_setspecific(slot_key, s) != 0) {
+    _stats_release(s);
+    s = NULL;
+  }
+  return s;
+}
+
+static void _stats_bump(uint64_t *c, uint64_t n){
+  __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void crypto_stats_add(unsigned int counter, uint64_t n){
+  struct stats_slot *s = _stats_slot();
+  if(s != NULL && counter < CRYPTO_STATS_COUNTERS)
+    _stats_bump(&s->c.counters[counter], n);
+}
+
+void crypto_stats_op(unsigned int op, uint64_t ns){
+  struct stats_slot *s = _stats_slot();
+  if(s == NULL || op >= CRYPTO_TRACE_OPS)
+    return;
+
+  unsigned int b = 63 - __builtin_clzll(ns | 1);
+  _stats_bump(&s->c.calls[op][b < STATS_BUCKETS ? b : STATS_BUCKETS - 1], 1);
+  _stats_bump(&s->c.ns[op], ns);
+}
+
+// Adds up every slot into sum, called with lock held.
+static void _stats_sum(struct stats_counts *sum){
+  const uint64_t *from;
+  uint64_t *to = (uint64_t *) sum;
+  const size_t n = sizeof(*sum) / sizeof(uint64_t);
+
+  memset(sum, 0, sizeof(*sum));
+  for(struct stats_slot *s = slots; s != NULL; s = s->next) {
+    from = (const uint64_t *) &s->c;
+    for(size_t i = 0; i < n; i++)
+      to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+  }
+}
+
+void crypto_stats_reset(void){
+  pthread_mutex_lock(&lock);
+  _stats_sum(&base);
+  pthread_mutex_unlock(&lock);
+}
+
+// Upper end, in us, of the bucket the call at fraction q of calls falls in.
+static double _stats_quantile(const uint64_t *calls, uint64_t total, double q){
+  uint64_t want = (uint64_t) (q * total), seen = 0;
+  for(unsigned int b = 0; b < STATS_BUCKETS; b++) {
+    seen += calls[b];
+    if(seen > want)
+      return (double) (2ULL << b) / 1e3;
+  }
+  return (double) (2ULL << (STATS_BUCKETS - 1)) / 1e3;
+}
+
+// Latencies are known to within a power of two, quantiles give the upper
+// end of the bucket they fall in.
+ssize_t crypto_stats_render(char **out, int json){
+  struct stats_counts now;
+  pthread_mutex_lock(&lock);
+  _stats_sum(&now);
+  uint64_t *n = (uint64_t *) &now;
+  const uint64_t *b = (const uint64_t *) &base;
+  for(size_t i = 0; i < sizeof(now) / sizeof(uint64_t); i++)
+    n[i] -= b[i];
+  pthread_mutex_unlock(&lock);
+
+  size_t len = 0;
+  FILE *f = open_memstream(out, &len);
+  if(f == NULL)
+    return -ENOMEM;
+
+  // Bytes that went to backing files for every byte written.
+  const uint64_t *c = now.counters;
+  double amp = c[CRYPTO_STATS_BYTES_WRITTEN] > 0 ?
+               (double) c[CRYPTO_STATS_BACKING_WRITTEN] / c[CRYPTO_STATS_BYTES_WRITTEN] : 0;
+
+  if(json)
+    fputs("{\"counters\":{", f);
+  for(unsigned int i = 0; i < CRYPTO_STATS_COUNTERS; i++)
+    fprintf(f, json ? "%s\"%s\":%llu" : "%s%s %llu\n", json && i > 0 ? "," : "", counter_names[i],
+            (unsigned long long) c[i]);
+  fprintf(f, json ? "},\"write_amplification\":%.3f,\"ops\":{" : "write_amplification %.3f\n", amp);
+
+  int first = 1;
+  for(unsigned int op = 1; op < CRYPTO_TRACE_OPS; op++) {
+    uint64_t calls = 0, top = 0;
+    for(unsigned int k = 0; k < STATS_BUCKETS; k++) {
+      calls += now.calls[op][k];
+      if(now.calls[op][k] > 0)
+        top = k;
+    }
+    if(calls == 0)
+      continue;
+
+    const char *name = crypto_trace_op_name(op);
+    double mean = now.ns[op] / 1e3 / calls;
+    double p50  = _stats_quantile(now.calls[op], calls, 0.50);
+    double p99  = _stats_quantile(now.calls[op], calls, 0.99);
+    double max  = (double) (2ULL << top) / 1e3;
+    if(json)
+      fprintf(f, "%s\"%s\":{\"calls\":%llu,\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}",
+              first ? "" : ",", name, (unsigned long long) calls, mean, p50, p99, max);
+    else
+      fprintf(f, "%s.calls %llu\n%s.mean_us %.1f\n%s.p50_us %.1f\n%s.p99_us %.1f\n%s.max_us %.1f\n",
+              name, (unsigned long long) calls, name, mean, name, p50, name, p99, name, max);
+    first = 0;
+  }
+  if(json)
+    fputs("}}\n", f);
+
+  if(fclose(f) != 0) {
+    free(*out);
+    return -ENOMEM;
+  }
+  return len;
+}
@@ -0,0 +1,42 @@
+#ifndef CRYPTOFS_STATS_H
+#define CRYPTOFS_STATS_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+// Counts of what the engine does, and histograms of how long each kind
+// of call takes. Every thread counts into a slot of its own, so counting
+// never takes a lock or fights over a cache line, and the slots are only
+// added up when somebody asks.
+
+enum {
+  CRYPTO_STATS_SEALED,            // blocks encrypted
+  CRYPTO_STATS_OPENED,            // blocks decrypted
+  CRYPTO_STATS_AUTH_FAILED,       // blocks that didn't authenticate, read as -ENXIO
+  CRYPTO_STATS_HOLES,             // blocks read as holes, without decrypting
+  CRYPTO_STATS_RMW,               // partial block writes that decrypted the block first
+  CRYPTO_STATS_CACHE_HITS,
+  CRYPTO_STATS_CACHE_MISSES,
+  CRYPTO_STATS_AHEAD,             // fetches ahead of sequential readers
+  CRYPTO_STATS_BYTES_READ,        // plaintext handed to readers
+  CRYPTO_STATS_BYTES_WRITTEN,     // plaintext taken from writers
+  CRYPTO_STATS_BYTES_SEALED,      // plaintext encrypted, more than was written when blocks are resealed
+  CRYPTO_STATS_PADDING,           // nonce and tag bytes of the blocks sealed
+  CRYPTO_STATS_BACKING_READ,      // bytes read from backing files
+  CRYPTO_STATS_BACKING_WRITTEN,   // bytes written to them
+  CRYPTO_STATS_COUNTERS
+};
+
+void crypto_stats_add(unsigned int counter, uint64_t n);
+
+// Counts a call of op, one of the CRYPTO_TRACE_ ops, that took ns.
+void crypto_stats_op(unsigned int op, uint64_t ns);
+
+// Counts everything from zero again.
+void crypto_stats_reset(void);
+
+// Renders the counts, as lines of text or as JSON, into a buffer the
+// caller frees. Returns its length, or -ENOMEM.
+ssize_t crypto_stats_render(char **out, int json);
+
+#endif
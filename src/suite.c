@@ -0,0 +1,90 @@
+#include <string.h>
+#include <errno.h>
+
+#include "lib/tweetnacl.h"
+#include "src/gcm.h"
+#include "src/chacha.h"
+#include "src/suite.h"
+
+static const char *names[CRYPTO_SUITE_COUNT] = {
+  [CRYPTO_SUITE_XSALSA20_POLY1305]  = "xsalsa20-poly1305",
+  [CRYPTO_SUITE_XAES256_GCM]        = "xaes256-gcm",
+  [CRYPTO_SUITE_XCHACHA20_POLY1305] = "xchacha20-poly1305"
+};
+
+// Only ever written by crypto_suite_init, before any block is sealed.
+static unsigned int suite = CRYPTO_SUITE_XSALSA20_POLY1305;
+static unsigned char suite_key[CRYPTO_SUITE_KEYBYTES];
+static struct crypto_xaes xaes;
+
+int crypto_suite_find(const char *name){
+  for(int i = 0; i < CRYPTO_SUITE_COUNT; i++)
+    if(strcmp(names[i], name) == 0)
+      return i;
+  return -1;
+}
+
+const char *crypto_suite_name(unsigned int id){
+  return id < CRYPTO_SUITE_COUNT ? names[id] : NULL;
+}
+
+int crypto_suite_init(unsigned int id, const unsigned char *key){
+  if(id >= CRYPTO_SUITE_COUNT)
+    return -EINVAL;
+
+  crypto_suite_destroy();
+  suite = id;
+
+  // The volume header is a secretbox under the volume key whatever the
+  // suite, so the other suites get a key of their own.
+  if(id == CRYPTO_SUITE_XSALSA20_POLY1305) {
+    memcpy(suite_key, key, CRYPTO_SUITE_KEYBYTES);
+  } else {
+    unsigned char in[32 + CRYPTO_SUITE_KEYBYTES], hash[crypto_hash_BYTES];
+    memset(in, 0, 32);
+    strcpy((char *) in, names[id]);
+    memcpy(in + 32, key, CRYPTO_SUITE_KEYBYTES);
+    crypto_hash(hash, in, sizeof(in));
+    memcpy(suite_key, hash, CRYPTO_SUITE_KEYBYTES);
+    memset(in, 0, sizeof(in));
+    memset(hash, 0, sizeof(hash));
+  }
+
+  if(id == CRYPTO_SUITE_XAES256_GCM)
+    crypto_xaes_init(&xaes, suite_key);
+  return 0;
+}
+
+void crypto_suite_destroy(void){
+  volatile unsigned char *p = suite_key;
+  for(size_t i = 0; i < sizeof(suite_key); i++)
+    p[i] = 0;
+  crypto_xaes_wipe(&xaes);
+  suite = CRYPTO_SUITE_XSALSA20_POLY1305;
+}
+
+int crypto_suite_seal(unsigned char *c, unsigned char *tag, const unsigned char *m, size_t len,
+                      const unsigned char *n){
+  switch(suite) {
+  case CRYPTO_SUITE_XAES256_GCM:
+    crypto_xaes_seal(&xaes, c, tag, m, len, n);
+    return 0;
+  case CRYPTO_SUITE_XCHACHA20_POLY1305:
+    crypto_chacha_seal(suite_key, c, tag, m, len, n);
+    return 0;
+  default:
+    return crypto_secretbox_detached(c, tag, m, len, n, suite_key);
+  }
+}
+
+int crypto_suite_open(unsigned char *m, const unsigned char *c, const unsigned char *tag, size_t len,
+                      const unsigned char *n){
+  switch(suite) {
+  case CRYPTO_SUITE_XAES256_GCM:
+    return crypto_xaes_open(&xaes, m, c, tag, len, n);
+  case CRYPTO_SUITE_XCHACHA20_POLY1305:
+    return crypto_chacha_open(suite_key, m, c, tag, len, n);
+  default:
+    return crypto_secretbox_open_detached(m, c, tag, len, n, suite_key);
+  }
+}
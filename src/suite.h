@@ -0,0 +1,38 @@
+#ifndef CRYPTOFS_SUITE_H
+#define CRYPTOFS_SUITE_H
+
+#include <stddef.h>
+
+// The AEAD every block and file header of a volume is sealed with, picked
+// when the volume is created and kept in its header. Whatever the suite,
+// a sealed block is laid out the same: a 24 byte nonce, a 16 byte tag and
+// as much ciphertext as there was plaintext. All of them take the whole
+// nonce, so nonces drawn at random never run out under one volume key.
+
+#define CRYPTO_SUITE_XSALSA20_POLY1305  0   // tweetnacl's secretbox, what volumes always used
+#define CRYPTO_SUITE_XAES256_GCM        1   // AES-NI and PCLMULQDQ where the cpu has them
+#define CRYPTO_SUITE_XCHACHA20_POLY1305 2   // vector units only, for cpus without AES-NI
+#define CRYPTO_SUITE_COUNT 3
+
+#define CRYPTO_SUITE_KEYBYTES 32
+#define CRYPTO_SUITE_NONCEBYTES 24
+#define CRYPTO_SUITE_TAGBYTES 16
+
+// The id of the suite called name, -1 if there is none.
+int crypto_suite_find(const char *name);
+// NULL if id isn't a suite.
+const char *crypto_suite_name(unsigned int id);
+
+// Makes id the suite crypto_suite_seal and crypto_suite_open use, with a
+// key derived from key. Returns -EINVAL if id isn't a suite.
+int crypto_suite_init(unsigned int id, const unsigned char *key);
+void crypto_suite_destroy(void);
+
+// Both take the whole 24 byte nonce.
+int crypto_suite_seal(unsigned char *c, unsigned char *tag, const unsigned char *m, size_t len,
+                      const unsigned char *n);
+// -1 if c doesn't authenticate.
+int crypto_suite_open(unsigned char *m, const unsigned char *c, const unsigned char *tag, size_t len,
+                      const unsigned char *n);
+
+#endif
@@ -0,0 +1,362 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "src/stats.h"
+#include "src/trace.h"
+#include <fuse.h>
+
+#define TRACE_BUFFERED 4096   // records written out at once
+
+static const char *op_names[CRYPTO_TRACE_OPS] = {
+  [CRYPTO_TRACE_GETATTR]   = "getattr",
+  [CRYPTO_TRACE_READLINK]  = "readlink",
+  [CRYPTO_TRACE_MKNOD]     = "mknod",
+  [CRYPTO_TRACE_MKDIR]     = "mkdir",
+  [CRYPTO_TRACE_UNLINK]    = "unlink",
+  [CRYPTO_TRACE_RMDIR]     = "rmdir",
+  [CRYPTO_TRACE_SYMLINK]   = "symlink",
+  [CRYPTO_TRACE_RENAME]    = "rename",
+  [CRYPTO_TRACE_LINK]      = "link",
+  [CRYPTO_TRACE_CHMOD]     = "chmod",
+  [CRYPTO_TRACE_CHOWN]     = "chown",
+  [CRYPTO_TRACE_TRUNCATE]  = "truncate",
+  [CRYPTO_TRACE_OPEN]      = "open",
+  [CRYPTO_TRACE_READ]      = "read",
+  [CRYPTO_TRACE_WRITE]     = "write",
+  [CRYPTO_TRACE_STATFS]    = "statfs",
+  [CRYPTO_TRACE_FLUSH]     = "flush",
+  [CRYPTO_TRACE_RELEASE]   = "release",
+  [CRYPTO_TRACE_FSYNC]     = "fsync",
+  [CRYPTO_TRACE_READDIR]   = "readdir",
+  [CRYPTO_TRACE_CREATE]    = "create",
+  [CRYPTO_TRACE_FTRUNCATE] = "ftruncate",
+  [CRYPTO_TRACE_FALLOCATE] = "fallocate"
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int fd = -1;
+static uint64_t started = 0;
+static struct crypto_trace_rec *recs = NULL;
+static size_t nrecs = 0;
+
+static const struct fuse_operations *inner = NULL;
+static struct fuse_operations traced;
+
+static uint64_t _trace_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int _trace_write(int to, const void *buf, size_t len){
+  const char *p = buf;
+  while(len > 0) {
+    ssize_t res = write(to, p, len);
+    if(res == -1 && errno == EINTR)
+      continue;
+    if(res == -1)
+      return -errno;
+    p += res;
+    len -= res;
+  }
+  return 0;
+}
+
+// A trace that can't be written out is given up on, rather than holding
+// up the calls being traced.
+static void _trace_flush(void){
+  if(nrecs > 0 && _trace_write(fd, recs, nrecs * sizeof(*recs)) < 0) {
+    close(fd);
+    __atomic_store_n(&fd, -1, __ATOMIC_RELAXED);
+  }
+  nrecs = 0;
+}
+
+// Every call is timed for the stats, it only takes the lock when there
+// is a trace to record it in.
+static void _trace_add(unsigned int op, uint64_t t0, const char *path, uint64_t arg, uint64_t len,
+                       int flags, uint64_t fh, int res){
+  uint64_t t1 = _trace_now();
+
+  crypto_stats_op(op, t1 - t0);
+  if(__atomic_load_n(&fd, __ATOMIC_RELAXED) == -1)
+    return;
+
+  pthread_mutex_lock(&lock);
+  if(fd != -1) {
+    struct crypto_trace_rec *r = &recs[nrecs++];
+    memset(r, 0, sizeof(*r));
+    r->when    = t0 - started;
+    r->path    = crypto_trace_hash(path);
+    r->arg     = arg;
+    r->len     = len;
+    r->fh      = fh;
+    r->latency = t1 - t0 > UINT32_MAX ? UINT32_MAX : t1 - t0;
+    r->flags   = flags;
+    r->res     = res;
+    r->op      = op;
+    if(nrecs == TRACE_BUFFERED)
+      _trace_flush();
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static int _trace_getattr(const char *path, struct stat *st){
+  uint64_t t0 = _trace_now();
+  int res = inner->getattr(path, st);
+  _trace_add(CRYPTO_TRACE_GETATTR, t0, path, 0, 0, 0, 0, res);
+  return res;
+}
+
+static int _trace_readlink(const char *path, char *buf, size_t size){
+  uint64_t t0 = _trace_now();
+  int res = inner->readlink(path, buf, size);
+  _trace_add(CRYPTO_TRACE_READLINK, t0, path, 0, size, 0, 0, res);
+  return res;
+}
+
+static int _trace_mknod(const char *path, mode_t mode, dev_t dev){
+  uint64_t t0 = _trace_now();
+  int res = inner->mknod(path, mode, dev);
+  _trace_add(CRYPTO_TRACE_MKNOD, t0, path, dev, 0, mode, 0, res);
+  return res;
+}
+
+static int _trace_mkdir(const char *path, mode_t mode){
+  uint64_t t0 = _trace_now();
+  int res = inner->mkdir(path, mode);
+  _trace_add(CRYPTO_TRACE_MKDIR, t0, path, 0, 0, mode, 0, res);
+  return res;
+}
+
+static int _trace_unlink(const char *path){
+  uint64_t t0 = _trace_now();
+  int res = inner->unlink(path);
+  _trace_add(CRYPTO_TRACE_UNLINK, t0, path, 0, 0, 0, 0, res);
+  return res;
+}
+
+static int _trace_rmdir(const char *path){
+  uint64_t t0 = _trace_now();
+  int res = inner->rmdir(path);
+  _trace_add(CRYPTO_TRACE_RMDIR, t0, path, 0, 0, 0, 0, res);
+  return res;
+}
+
+static int _trace_symlink(const char *from, const char *to){
+  uint64_t t0 = _trace_now();
+  int res = inner->symlink(from, to);
+  _trace_add(CRYPTO_TRACE_SYMLINK, t0, to, crypto_trace_hash(from), 0, 0, 0, res);
+  return res;
+}
+
+static int _trace_rename(const char *from, const char *to){
+  uint64_t t0 = _trace_now();
+  int res = inner->rename(from, to);
+  _trace_add(CRYPTO_TRACE_RENAME, t0, from, crypto_trace_hash(to), 0, 0, 0, res);
+  return res;
+}
+
+static int _trace_link(const char *from, const char *to){
+  uint64_t t0 = _trace_now();
+  int res = inner->link(from, to);
+  _trace_add(CRYPTO_TRACE_LINK, t0, from, crypto_trace_hash(to), 0, 0, 0, res);
+  return res;
+}
+
+static int _trace_chmod(const char *path, mode_t mode){
+  uint64_t t0 = _trace_now();
+  int res = inner->chmod(path, mode);
+  _trace_add(CRYPTO_TRACE_CHMOD, t0, path, 0, 0, mode, 0, res);
+  return res;
+}
+
+static int _trace_chown(const char *path, uid_t uid, gid_t gid){
+  uint64_t t0 = _trace_now();
+  int res = inner->chown(path, uid, gid);
+  _trace_add(CRYPTO_TRACE_CHOWN, t0, path, (uint64_t) uid << 32 | (uint32_t) gid, 0, 0, 0, res);
+  return res;
+}
+
+static int _trace_truncate(const char *path, off_t off){
+  uint64_t t0 = _trace_now();
+  int res = inner->truncate(path, off);
+  _trace_add(CRYPTO_TRACE_TRUNCATE, t0, path, off, 0, 0, 0, res);
+  return res;
+}
+
+static int _trace_open(const char *path, struct fuse_file_info *inf){
+  uint64_t t0 = _trace_now();
+  int res = inner->open(path, inf);
+  _trace_add(CRYPTO_TRACE_OPEN, t0, path, 0, 0, inf->flags, res == 0 ? inf->fh : 0, res);
+  return res;
+}
+
+static int _trace_read(const char *path, char *buf, size_t size, off_t off,
+                       struct fuse_file_info *inf){
+  uint64_t t0 = _trace_now();
+  int res = inner->read(path, buf, size, off, inf);
+  _trace_add(CRYPTO_TRACE_READ, t0, path, off, size, 0, inf->fh, res);
+  return res;
+}
+
+static int _trace_write_op(const char *path, const char *buf, size_t size, off_t off,
+                           struct fuse_file_info *inf){
+  uint64_t t0 = _trace_now();
+  int res = inner->write(path, buf, size, off, inf);
+  _trace_add(CRYPTO_TRACE_WRITE, t0, path, off, size, 0, inf->fh, res);
+  return res;
+}
+
+static int _trace_statfs(const char *path, struct statvfs *st){
+  uint64_t t0 = _trace_now();
+  int res = inner->statfs(path, st);
+  _trace_add(CRYPTO_TRACE_STATFS, t0, path, 0, 0, 0, 0, res);
+  return res;
+}
+
+static int _trace_flush_op(const char *path, struct fuse_file_info *inf){
+  uint64_t t0 = _trace_now();
+  int res = inner->flush(path, inf);
+  _trace_add(CRYPTO_TRACE_FLUSH, t0, path, 0, 0, 0, inf->fh, res);
+  return res;
+}
+
+static int _trace_release(const char *path, struct fuse_file_info *inf){
+  uint64_t t0 = _trace_now(), fh = inf->fh;
+  int res = inner->release(path, inf);
+  _trace_add(CRYPTO_TRACE_RELEASE, t0, path, 0, 0, 0, fh, res);
+  return res;
+}
+
+static int _trace_fsync(const char *path, int datasync, struct fuse_file_info *inf){
+  uint64_t t0 = _trace_now();
+  int res = inner->fsync(path, datasync, inf);
+  _trace_add(CRYPTO_TRACE_FSYNC, t0, path, 0, 0, datasync, inf->fh, res);
+  return res;
+}
+
+static int _trace_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off,
+                          struct fuse_file_info *inf){
+  uint64_t t0 = _trace_now();
+  int res = inner->readdir(path, buf, filler, off, inf);
+  _trace_add(CRYPTO_TRACE_READDIR, t0, path, off, 0, 0, inf != NULL ? inf->fh : 0, res);
+  return res;
+}
+
+static int _trace_create(const char *path, mode_t mode, struct fuse_file_info *inf){
+  uint64_t t0 = _trace_now();
+  int res = inner->create(path, mode, inf);
+  _trace_add(CRYPTO_TRACE_CREATE, t0, path, mode, 0, inf->flags, res == 0 ? inf->fh : 0, res);
+  return res;
+}
+
+static int _trace_ftruncate(const char *path, off_t off, struct fuse_file_info *inf){
+  uint64_t t0 = _trace_now();
+  int res = inner->ftruncate(path, off, inf);
+  _trace_add(CRYPTO_TRACE_FTRUNCATE, t0, path, off, 0, 0, inf->fh, res);
+  return res;
+}
+
+#if FUSE_VERSION >= 29
+static int _trace_fallocate(const char *path, int mode, off_t off, off_t len,
+                            struct fuse_file_info *inf){
+  uint64_t t0 = _trace_now();
+  int res = inner->fallocate(path, mode, off, len, inf);
+  _trace_add(CRYPTO_TRACE_FALLOCATE, t0, path, off, len, mode, inf->fh, res);
+  return res;
+}
+#endif
+
+int crypto_trace_open(const char *file){
+  int to = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if(to == -1)
+    return -errno;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  struct crypto_trace_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CRYPTO_TRACE_MAGIC, sizeof(h.magic));
+  h.version  = CRYPTO_TRACE_VERSION;
+  h.rec_size = sizeof(struct crypto_trace_rec);
+  h.started  = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+  int err = _trace_write(to, &h, sizeof(h));
+  if(err == 0 && (recs = malloc(TRACE_BUFFERED * sizeof(*recs))) == NULL)
+    err = -ENOMEM;
+  if(err < 0) {
+    close(to);
+    return err;
+  }
+
+  pthread_mutex_lock(&lock);
+  started = _trace_now();
+  __atomic_store_n(&fd, to, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+void crypto_trace_close(void){
+  pthread_mutex_lock(&lock);
+  if(fd != -1) {
+    _trace_flush();
+    if(fd != -1)
+      close(fd);
+    __atomic_store_n(&fd, -1, __ATOMIC_RELAXED);
+  }
+  free(recs);
+  recs = NULL;
+  pthread_mutex_unlock(&lock);
+}
+
+#define TRACE(op, fn) traced.op = ops->op != NULL ? fn : NULL
+
+const struct fuse_operations *crypto_trace_wrap(const struct fuse_operations *ops){
+  inner  = ops;
+  traced = *ops;
+  TRACE(getattr, _trace_getattr);
+  TRACE(readlink, _trace_readlink);
+  TRACE(mknod, _trace_mknod);
+  TRACE(mkdir, _trace_mkdir);
+  TRACE(unlink, _trace_unlink);
+  TRACE(rmdir, _trace_rmdir);
+  TRACE(symlink, _trace_symlink);
+  TRACE(rename, _trace_rename);
+  TRACE(link, _trace_link);
+  TRACE(chmod, _trace_chmod);
+  TRACE(chown, _trace_chown);
+  TRACE(truncate, _trace_truncate);
+  TRACE(open, _trace_open);
+  TRACE(read, _trace_read);
+  TRACE(write, _trace_write_op);
+  TRACE(statfs, _trace_statfs);
+  TRACE(flush, _trace_flush_op);
+  TRACE(release, _trace_release);
+  TRACE(fsync, _trace_fsync);
+  TRACE(readdir, _trace_readdir);
+  TRACE(create, _trace_create);
+  TRACE(ftruncate, _trace_ftruncate);
+#if FUSE_VERSION >= 29
+  TRACE(fallocate, _trace_fallocate);
+#endif
+  return &traced;
+}
+
+// FNV-1a.
+uint64_t crypto_trace_hash(const char *path){
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for(const unsigned char *p = (const unsigned char *) path; p != NULL && *p != '\0'; p++)
+    h = (h ^ *p) * 0x100000001b3ULL;
+  return h;
+}
+
+const char *crypto_trace_op_name(unsigned int op){
+  return op < CRYPTO_TRACE_OPS ? op_names[op] : NULL;
+}
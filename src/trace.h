@@ -0,0 +1,78 @@
+#ifndef CRYPTOFS_TRACE_H
+#define CRYPTOFS_TRACE_H
+
+#include <stdint.h>
+
+// A recording of the calls the path based frontend served, to replay
+// the workload of a mount somewhere else. A trace is a header followed by
+// one fixed size record per call, in the byte order of the machine that
+// wrote it. Paths only go in hashed, so a trace gives no names away.
+
+#define CRYPTO_TRACE_MAGIC "cfs-trce"
+#define CRYPTO_TRACE_VERSION 1
+
+enum {
+  CRYPTO_TRACE_GETATTR = 1,
+  CRYPTO_TRACE_READLINK,
+  CRYPTO_TRACE_MKNOD,         // flags: mode, arg: rdev
+  CRYPTO_TRACE_MKDIR,         // flags: mode
+  CRYPTO_TRACE_UNLINK,
+  CRYPTO_TRACE_RMDIR,
+  CRYPTO_TRACE_SYMLINK,       // path: the link, arg: hash of where it points
+  CRYPTO_TRACE_RENAME,        // arg: hash of the new path
+  CRYPTO_TRACE_LINK,          // arg: hash of the new path
+  CRYPTO_TRACE_CHMOD,         // flags: mode
+  CRYPTO_TRACE_CHOWN,         // arg: uid << 32 | gid
+  CRYPTO_TRACE_TRUNCATE,      // arg: size
+  CRYPTO_TRACE_OPEN,          // flags: open flags, fh: the new handle
+  CRYPTO_TRACE_READ,          // arg: offset
+  CRYPTO_TRACE_WRITE,         // arg: offset
+  CRYPTO_TRACE_STATFS,
+  CRYPTO_TRACE_FLUSH,
+  CRYPTO_TRACE_RELEASE,
+  CRYPTO_TRACE_FSYNC,         // flags: datasync
+  CRYPTO_TRACE_READDIR,       // arg: offset
+  CRYPTO_TRACE_CREATE,        // flags: open flags, arg: mode, fh: the new handle
+  CRYPTO_TRACE_FTRUNCATE,     // arg: size
+  CRYPTO_TRACE_FALLOCATE,     // flags: mode, arg: offset
+  CRYPTO_TRACE_OPS
+};
+
+struct crypto_trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t rec_size;          // sizeof(struct crypto_trace_rec)
+  uint64_t started;           // wall clock time recording started at, in ns
+};
+
+struct crypto_trace_rec {
+  uint64_t when;              // ns from the start of the trace to the call
+  uint64_t path;              // crypto_trace_hash of the path
+  uint64_t arg;               // what the op says above, 0 otherwise
+  uint64_t len;               // bytes asked for
+  uint64_t fh;                // handle the call was made on, 0 for none
+  uint32_t latency;           // ns the call took, UINT32_MAX if longer
+  int32_t flags;
+  int32_t res;                // what the call returned
+  uint8_t op;
+  uint8_t pad[3];
+};
+
+struct fuse_operations;
+
+// Starts recording to file, which is created or truncated. Returns
+// -errno if it can't.
+int crypto_trace_open(const char *file);
+// Writes out whatever is buffered and stops recording.
+void crypto_trace_close(void);
+
+// An op table that calls the one in ops, which has to stay around, and
+// times each call for the stats once it returns, recording it too while
+// there is a trace open.
+const struct fuse_operations *crypto_trace_wrap(const struct fuse_operations *ops);
+
+uint64_t crypto_trace_hash(const char *path);
+// NULL if op isn't one.
+const char *crypto_trace_op_name(unsigned int op);
+
+#endif
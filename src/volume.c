@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "lib/tweetnacl.h"
+#include "src/suite.h"
+#include "src/volume.h"
+
+// On disk the header is a nonce followed by a secretbox of
+//
+//   "cryptofs" | version (u32) | block_size (u32) | flags (u32) | suite (u32)
+//
+// with integers little endian. Settings are only ever appended, one that
+// is missing from an older header reads as 0. Versions before this one
+// skip settings they don't know, so a volume whose blocks they couldn't
+// open is written as version 2, which they refuse.
+#define VOLUME_MAGIC "cryptofs"
+#define VOLUME_VERSION 1
+#define VOLUME_VERSION_SUITE 2
+#define VOLUME_FIELDS 4
+#define VOLUME_FIELDS_MAX 16
+#define VOLUME_PLAIN(fields) (8 + 4 * (fields))
+#define VOLUME_SIZE(fields) \
+  (crypto_secretbox_NONCEBYTES + crypto_secretbox_BOXZEROBYTES + VOLUME_PLAIN(fields))
+
+static void _volume_put32(unsigned char *p, uint32_t v){
+  for(int i = 0; i < 4; i++)
+    p[i] = v >> (8 * i);
+}
+
+static uint32_t _volume_get32(const unsigned char *p){
+  uint32_t v = 0;
+  for(int i = 0; i < 4; i++)
+    v |= (uint32_t) p[i] << (8 * i);
+  return v;
+}
+
+static char *_volume_path(const char *dir){
+  char *ret;
+  if(asprintf(&ret, "%s/%s", dir, CRYPTO_VOLUME_FILE) == -1)
+    return NULL;
+  return ret;
+}
+
+int crypto_volume_block_ok(size_t block_size){
+  return block_size >= CRYPTO_BLOCK_MIN && block_size <= CRYPTO_BLOCK_MAX &&
+         (block_size & (block_size - 1)) == 0;
+}
+
+int crypto_volume_load(const char *dir, const unsigned char *key, struct crypto_volume *vol){
+  unsigned char raw[VOLUME_SIZE(VOLUME_FIELDS_MAX) + 1];
+  unsigned char cpad[crypto_secretbox_ZEROBYTES + VOLUME_PLAIN(VOLUME_FIELDS_MAX)];
+  unsigned char mpad[crypto_secretbox_ZEROBYTES + VOLUME_PLAIN(VOLUME_FIELDS_MAX)];
+  uint32_t fields[VOLUME_FIELDS_MAX] = { 0 };
+
+  char *path = _volume_path(dir);
+  if(path == NULL)
+    return -ENOMEM;
+  int fd = open(path, O_RDONLY);
+  free(path);
+  if(fd == -1)
+    return -errno;
+
+  ssize_t res = read(fd, raw, sizeof(raw));
+  int err = res == -1 ? -errno : 0;
+  close(fd);
+  if(err < 0)
+    return err;
+  if(res < VOLUME_SIZE(2) || res > VOLUME_SIZE(VOLUME_FIELDS_MAX) || (res - VOLUME_SIZE(0)) % 4 != 0)
+    return -EINVAL;
+
+  size_t clen = res - crypto_secretbox_NONCEBYTES;
+  memset(cpad, 0, crypto_secretbox_BOXZEROBYTES);
+  memcpy(cpad + crypto_secretbox_BOXZEROBYTES, raw + crypto_secretbox_NONCEBYTES, clen);
+  if(crypto_secretbox_open(mpad, cpad, clen + crypto_secretbox_BOXZEROBYTES, raw, key) == -1)
+    return -EINVAL;
+
+  const unsigned char *plain = mpad + crypto_secretbox_ZEROBYTES;
+  size_t nfields = (res - VOLUME_SIZE(0)) / 4;
+  for(size_t i = 0; i < nfields; i++)
+    fields[i] = _volume_get32(plain + 8 + 4 * i);
+  if(memcmp(plain, VOLUME_MAGIC, 8) != 0 ||
+     (fields[0] != VOLUME_VERSION && fields[0] != VOLUME_VERSION_SUITE))
+    return -EINVAL;
+
+  vol->block_size = fields[1];
+  vol->flags      = fields[2];
+  vol->suite      = fields[3];
+  if(!crypto_volume_block_ok(vol->block_size) || (vol->flags & ~CRYPTO_VOLUME_FLAGS) != 0 ||
+     crypto_suite_name(vol->suite) == NULL)
+    return -EINVAL;
+
+  return 0;
+}
+
+int crypto_volume_create(const char *dir, const unsigned char *key, const struct crypto_volume *vol){
+  unsigned char raw[VOLUME_SIZE(VOLUME_FIELDS)];
+  unsigned char mpad[crypto_secretbox_ZEROBYTES + VOLUME_PLAIN(VOLUME_FIELDS)];
+  unsigned char cpad[crypto_secretbox_ZEROBYTES + VOLUME_PLAIN(VOLUME_FIELDS)];
+
+  if(!crypto_volume_block_ok(vol->block_size) || (vol->flags & ~CRYPTO_VOLUME_FLAGS) != 0 ||
+     crypto_suite_name(vol->suite) == NULL)
+    return -EINVAL;
+
+  memset(mpad, 0, crypto_secretbox_ZEROBYTES);
+  unsigned char *plain = mpad + crypto_secretbox_ZEROBYTES;
+  memcpy(plain, VOLUME_MAGIC, 8);
+  _volume_put32(plain + 8, vol->suite == CRYPTO_SUITE_XSALSA20_POLY1305 ?
+                           VOLUME_VERSION : VOLUME_VERSION_SUITE);
+  _volume_put32(plain + 12, vol->block_size);
+  _volume_put32(plain + 16, vol->flags);
+  _volume_put32(plain + 20, vol->suite);
+
+  randombytes(raw, crypto_secretbox_NONCEBYTES);
+  if(crypto_secretbox(cpad, mpad, sizeof(mpad), raw, key) < 0)
+    return -EINVAL;
+  memcpy(raw + crypto_secretbox_NONCEBYTES, cpad + crypto_secretbox_BOXZEROBYTES,
+         sizeof(raw) - crypto_secretbox_NONCEBYTES);
+
+  char *path = _volume_path(dir);
+  if(path == NULL)
+    return -ENOMEM;
+
+  int err = 0;
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if(fd == -1) {
+    free(path);
+    return -errno;
+  }
+
+  ssize_t res = write(fd, raw, sizeof(raw));
+  if(res == -1 || fsync(fd) == -1)
+    err = -errno;
+  else if(res != sizeof(raw))
+    err = -EIO;
+  close(fd);
+
+  // Don't leave a torn header behind, it would lock the volume out.
+  if(err < 0)
+    unlink(path);
+  free(path);
+  return err;
+}
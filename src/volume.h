@@ -0,0 +1,42 @@
+#ifndef CRYPTOFS_VOLUME_H
+#define CRYPTOFS_VOLUME_H
+
+#include <stddef.h>
+
+// Settings fixed when a volume is created. They live sealed under the
+// volume key in a small file at the top of the encrypted directory, which
+// doubles as a check that the password is the right one.
+
+#define CRYPTO_VOLUME_FILE ".cryptofs.volume"
+
+// Block sizes are powers of two in this range, volumes made before the
+// header existed use 4096 byte blocks.
+#define CRYPTO_BLOCK_MIN 4096
+#define CRYPTO_BLOCK_LEGACY 4096
+#define CRYPTO_BLOCK_MAX (1 << 20)
+
+// Every file starts with a sealed header holding its plaintext size.
+#define CRYPTO_VOLUME_HEADERS 0x1
+// Blocks that are nothing but zeros, nonce and tag included, are holes
+// and read as zeros. Only set when asked for, since it lets whoever can
+// write the backing files zero blocks without it being noticed.
+#define CRYPTO_VOLUME_HOLES 0x2
+#define CRYPTO_VOLUME_FLAGS (CRYPTO_VOLUME_HEADERS | CRYPTO_VOLUME_HOLES)
+
+struct crypto_volume {
+  size_t block_size;        // ciphertext bytes per block, nonce and tag included
+  unsigned int flags;       // CRYPTO_VOLUME_*
+  unsigned int suite;       // CRYPTO_SUITE_*, what blocks are sealed with
+};
+
+int crypto_volume_block_ok(size_t block_size);
+
+// Reads the header of the volume in dir. Returns 0, -ENOENT if there is no
+// header or -EINVAL if it does not open under key or has settings we don't
+// understand.
+int crypto_volume_load(const char *dir, const unsigned char *key, struct crypto_volume *vol);
+
+// Writes the header of a new volume, -EEXIST if it already has one.
+int crypto_volume_create(const char *dir, const unsigned char *key, const struct crypto_volume *vol);
+
+#endif
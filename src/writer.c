@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "src/io.h"
+#include "src/writer.h"
+
+struct crypto_write {
+  int fd;
+  unsigned char *buf;
+  size_t len;
+  off_t off;
+  struct crypto_write *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work  = PTHREAD_COND_INITIALIZER;
+static pthread_once_t once  = PTHREAD_ONCE_INIT;
+static struct crypto_writeq *ready = NULL, **ready_tail = &ready;
+static pthread_t *threads = NULL;
+static size_t nthreads = 0, started = 0;
+static size_t queued_max = 0;
+static int stopping = 0;
+
+static int _writer_pwrite(int fd, const unsigned char *buf, size_t len, off_t off){
+  while(len > 0) {
+    ssize_t res = pwrite(fd, buf, len, off);
+    if(res == -1 && errno == EINTR)
+      continue;
+    if(res == -1)
+      return -errno;
+    if(res == 0)
+      return -EIO;
+    buf += res;
+    len -= res;
+    off += res;
+  }
+  return 0;
+}
+
+static int _writer_overlaps(const struct crypto_io *ios, size_t n, const struct crypto_write *w){
+  for(size_t i = 0; i < n; i++) {
+    if(w->off < ios[i].off + (off_t) ios[i].len && ios[i].off < w->off + (off_t) w->len)
+      return 1;
+  }
+  return 0;
+}
+
+// Writes out q until there is nothing left in it. Writes from the front
+// of the queue go out together, up to the first that overlaps one before
+// it, which has to wait for them to land. Whoever waits on the queue may
+// free it as soon as it goes idle, so it isn't touched after.
+static void _writer_run(struct crypto_writeq *q){
+  struct crypto_io ios[CRYPTO_IO_MAX];
+  const size_t depth = crypto_io_depth();
+
+  pthread_mutex_lock(&q->lock);
+  while(q->head != NULL) {
+    size_t n = 0;
+    for(struct crypto_write *w = q->head; w != NULL && n < depth; w = w->next, n++) {
+      if(_writer_overlaps(ios, n, w))
+        break;
+      ios[n].fd    = w->fd;
+      ios[n].write = 1;
+      ios[n].buf   = w->buf;
+      ios[n].len   = w->len;
+      ios[n].off   = w->off;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    crypto_io_run(ios, n);
+
+    pthread_mutex_lock(&q->lock);
+    for(size_t i = 0; i < n; i++) {
+      struct crypto_write *w = q->head;
+      if((q->head = w->next) == NULL)
+        q->tail = &q->head;
+      q->bytes -= w->len;
+      int err = ios[i].res < 0 ? ios[i].res : (size_t) ios[i].res < w->len ? -EIO : 0;
+      if(err < 0 && q->err == 0)
+        q->err = err;
+      free(w->buf);
+      free(w);
+    }
+    pthread_cond_broadcast(&q->moved);
+  }
+  q->busy = 0;
+  pthread_cond_broadcast(&q->moved);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static void *_writer_main(void *unused){
+  (void) unused;
+
+  pthread_mutex_lock(&lock);
+  for(;;) {
+    while(ready == NULL && !stopping)
+      pthread_cond_wait(&work, &lock);
+    if(ready == NULL)
+      break;
+
+    struct crypto_writeq *q = ready;
+    if((ready = q->next) == NULL)
+      ready_tail = &ready;
+    pthread_mutex_unlock(&lock);
+
+    _writer_run(q);
+
+    pthread_mutex_lock(&lock);
+  }
+  pthread_mutex_unlock(&lock);
+
+  return NULL;
+}
+
+static void _writer_start(void){
+  if(nthreads == 0)
+    return;
+
+  threads = calloc(nthreads, sizeof(*threads));
+  if(threads == NULL)
+    return;
+
+  for(started = 0; started < nthreads; started++) {
+    if(pthread_create(&threads[started], NULL, _writer_main, NULL) != 0)
+      break;
+  }
+}
+
+void crypto_writer_init(size_t threads, size_t max_queued){
+  nthreads   = threads;
+  queued_max = max_queued;
+}
+
+// Queues still in line are written out before the threads go.
+void crypto_writer_destroy(void){
+  pthread_mutex_lock(&lock);
+  stopping = 1;
+  pthread_cond_broadcast(&work);
+  pthread_mutex_unlock(&lock);
+
+  for(size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  threads = NULL;
+  started = 0;
+}
+
+void crypto_writeq_init(struct crypto_writeq *q){
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->moved, NULL);
+  q->head  = NULL;
+  q->tail  = &q->head;
+  q->bytes = 0;
+  q->busy  = 0;
+  q->err   = 0;
+  q->next  = NULL;
+}
+
+void crypto_writeq_destroy(struct crypto_writeq *q){
+  crypto_writeq_drain(q);
+  pthread_cond_destroy(&q->moved);
+  pthread_mutex_destroy(&q->lock);
+}
+
+int crypto_writeq_push(struct crypto_writeq *q, int fd, unsigned char *buf, size_t len, off_t off){
+  pthread_once(&once, _writer_start);
+
+  struct crypto_write *w = NULL;
+  if(started == 0 || stopping || (w = malloc(sizeof(*w))) == NULL) {
+    crypto_writeq_drain(q);
+    int err = _writer_pwrite(fd, buf, len, off);
+    free(buf);
+    return err;
+  }
+  w->fd   = fd;
+  w->buf  = buf;
+  w->len  = len;
+  w->off  = off;
+  w->next = NULL;
+
+  pthread_mutex_lock(&q->lock);
+  while(q->bytes > 0 && q->bytes + len > queued_max)
+    pthread_cond_wait(&q->moved, &q->lock);
+  *q->tail = w;
+  q->tail = &w->next;
+  q->bytes += len;
+  if(!q->busy) {
+    q->busy = 1;
+    q->next = NULL;
+    pthread_mutex_lock(&lock);
+    *ready_tail = q;
+    ready_tail = &q->next;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  return 0;
+}
+
+void crypto_writeq_drain(struct crypto_writeq *q){
+  pthread_mutex_lock(&q->lock);
+  while(q->busy)
+    pthread_cond_wait(&q->moved, &q->lock);
+  pthread_mutex_unlock(&q->lock);
+}
+
+int crypto_writeq_error(struct crypto_writeq *q){
+  pthread_mutex_lock(&q->lock);
+  int err = q->err;
+  q->err = 0;
+  pthread_mutex_unlock(&q->lock);
+  return err;
+}
@@ -0,0 +1,48 @@
+#ifndef CRYPTOFS_WRITER_H
+#define CRYPTOFS_WRITER_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// Writes that go to disk behind the caller's back, on threads of their
+// own. Every file has a queue whose writes land one at a time, in the
+// order they were queued, while the queues of different files are written
+// in parallel. The first write of a queue that fails is latched until
+// somebody takes it, the way the kernel reports errors of buffered writes.
+// The threads are started on first use, after FUSE has daemonized.
+
+struct crypto_write;
+
+struct crypto_writeq {
+  pthread_mutex_t lock;
+  pthread_cond_t moved;         // a write landed, or the queue went idle
+  struct crypto_write *head;
+  struct crypto_write **tail;
+  size_t bytes;                 // queued, counting the write being made
+  int busy;                     // waiting for a writer or being written out
+  int err;                      // first failure nobody took yet
+  struct crypto_writeq *next;   // in line for a writer
+};
+
+// Sets the number of writer threads, 0 writes everything on the caller,
+// and how many bytes a file can have queued before pushing blocks.
+void crypto_writer_init(size_t threads, size_t max_queued);
+void crypto_writer_destroy(void);
+
+void crypto_writeq_init(struct crypto_writeq *q);
+void crypto_writeq_destroy(struct crypto_writeq *q);
+
+// Queues len bytes of buf to be written at off of fd, taking buf over,
+// it is freed once written. If it can't be queued the write is made
+// right away, once whatever was queued before it has landed, and its
+// error returned.
+int crypto_writeq_push(struct crypto_writeq *q, int fd, unsigned char *buf, size_t len, off_t off);
+
+// Waits for everything queued so far to land.
+void crypto_writeq_drain(struct crypto_writeq *q);
+
+// Returns the latched error and clears it, 0 if there is none.
+int crypto_writeq_error(struct crypto_writeq *q);
+
+#endif
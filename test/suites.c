@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "src/gcm.h"
+#include "src/chacha.h"
+
+// Known answers for the AEADs the block suites are built on, run by
+// test_suites.t. The short vectors are published ones. The long ones were
+// made with OpenSSL and go through the eight block paths and a partial
+// last block. AES runs both on the instructions, where the cpu has them,
+// and on the portable code.
+
+struct kat {
+  const char *suite;
+  const char *key;
+  const char *nonce;
+  const char *msg;      // NULL for len bytes of i * 7
+  size_t len;
+  const char *ct;
+  const char *tag;
+};
+
+static const struct kat kats[] = {
+  // McGrew and Viega's GCM test case 15.
+  { "gcm",
+    "feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+    "cafebabefacedbaddecaf888",
+    "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+    "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255", 64,
+    "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+    "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662898015ad",
+    "b094dac5d93471bdec1a502270e3cc6c" },
+  { "gcm",
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f",
+    "a0a1a2a3a4a5a6a7a8a9aaab",
+    NULL, 300,
+    "e61f723859e8288e5a5ac19e5321a2b700db27951e24d8cd34a1903bbb60a7d8"
+    "3291a90a5321592c478322e53d41c1b0174c182d0ea360ffc9d19dc300db3709"
+    "747b4bbaec460e110c1df9159bd5ee93fd3c95e18992c31b861a48e73511df0d"
+    "2f23851ebf6d454a4604e0bd7173ef2134477f8bf206a17d678088f9d03e8034"
+    "45963eea4fe12aa68fe63846c691733f782e536eb2c3e0add5e28bc8eb8c6672"
+    "a67f71c4cae9ca871a958d8fdb697428a7f1237dee95543f8a8d602478a92d6e"
+    "7471029c3cb2d19c8b22c642ddbf901ce25e5a2df3b00259052eae1859cdc87e"
+    "48761c14852e936e98e324323670c2f69b2a5c9a25e1ca46a3627bb781d8da6b"
+    "1738c792f3ef88d15e9c11c833600eba486674d53729598b50c8a067267b56f4"
+    "7bafa857dc0177dcfd726801",
+    "7d74f5505cb5b5ec58b1d4503e545c5b" },
+  // c2sp.org/XAES-256-GCM, the first vector, which has no associated data.
+  { "xaes",
+    "0101010101010101010101010101010101010101010101010101010101010101",
+    "4142434445464748494a4b4c4d4e4f505152535455565758",
+    "584145532d3235362d47434d", 12,
+    "ce546ef63c9cc60765923609",
+    "b33a9a1974e96e52daf2fcf7075e2271" },
+  { "xaes",
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f",
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7",
+    NULL, 300,
+    "ccab54e1b3f4c42bde39c64f646bac68e44abfbe1aa2d3fff208983b12bc78c8"
+    "79d27e52ae1b2d5b5f1baeb88b36e79be43f8ba842d58df20bc13f386e202832"
+    "5ce8da82b2e522733e1c44a67890a6a9e259a25f16eb07dfacf001cabb5a9a09"
+    "e9eb2e902536890b294d0e1234c253af30fda78e6c53b974d415338ac4359aab"
+    "267489972828270c37cb2e61a315e0d10356a0ff57532339ec4e72d245d6ad03"
+    "956056fe67c4dcb79b020563ceff1119a45b4fe257b015cd5b49f199378219f3"
+    "c9912fb1a3dab67a326ef259731f77e056ab37cbe301e9d68ffca1f5ac4da97a"
+    "d70cd952ddd470ff45cbeb689207fa9d311a93fe927f8f3c94eb36997b13022d"
+    "2914b25487e31589a04256b9629780712350aa2af2c0eeaf2d2313334587a4ee"
+    "2cb527b53cb0f264cccbbc6e",
+    "cafe48d4865e3008f78f64d10961747c" },
+  // draft-irtf-cfrg-xchacha A.3.1. The ciphertext is the draft's, the tag
+  // is over it without the draft's associated data. The key goes through
+  // HChaCha20 first, so this checks that too.
+  { "xchacha",
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f",
+    "404142434445464748494a4b4c4d4e4f5051525354555657",
+    "4c616469657320616e642047656e746c656d656e206f662074686520636c6173"
+    "73206f66202739393a204966204920636f756c64206f6666657220796f75206f"
+    "6e6c79206f6e652074697020666f7220746865206675747572652c2073756e73"
+    "637265656e20776f756c642062652069742e", 114,
+    "bd6d179d3e83d43b9576579493c0e939572a1700252bfaccbed2902c21396cbb"
+    "731c7f1b0b4aa6440bf3a82f4eda7e39ae64c6708c54c216cb96b72e1213b452"
+    "2f8c9ba40db5d945b11b69b982c1bb9e3f3fac2bc369488f76b2383565d3fff9"
+    "21f9664c97637da9768812f615c68b13b52e",
+    "f7e62efbf45089db18f9c8a3f0e41e5f" },
+  { NULL }
+};
+
+static void unhex(unsigned char *out, const char *hex, size_t len){
+  for(size_t i = 0; i < len; i++)
+    sscanf(hex + 2 * i, "%2hhx", out + i);
+}
+
+static void kat_seal(const struct kat *t, int hw, const unsigned char *key, unsigned char *c,
+                     unsigned char *tag, const unsigned char *m, const unsigned char *n){
+  if(strcmp(t->suite, "gcm") == 0) {
+    struct crypto_gcm g;
+    crypto_gcm_init(&g, key);
+    g.hw &= hw;
+    crypto_gcm_seal(&g, c, tag, m, t->len, n);
+  } else if(strcmp(t->suite, "xaes") == 0) {
+    struct crypto_xaes x;
+    crypto_xaes_init(&x, key);
+    x.hw &= hw;
+    crypto_xaes_seal(&x, c, tag, m, t->len, n);
+  } else {
+    crypto_chacha_seal(key, c, tag, m, t->len, n);
+  }
+}
+
+static int kat_open(const struct kat *t, int hw, const unsigned char *key, unsigned char *m,
+                    const unsigned char *c, const unsigned char *tag, const unsigned char *n){
+  if(strcmp(t->suite, "gcm") == 0) {
+    struct crypto_gcm g;
+    crypto_gcm_init(&g, key);
+    g.hw &= hw;
+    return crypto_gcm_open(&g, m, c, tag, t->len, n);
+  } else if(strcmp(t->suite, "xaes") == 0) {
+    struct crypto_xaes x;
+    crypto_xaes_init(&x, key);
+    x.hw &= hw;
+    return crypto_xaes_open(&x, m, c, tag, t->len, n);
+  }
+  return crypto_chacha_open(key, m, c, tag, t->len, n);
+}
+
+int main(int argc, char *argv[]){
+  if(argc != 2) return -1;
+
+  int failed = 0, ran = 0;
+  for(const struct kat *t = kats; t->suite != NULL; t++) {
+    if(strcmp(t->suite, argv[1]) != 0)
+      continue;
+
+    unsigned char key[32], n[24], m[1024], want[1024], c[1024], tag[16], wtag[16];
+    unhex(key, t->key, 32);
+    unhex(n, t->nonce, strlen(t->nonce) / 2);
+    unhex(want, t->ct, t->len);
+    unhex(wtag, t->tag, 16);
+    for(size_t i = 0; i < t->len; i++)
+      m[i] = i * 7;
+    if(t->msg != NULL)
+      unhex(m, t->msg, t->len);
+
+    for(int hw = 1; hw >= 0; hw--) {
+      unsigned char out[1024];
+      kat_seal(t, hw, key, c, tag, m, n);
+      if(memcmp(c, want, t->len) != 0 || memcmp(tag, wtag, 16) != 0) {
+        printf("%s %zu bytes hw=%d: wrong seal\n", t->suite, t->len, hw);
+        failed = 1;
+      }
+      if(kat_open(t, hw, key, out, want, wtag, n) != 0 || memcmp(out, m, t->len) != 0) {
+        printf("%s %zu bytes hw=%d: wrong open\n", t->suite, t->len, hw);
+        failed = 1;
+      }
+      wtag[15] ^= 1;
+      if(kat_open(t, hw, key, out, want, wtag, n) != -1) {
+        printf("%s %zu bytes hw=%d: forged tag opened\n", t->suite, t->len, hw);
+        failed = 1;
+      }
+      wtag[15] ^= 1;
+    }
+    ran++;
+  }
+
+  if(ran == 0)
+    printf("no vectors for %s\n", argv[1]);
+  return failed || ran == 0;
+}
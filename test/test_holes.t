@@ -0,0 +1,32 @@
+#! /usr/bin/env bash
+# set -x
+dir=`dirname $0`
+. ${dir}/utils.sh
+cd `dirname ${0}`
+
+# Like test_truncate.t, every change is made to a plain copy in ./ref as
+# well. The ranges start and end inside the 4056 bytes of a block and
+# cover whole ones in between. @ stands for the file.
+both(){
+  echo "${1//@/./ref/f} && ${1//@/./two/f} && cmp ./ref/f ./two/f"
+}
+
+volume(){
+  mkdir -p ./one ./two ./ref
+  expect "echo 'pass' | ../build/cryptofs ./one ./two ${1}"
+  expect "head -c 10000 /dev/urandom > ./ref/f && cp ./ref/f ./two/f && cmp ./ref/f ./two/f"
+  # A write far past the end leaves a hole in between.
+  expect "head -c 3000 /dev/urandom > ./ref/tail && `both "dd if=./ref/tail of=@ bs=3000 seek=10 conv=notrunc status=none"`"
+  expect "`both "fallocate -o 40000 -l 20000 @"`"
+  expect "`both "fallocate -n -o 60000 -l 9000 @"`"
+  expect "`both "fallocate -p -o 2000 -l 25000 @"`"
+  expect "`both "fallocate -z -o 28000 -l 5000 @"`"
+  umount ./two
+  expect "echo 'pass' | ../build/cryptofs ./one ./two && cmp ./ref/f ./two/f"
+  umount ./two
+  rm -rf ./one ./two ./ref
+}
+
+echo "1..16"
+volume
+volume "-o holes"
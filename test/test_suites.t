@@ -0,0 +1,9 @@
+#! /usr/bin/env bash
+dir=`dirname $0`
+. ${dir}/utils.sh
+cd `dirname ${0}`
+
+echo "1..3"
+expect "../build/cryptofs-kat gcm"
+expect "../build/cryptofs-kat xaes"
+expect "../build/cryptofs-kat xchacha"
@@ -0,0 +1,32 @@
+#! /usr/bin/env bash
+# set -x
+dir=`dirname $0`
+. ${dir}/utils.sh
+cd `dirname ${0}`
+
+# Every size change is made to a plain copy in ./ref as well, which the
+# mount has to read back the same, zeros and all, before and after it is
+# mounted again. 4056 bytes fit in a block.
+resize(){
+  echo "truncate -s ${1} ./ref/f && truncate -s ${1} ./two/f && cmp ./ref/f ./two/f"
+}
+
+volume(){
+  mkdir -p ./one ./two ./ref
+  expect "echo 'pass' | ../build/cryptofs ./one ./two ${1}"
+  expect "head -c 20000 /dev/urandom > ./ref/f && cp ./ref/f ./two/f && cmp ./ref/f ./two/f"
+  expect "`resize 10000`"
+  expect "`resize 30000`"
+  expect "`resize 4056`"
+  expect "`resize 9000`"
+  expect "`resize 0`"
+  expect "`resize 5000`"
+  umount ./two
+  expect "echo 'pass' | ../build/cryptofs ./one ./two && cmp ./ref/f ./two/f"
+  umount ./two
+  rm -rf ./one ./two ./ref
+}
+
+echo "1..18"
+volume
+volume "-o file_headers"